@@ -0,0 +1,482 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include "branch-bloom.h"
+
+/* The file is laid out as follows, with all integers stored big-endian:
+ *
+ *   "BFB1"                     Signature
+ *   uint32 nfilters
+ *   filters[nfilters]          Sorted by name:
+ *       uint16 length
+ *       char name[length]
+ *       uint8 tip[20]
+ *       uint32 count           The number of commits in the filter
+ *       uint32 nblocks         A power of two
+ *       uint8 blocks[nblocks * 8]
+ */
+
+#define BLOOM_SIGNATURE                 "BFB1"
+#define BLOOM_HEADER_SIZE               8
+#define BLOOM_BLOCK_SIZE                8
+/* The number of bits set for each commit */
+#define BLOOM_HASHES                    6
+/* The number of bits per commit below which a filter is rebuilt; new filters
+ * are sized for twice as many commits as they hold, to leave room to grow
+ */
+#define BLOOM_BITS_PER_COMMIT           10
+#define BLOOM_MIN_BLOCKS                16
+
+struct bloom_filter_struct
+{
+	char *name;
+	git_oid tip;
+	uint32_t count;
+	uint32_t nblocks;
+	/* Either within the loaded file or allocated for the filter */
+	unsigned char *blocks;
+	int allocated;
+	/* Whether the filter has been obtained, or changed, since loading; a
+	 * loaded filter which wasn't obtained is also marked as used when it's
+	 * carried forward by branch_bloom_write()
+	 */
+	int used;
+	int changed;
+};
+
+struct branch_bloom_struct
+{
+	unsigned char *buf;
+	size_t size;
+	struct bloom_filter_struct *filters;
+	size_t nfilters;
+	size_t nalloc;
+	/* The number of filters loaded, which are in name order */
+	size_t nloaded;
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+/* Determine the path to a repository's branch filters */
+static char *
+bloom_path(git_repository *repo)
+{
+	const char *gitdir;
+	char *path;
+
+	gitdir = git_repository_path(repo);
+	path = (char *) xalloc(strlen(gitdir) + strlen(BLOOM_FILENAME) + 8);
+	strcpy(path, gitdir);
+	if(path[0] && path[strlen(path) - 1] != '/')
+	{
+		strcat(path, "/");
+	}
+	strcat(path, BLOOM_FILENAME);
+	return path;
+}
+
+static int
+filter_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct bloom_filter_struct *) a)->name, ((const struct bloom_filter_struct *) b)->name);
+}
+
+/* Add a commit to a filter: the first four bytes of its ID select the block,
+ * and each of the following bytes one of the block's bits
+ */
+static void
+bloom_add(struct bloom_filter_struct *filter, const git_oid *oid)
+{
+	unsigned char *block;
+	int c;
+
+	block = filter->blocks + (size_t) (get32(oid->id) & (filter->nblocks - 1)) * BLOOM_BLOCK_SIZE;
+	for(c = 0; c < BLOOM_HASHES; c++)
+	{
+		block[(oid->id[4 + c] >> 3) & 7] |= 1 << (oid->id[4 + c] & 7);
+	}
+	filter->count++;
+}
+
+/* Test whether a commit may be in a filter, returning 0 if it certainly
+ * isn't
+ */
+int
+bloom_filter_test(const BLOOM_FILTER *filter, const git_oid *oid)
+{
+	const unsigned char *block;
+	int c;
+
+	block = filter->blocks + (size_t) (get32(oid->id) & (filter->nblocks - 1)) * BLOOM_BLOCK_SIZE;
+	for(c = 0; c < BLOOM_HASHES; c++)
+	{
+		if(!(block[(oid->id[4 + c] >> 3) & 7] & (1 << (oid->id[4 + c] & 7))))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Load a repository's branch filters, returning an empty set if there aren't
+ * any (or the file isn't valid)
+ */
+BRANCH_BLOOM *
+branch_bloom_open(git_repository *repo)
+{
+	BRANCH_BLOOM *bloom;
+	struct bloom_filter_struct *filter;
+	char *path;
+	FILE *f;
+	long size;
+	const unsigned char *p, *end;
+	uint32_t c, count, len;
+
+	bloom = (BRANCH_BLOOM *) xalloc(sizeof(BRANCH_BLOOM));
+	path = bloom_path(repo);
+	f = fopen(path, "rb");
+	free(path);
+	if(!f)
+	{
+		return bloom;
+	}
+	if(fseek(f, 0, SEEK_END) || (size = ftell(f)) < BLOOM_HEADER_SIZE || fseek(f, 0, SEEK_SET))
+	{
+		fclose(f);
+		return bloom;
+	}
+	bloom->buf = (unsigned char *) xalloc(size);
+	bloom->size = size;
+	if(fread(bloom->buf, size, 1, f) != 1 || memcmp(bloom->buf, BLOOM_SIGNATURE, 4))
+	{
+		fclose(f);
+		free(bloom->buf);
+		bloom->buf = NULL;
+		return bloom;
+	}
+	fclose(f);
+	p = bloom->buf + BLOOM_HEADER_SIZE;
+	end = bloom->buf + bloom->size;
+	count = get32(bloom->buf + 4);
+	bloom->nalloc = count + 1;
+	bloom->filters = (struct bloom_filter_struct *) xalloc(bloom->nalloc * sizeof(struct bloom_filter_struct));
+	for(c = 0; c < count; c++)
+	{
+		if(end - p < 2)
+		{
+			break;
+		}
+		len = (uint32_t) p[0] << 8 | p[1];
+		p += 2;
+		if((size_t) (end - p) < len + GIT_OID_RAWSZ + 8)
+		{
+			break;
+		}
+		filter = &(bloom->filters[c]);
+		filter->name = (char *) xalloc(len + 1);
+		memcpy(filter->name, p, len);
+		p += len;
+		git_oid_fromraw(&(filter->tip), p);
+		p += GIT_OID_RAWSZ;
+		filter->count = get32(p);
+		filter->nblocks = get32(p + 4);
+		p += 8;
+		if(!filter->nblocks || (filter->nblocks & (filter->nblocks - 1)) || (size_t) (end - p) / BLOOM_BLOCK_SIZE < filter->nblocks)
+		{
+			free(filter->name);
+			break;
+		}
+		filter->blocks = (unsigned char *) p;
+		p += (size_t) filter->nblocks * BLOOM_BLOCK_SIZE;
+	}
+	bloom->nfilters = c;
+	bloom->nloaded = c;
+	return bloom;
+}
+
+/* Free a set of branch filters */
+void
+branch_bloom_close(BRANCH_BLOOM *bloom)
+{
+	size_t c;
+
+	if(!bloom)
+	{
+		return;
+	}
+	for(c = 0; c < bloom->nfilters; c++)
+	{
+		free(bloom->filters[c].name);
+		if(bloom->filters[c].allocated)
+		{
+			free(bloom->filters[c].blocks);
+		}
+	}
+	free(bloom->filters);
+	free(bloom->buf);
+	free(bloom);
+}
+
+/* Collect the commits reachable from tip, but not from hide (if it isn't
+ * NULL); returns NULL on error
+ */
+static git_oid *
+collect_commits(git_repository *repo, const git_oid *tip, const git_oid *hide, size_t *count)
+{
+	git_revwalk *walker;
+	git_oid *commits, oid;
+	size_t nalloc;
+
+	*count = 0;
+	if(git_revwalk_new(&walker, repo))
+	{
+		return NULL;
+	}
+	if(git_revwalk_push(walker, tip) || (hide && git_revwalk_hide(walker, hide)))
+	{
+		git_revwalk_free(walker);
+		return NULL;
+	}
+	nalloc = 1024;
+	commits = (git_oid *) xalloc(nalloc * sizeof(git_oid));
+	while(!git_revwalk_next(&oid, walker))
+	{
+		if(*count == nalloc)
+		{
+			nalloc *= 2;
+			commits = (git_oid *) xrealloc(commits, nalloc * sizeof(git_oid));
+		}
+		git_oid_cpy(&(commits[(*count)++]), &oid);
+	}
+	git_revwalk_free(walker);
+	return commits;
+}
+
+/* Replace a filter's contents with a filter sized for count commits (plus
+ * room to grow), adding the given commits to it
+ */
+static void
+bloom_rebuild(struct bloom_filter_struct *filter, const git_oid *commits, size_t count)
+{
+	size_t c;
+
+	if(filter->allocated)
+	{
+		free(filter->blocks);
+	}
+	filter->nblocks = BLOOM_MIN_BLOCKS;
+	while((size_t) filter->nblocks * BLOOM_BLOCK_SIZE * 8 < count * BLOOM_BITS_PER_COMMIT * 2)
+	{
+		filter->nblocks *= 2;
+	}
+	filter->blocks = (unsigned char *) xalloc((size_t) filter->nblocks * BLOOM_BLOCK_SIZE);
+	memset(filter->blocks, 0, (size_t) filter->nblocks * BLOOM_BLOCK_SIZE);
+	filter->allocated = 1;
+	filter->count = 0;
+	for(c = 0; c < count; c++)
+	{
+		bloom_add(filter, &(commits[c]));
+	}
+}
+
+/* Obtain the filter for a branch, bringing it up to date with the branch's
+ * current tip if necessary; returns NULL on error
+ */
+const BLOOM_FILTER *
+branch_bloom_get(BRANCH_BLOOM *bloom, git_repository *repo, const COMMIT_GRAPH *graph, const char *name, const git_oid *tip)
+{
+	struct bloom_filter_struct key, *filter;
+	unsigned char *blocks;
+	git_oid *commits;
+	size_t c, count;
+
+	filter = NULL;
+	if(bloom->nloaded)
+	{
+		key.name = (char *) name;
+		filter = (struct bloom_filter_struct *) bsearch(&key, bloom->filters, bloom->nloaded, sizeof(struct bloom_filter_struct), filter_cmp);
+	}
+	if(!filter)
+	{
+		if(bloom->nfilters == bloom->nalloc)
+		{
+			bloom->nalloc = bloom->nalloc ? bloom->nalloc * 2 : 64;
+			bloom->filters = (struct bloom_filter_struct *) xrealloc(bloom->filters, bloom->nalloc * sizeof(struct bloom_filter_struct));
+		}
+		filter = &(bloom->filters[bloom->nfilters++]);
+		memset(filter, 0, sizeof(struct bloom_filter_struct));
+		filter->name = xstrdup(name);
+	}
+	filter->used = 1;
+	if(filter->blocks && !git_oid_cmp(&(filter->tip), tip))
+	{
+		return filter;
+	}
+	commits = NULL;
+	if(filter->blocks && commit_reachable(graph, repo, tip, &(filter->tip)) == 1)
+	{
+		/* The branch has moved forward: add the new commits if there's room */
+		commits = collect_commits(repo, tip, &(filter->tip), &count);
+		if(commits && ((size_t) filter->nblocks * BLOOM_BLOCK_SIZE * 8) / BLOOM_BITS_PER_COMMIT >= filter->count + count)
+		{
+			if(!filter->allocated)
+			{
+				blocks = (unsigned char *) xalloc((size_t) filter->nblocks * BLOOM_BLOCK_SIZE);
+				memcpy(blocks, filter->blocks, (size_t) filter->nblocks * BLOOM_BLOCK_SIZE);
+				filter->blocks = blocks;
+				filter->allocated = 1;
+			}
+			for(c = 0; c < count; c++)
+			{
+				bloom_add(filter, &(commits[c]));
+			}
+			free(commits);
+			git_oid_cpy(&(filter->tip), tip);
+			filter->changed = 1;
+			return filter;
+		}
+		free(commits);
+	}
+	commits = collect_commits(repo, tip, NULL, &count);
+	if(!commits)
+	{
+		filter->used = 0;
+		return NULL;
+	}
+	bloom_rebuild(filter, commits, count);
+	free(commits);
+	git_oid_cpy(&(filter->tip), tip);
+	filter->changed = 1;
+	return filter;
+}
+
+/* Write the filters back to the repository if any have changed. Those which
+ * weren't obtained are carried forward unchanged, unless exists (if it isn't
+ * NULL) reports that their branch no longer exists; nothing is written if
+ * another process holds the lock on the file
+ */
+int
+branch_bloom_write(BRANCH_BLOOM *bloom, git_repository *repo, int (*exists)(const char *name, void *data), void *data, const char *progname)
+{
+	struct bloom_filter_struct *filter;
+	unsigned char hdr[BLOOM_HEADER_SIZE];
+	size_t c, count, len;
+	int changed;
+	char *path, *tmppath;
+	FILE *f;
+	int fd, busy;
+
+	changed = 0;
+	for(c = 0; c < bloom->nfilters; c++)
+	{
+		changed |= bloom->filters[c].changed;
+	}
+	if(!changed)
+	{
+		return 0;
+	}
+	/* Whether each branch still exists is only checked when the file is
+	 * to be rewritten anyway; a filter which couldn't be built has no blocks
+	 * to write
+	 */
+	count = 0;
+	for(c = 0; c < bloom->nfilters; c++)
+	{
+		filter = &(bloom->filters[c]);
+		if(!filter->used && filter->blocks)
+		{
+			filter->used = (!exists || exists(filter->name, data));
+		}
+		if(filter->used)
+		{
+			count++;
+		}
+	}
+	qsort(bloom->filters, bloom->nfilters, sizeof(struct bloom_filter_struct), filter_cmp);
+	bloom->nloaded = bloom->nfilters;
+
+	path = bloom_path(repo);
+	tmppath = (char *) xalloc(strlen(path) + 8);
+	strcpy(tmppath, path);
+	strcat(tmppath, ".lock");
+	/* Only the process which creates the lock writes the filters; any other
+	 * skips writing them, since a filter which lost bits to an interleaved
+	 * write would give false negatives
+	 */
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if(fd == -1)
+	{
+		busy = (errno == EEXIST);
+		if(!busy)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, tmppath, strerror(errno));
+		}
+		free(tmppath);
+		free(path);
+		return busy ? 0 : -1;
+	}
+	f = fdopen(fd, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, tmppath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	memcpy(hdr, BLOOM_SIGNATURE, 4);
+	put32(hdr + 4, (uint32_t) count);
+	fwrite(hdr, BLOOM_HEADER_SIZE, 1, f);
+	for(c = 0; c < bloom->nfilters; c++)
+	{
+		filter = &(bloom->filters[c]);
+		if(!filter->used)
+		{
+			continue;
+		}
+		len = strlen(filter->name);
+		hdr[0] = (len >> 8) & 0xff;
+		hdr[1] = len & 0xff;
+		fwrite(hdr, 2, 1, f);
+		fwrite(filter->name, len, 1, f);
+		fwrite(filter->tip.id, GIT_OID_RAWSZ, 1, f);
+		put32(hdr, filter->count);
+		put32(hdr + 4, filter->nblocks);
+		fwrite(hdr, 8, 1, f);
+		fwrite(filter->blocks, (size_t) filter->nblocks * BLOOM_BLOCK_SIZE, 1, f);
+	}
+	if(fclose(f) || rename(tmppath, path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	free(tmppath);
+	free(path);
+	return 0;
+}
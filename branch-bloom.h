@@ -0,0 +1,50 @@
+#ifndef BRANCH_BLOOM_H_
+# define BRANCH_BLOOM_H_               1
+
+# include "utils.h"
+# include "commit-graph.h"
+
+/* The branch Bloom filters, stored as $GIT_DIR/branchfor-bloom, record for
+ * each branch a Bloom filter of the commits reachable from its tip. A commit
+ * which isn't in a branch's filter is certainly not contained by the branch;
+ * one which is may be, and has to be checked properly.
+ *
+ * Each filter is divided into 64-bit blocks, and all of the bits for a given
+ * commit are set within a single block, so that testing a commit costs one
+ * memory probe per branch. Because commit IDs are already uniformly
+ * distributed, the block and bit positions are taken directly from the bytes
+ * of the ID rather than by hashing it again.
+ *
+ * When a branch moves forward, the commits added since its previous tip are
+ * added to its existing filter; if it has been rewound or rewritten, or its
+ * filter has become too full, the filter is rebuilt.
+ */
+
+# define BLOOM_FILENAME                 "branchfor-bloom"
+
+typedef struct branch_bloom_struct BRANCH_BLOOM;
+typedef struct bloom_filter_struct BLOOM_FILTER;
+
+/* Load a repository's branch filters, returning an empty set if there aren't
+ * any (or the file isn't valid)
+ */
+BRANCH_BLOOM *branch_bloom_open(git_repository *repo);
+/* Free a set of branch filters */
+void branch_bloom_close(BRANCH_BLOOM *bloom);
+/* Obtain the filter for a branch, bringing it up to date with the branch's
+ * current tip if necessary; returns NULL on error. The filter remains valid
+ * only until the next call.
+ */
+const BLOOM_FILTER *branch_bloom_get(BRANCH_BLOOM *bloom, git_repository *repo, const COMMIT_GRAPH *graph, const char *name, const git_oid *tip);
+/* Test whether a commit may be in a filter, returning 0 if it certainly
+ * isn't
+ */
+int bloom_filter_test(const BLOOM_FILTER *filter, const git_oid *oid);
+/* Write the filters back to the repository if any have changed. Those which
+ * weren't obtained are carried forward unchanged, unless exists (if it isn't
+ * NULL) reports that their branch no longer exists; nothing is written if
+ * another process holds the lock on the file
+ */
+int branch_bloom_write(BRANCH_BLOOM *bloom, git_repository *repo, int (*exists)(const char *name, void *data), void *data, const char *progname);
+
+#endif /*!BRANCH_BLOOM_H_*/
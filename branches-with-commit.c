@@ -2,168 +2,1739 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <getopt.h>
 
-#include <git2.h>
+#include "utils.h"
+#include "commit-graph.h"
+#include "contains-cache.h"
+#include "branch-bloom.h"
+#include "ref-filter.h"
+#include "oid-index.h"
+#include "output.h"
+#include "multicall.h"
+
+/* Rather than walking the history of each branch in turn until the target
+ * commit is found, the branch tips are collected first and then walked
+ * together, newest commit first. Each commit visited carries a bitset of the
+ * branches which can reach it, and that set is propagated to its parents.
+ * Any commit whose generation number (from the commit graph, if there is
+ * one) is not greater than the target's cannot have the target as an
+ * ancestor, and so the walk never descends below the target: the cost is one
+ * walk over the commits between the tips and the target, regardless of how
+ * many branches there are. Where generation numbers aren't available, commit
+ * times are used instead, allowing for a day's worth of clock skew.
+ *
+ * In batch mode (--stdin), any number of target commits are resolved by the
+ * same walk, which descends only as far as the oldest of them; the branch
+ * set of each target is then one row of the output matrix.
+ *
+ * Alternatively (with --jobs), each branch is walked separately, with the
+ * branches shared out between a pool of threads, each of which has its own
+ * repository handle. The results are merged back in reference order.
+ *
+ * With --cache, answers are recorded in (and looked up from) the
+ * containment cache before anything is walked. If a branch has moved since
+ * it was last queried, and its new tip descends from the old one, an answer
+ * for the old tip can be carried forward: a target contained by the old tip
+ * is still contained, and one which wasn't can only be among the commits
+ * which have been added since.
+ *
+ * With --tags, tags are checked too, each peeled to its commit once when the
+ * references are collected. To find only the first tag containing a commit
+ * (--first), the tags are ordered by generation number (or commit time) and
+ * tried in turn starting from the target's generation: the first one which
+ * reaches the target is the earliest release containing it, and no walk is
+ * needed for the remainder, which would only be its descendants.
+ *
+ * With --bloom, each branch also has a Bloom filter of the commits reachable
+ * from it, which is brought up to date as the branch moves. Since most
+ * queries are answered in the negative, any target which isn't in a branch's
+ * filter is known not to be contained without walking at all; the remainder
+ * are walked as usual.
+ *
+ * Commits may be given as any revision that git_revparse_single() accepts. In
+ * batch mode, abbreviated commit IDs are resolved using an index of the pack
+ * files' object names rather than by a separate lookup through libgit2 for
+ * each, so that scripts needn't run git rev-parse first.
+ *
+ * With --frontier, only the minimal set of containing branches is reported:
+ * those which don't descend from another containing branch. The ancestry of
+ * the branch tips is determined once, by a single walk, and the branches are
+ * then checked from the oldest tip to the newest; once one is found to
+ * contain the target, everything descended from it is known to as well, and
+ * is never walked.
+ */
+
+#define NODE_QUEUED                     1
+#define NODE_TARGET                     2
+
+/* Long options without a short equivalent */
+#define OPT_STDIN                       256
+#define OPT_JSON                        257
+#define OPT_CACHE                       258
+#define OPT_TAGS                        259
+#define OPT_FIRST                       260
+#define OPT_BLOOM                       261
+#define OPT_INCLUDE                     262
+#define OPT_EXCLUDE                     263
+#define OPT_FRONTIER                    264
+#define OPT_BINARY                      265
+
+#define BITSET_TEST(set, n)             ((set)[(n) / 64] & ((uint64_t) 1 << ((n) % 64)))
+#define BITSET_SET(set, n)              ((set)[(n) / 64] |= (uint64_t) 1 << ((n) % 64))
+
+/* How far a commit's timestamp may precede its parent's */
+#define CLOCK_SKEW_SLOP                 86400
+
+struct branch_struct
+{
+	/* The full name of the reference */
+	char *name;
+	/* Whether it's a local or remote branch, or a tag */
+	unsigned type;
+	/* The commit at the tip of the branch (or which the tag refers to) */
+	git_oid tip;
+	/* The tip's generation number and commit time, for ordering tags */
+	uint32_t generation;
+	git_time_t time;
+};
 
 struct branch_filter_struct
 {
 	unsigned type;
-	int (*cb)(git_reference *ref, const char *branch_name, git_branch_t type, void *data);
-	git_oid *oid;
+	int (*cb)(const struct ref_view_struct *ref, git_branch_t type, void *data);
 	git_repository *repo;
-	git_revwalk *walker;
+	COMMIT_GRAPH *graph;
+	/* The arena which holds the branches' names */
+	ARENA *arena;
+	/* The branches collected by branch_callback() */
+	struct branch_struct *branches;
+	size_t nbranches;
+	size_t nalloc;
+};
+
+struct query_struct
+{
+	/* The commit being searched for */
+	git_oid oid;
+	/* Its node in the walk, if it needs to be walked for */
+	struct walk_node_struct *node;
+	/* The branches which contain the commit */
+	uint64_t *contains;
+	/* The branches for which the answer is already known */
+	uint64_t *known;
+	/* With --frontier, the containing branches which don't descend from
+	 * another containing branch
+	 */
+	uint64_t *frontier;
 };
 
+struct worker_struct
+{
+	/* The repository path, for each thread to open for itself */
+	const char *path;
+	const char *progname;
+	COMMIT_GRAPH *graph;
+	const struct branch_struct *branches;
+	size_t nbranches;
+	const struct query_struct *queries;
+	size_t nqueries;
+	/* The index of the next branch to check */
+	size_t next;
+	/* For each branch, whether it contains each query */
+	unsigned char *results;
+	/* Set if any thread was unable to open the repository */
+	int failed;
+};
+
+struct walk_node_struct
+{
+	git_oid oid;
+	git_time_t time;
+	uint32_t generation;
+	/* The commit's position in the commit graph, or GRAPH_NONE */
+	uint32_t pos;
+	unsigned flags;
+	/* The set of branches which can reach this commit */
+	uint64_t bits[1];
+};
+
+struct walk_struct
+{
+	git_repository *repo;
+	COMMIT_GRAPH *graph;
+	/* The arena from which the nodes are allocated */
+	ARENA *arena;
+	/* The number of 64-bit words in each node's branch set */
+	size_t nwords;
+	/* The lowest generation number and earliest commit time of the commits
+	 * being searched for
+	 */
+	uint32_t mingen;
+	git_time_t mintime;
+	/* An open-addressed hash table of visited commits */
+	struct walk_node_struct **table;
+	size_t tablesize;
+	size_t count;
+	/* A max-heap of nodes ordered by generation number, and then by commit
+	 * time (which alone orders commits which aren't in the graph)
+	 */
+	struct walk_node_struct **heap;
+	size_t heapcount;
+	size_t heapsize;
+	/* The number of distinct targets */
+	size_t ntargets;
+};
+
+static size_t
+walk_hash(const git_oid *oid)
+{
+	/* Object IDs are already uniformly distributed */
+	return (size_t) oid->id[0] << 24 | (size_t) oid->id[1] << 16 | (size_t) oid->id[2] << 8 | (size_t) oid->id[3];
+}
+
+/* Look up a commit in the walk's table, adding it if it isn't present; its
+ * generation and commit time are loaded from the commit graph (or, failing
+ * that, the object database) when it's first seen
+ */
+static struct walk_node_struct *
+walk_node(struct walk_struct *walk, const git_oid *oid)
+{
+	struct walk_node_struct *node, **oldtable;
+	size_t c, n, oldsize;
+	git_commit *commit;
+	uint32_t pos;
+
+	if((walk->count + 1) * 2 > walk->tablesize)
+	{
+		oldtable = walk->table;
+		oldsize = walk->tablesize;
+		walk->tablesize = oldsize ? oldsize * 2 : 1024;
+		walk->table = (struct walk_node_struct **) xalloc(walk->tablesize * sizeof(struct walk_node_struct *));
+		for(c = 0; c < oldsize; c++)
+		{
+			if(!oldtable[c])
+			{
+				continue;
+			}
+			for(n = walk_hash(&(oldtable[c]->oid)) & (walk->tablesize - 1); walk->table[n]; n = (n + 1) & (walk->tablesize - 1));
+			walk->table[n] = oldtable[c];
+		}
+		free(oldtable);
+	}
+	for(n = walk_hash(oid) & (walk->tablesize - 1); walk->table[n]; n = (n + 1) & (walk->tablesize - 1))
+	{
+		if(!git_oid_cmp(&(walk->table[n]->oid), oid))
+		{
+			return walk->table[n];
+		}
+	}
+	/* The commit is looked up first, because a node can't be given back to
+	 * the arena if it turns out not to exist
+	 */
+	commit = NULL;
+	pos = commit_graph_find(walk->graph, oid);
+	if(pos == GRAPH_NONE && git_commit_lookup(&commit, walk->repo, oid))
+	{
+		return NULL;
+	}
+	node = (struct walk_node_struct *) arena_alloc(walk->arena, sizeof(struct walk_node_struct) + (walk->nwords - 1) * sizeof(uint64_t));
+	git_oid_cpy(&(node->oid), oid);
+	node->pos = pos;
+	if(commit)
+	{
+		node->generation = GENERATION_INFINITY;
+		node->time = git_commit_time(commit);
+		git_commit_free(commit);
+	}
+	else
+	{
+		node->generation = commit_graph_generation(walk->graph, pos);
+		node->time = commit_graph_time(walk->graph, pos);
+	}
+	walk->table[n] = node;
+	walk->count++;
+	return node;
+}
+
+/* Determine whether one node should be visited before another */
 static int
-branch_callback(git_reference *ref, const char *ref_name, git_branch_t branch_type, void *data)
+walk_before(const struct walk_node_struct *a, const struct walk_node_struct *b)
 {
-	char buf[GIT_OID_HEXSZ + 1];
-	const char *type;
-	git_oid *oid;
-	git_oid tip, found;
-	int match;
-	struct branch_filter_struct *filter;
-	git_reference *resolved;
-	
-	filter = (struct branch_filter_struct *) data;	
-	oid = filter->oid;
-	resolved = NULL;
-	git_reference_resolve(&resolved, ref);
-	git_oid_cpy(&tip, git_reference_target(resolved));
-	git_reference_free(resolved);
-	/* Determine whether oid exists in this branch's history by revwalking the
-	 * history
+	if(a->generation != b->generation)
+	{
+		return a->generation > b->generation;
+	}
+	return a->time > b->time;
+}
+
+/* Determine whether a commit can be skipped because it can't possibly have
+ * any of the targets as an ancestor
+ */
+static int
+walk_prune(const struct walk_struct *walk, const struct walk_node_struct *node)
+{
+	if(node->flags & NODE_TARGET)
+	{
+		return 0;
+	}
+	/* Commits in the graph are pruned by generation: if no target is in the
+	 * graph, the lowest generation is infinite, and none can be an ancestor
+	 * of anything which is
 	 */
-	git_revwalk_reset(filter->walker);
-	git_revwalk_push(filter->walker, &tip);
-	git_revwalk_push_glob(filter->walker, ref_name);
-	match = 0;
-	if(!strcmp(ref_name, "refs/heads/squeeze-backports"))
+	if(node->generation != GENERATION_INFINITY)
 	{
-		fprintf(stderr, "checking ref %s\n", ref_name);
+		return node->generation <= walk->mingen;
 	}
-	while(!git_revwalk_next(&found, filter->walker))
+	if(walk->mingen != GENERATION_INFINITY)
 	{
-		git_oid_tostr(buf, sizeof(buf), &found);
-		if(!strcmp(ref_name, "refs/heads/squeeze-backports"))
+		return 0;
+	}
+	/* Neither the commit nor any target is in the graph, so fall back to
+	 * the commit time
+	 */
+	return node->time < walk->mintime - CLOCK_SKEW_SLOP;
+}
+
+static void
+walk_push(struct walk_struct *walk, struct walk_node_struct *node)
+{
+	struct walk_node_struct *tmp;
+	size_t c, parent;
+
+	if(node->flags & NODE_QUEUED)
+	{
+		return;
+	}
+	node->flags |= NODE_QUEUED;
+	if(walk->heapcount == walk->heapsize)
+	{
+		walk->heapsize = walk->heapsize ? walk->heapsize * 2 : 256;
+		walk->heap = (struct walk_node_struct **) xrealloc(walk->heap, walk->heapsize * sizeof(struct walk_node_struct *));
+	}
+	c = walk->heapcount++;
+	walk->heap[c] = node;
+	while(c)
+	{
+		parent = (c - 1) / 2;
+		if(!walk_before(walk->heap[c], walk->heap[parent]))
 		{
-			fprintf(stderr, "  %s\n", buf);
+			break;
 		}
-		if(!git_oid_cmp(&found, oid))
+		tmp = walk->heap[parent];
+		walk->heap[parent] = walk->heap[c];
+		walk->heap[c] = tmp;
+		c = parent;
+	}
+}
+
+static struct walk_node_struct *
+walk_pop(struct walk_struct *walk)
+{
+	struct walk_node_struct *node, *tmp;
+	size_t c, child;
+
+	if(!walk->heapcount)
+	{
+		return NULL;
+	}
+	node = walk->heap[0];
+	node->flags &= ~NODE_QUEUED;
+	walk->heap[0] = walk->heap[--walk->heapcount];
+	c = 0;
+	for(;;)
+	{
+		child = c * 2 + 1;
+		if(child >= walk->heapcount)
 		{
-			match = 1;
 			break;
 		}
+		if(child + 1 < walk->heapcount && walk_before(walk->heap[child + 1], walk->heap[child]))
+		{
+			child++;
+		}
+		if(!walk_before(walk->heap[child], walk->heap[c]))
+		{
+			break;
+		}
+		tmp = walk->heap[child];
+		walk->heap[child] = walk->heap[c];
+		walk->heap[c] = tmp;
+		c = child;
 	}
-	if(!match)
+	return node;
+}
+
+/* Merge the branch set of a child into that of its parent, returning nonzero
+ * if the parent gained any branches
+ */
+static int
+walk_merge(struct walk_struct *walk, struct walk_node_struct *parent, const struct walk_node_struct *child)
+{
+	size_t c;
+	uint64_t added;
+
+	added = 0;
+	for(c = 0; c < walk->nwords; c++)
 	{
-		return 0;
+		added |= child->bits[c] & ~parent->bits[c];
+		parent->bits[c] |= child->bits[c];
 	}
-	switch(branch_type)
+	return added != 0;
+}
+
+/* Free a walk's table and heap; its nodes belong to the arena */
+static void
+walk_free(struct walk_struct *walk)
+{
+	free(walk->table);
+	free(walk->heap);
+}
+
+/* Add a commit to be searched for, returning its node (whose branch set will
+ * identify the branches that contain it once contains_walk() has finished)
+ */
+static struct walk_node_struct *
+walk_target(struct walk_struct *walk, const git_oid *oid)
+{
+	struct walk_node_struct *target;
+
+	target = walk_node(walk, oid);
+	if(!target)
 	{
-	case GIT_BRANCH_LOCAL:
-		type = "local";
-		break;
-	case GIT_BRANCH_REMOTE:
-		type = "remote";
-		break;
-	default:
-		type = "unknown";
+		return NULL;
+	}
+	if(!(target->flags & NODE_TARGET))
+	{
+		target->flags |= NODE_TARGET;
+		if(!walk->ntargets || target->generation < walk->mingen)
+		{
+			walk->mingen = target->generation;
+		}
+		if(!walk->ntargets || target->time < walk->mintime)
+		{
+			walk->mintime = target->time;
+		}
+		walk->ntargets++;
+	}
+	return target;
+}
+
+/* Walk from every branch tip at once, propagating branch sets down as far as
+ * the oldest of the targets
+ */
+static void
+contains_walk(struct walk_struct *walk, const struct branch_struct *branches, size_t nbranches)
+{
+	struct walk_node_struct *node, *parent;
+	git_commit *commit;
+	git_oid parentoid;
+	unsigned int c, count;
+	size_t n;
+
+	if(!walk->ntargets)
+	{
+		return;
 	}
-	git_oid_tostr(buf, sizeof(buf), oid);
-	printf("%s (%s) contains %s\n", ref_name, type, buf);
+	for(n = 0; n < nbranches; n++)
+	{
+		node = walk_node(walk, &(branches[n].tip));
+		if(!node)
+		{
+			continue;
+		}
+		node->bits[n / 64] |= (uint64_t) 1 << (n % 64);
+		if(!walk_prune(walk, node))
+		{
+			walk_push(walk, node);
+		}
+	}
+	while((node = walk_pop(walk)))
+	{
+		commit = NULL;
+		if(node->pos != GRAPH_NONE)
+		{
+			count = commit_graph_parentcount(walk->graph, node->pos);
+		}
+		else
+		{
+			if(git_commit_lookup(&commit, walk->repo, &(node->oid)))
+			{
+				continue;
+			}
+			count = git_commit_parentcount(commit);
+		}
+		for(c = 0; c < count; c++)
+		{
+			if(commit)
+			{
+				git_oid_cpy(&parentoid, git_commit_parent_id(commit, c));
+			}
+			else
+			{
+				commit_graph_oid(walk->graph, commit_graph_parent(walk->graph, node->pos, c), &parentoid);
+			}
+			parent = walk_node(walk, &parentoid);
+			if(!parent || walk_prune(walk, parent))
+			{
+				continue;
+			}
+			/* A commit is re-queued whenever it gains branches, so that a
+			 * parent which was visited before one of its children (because of
+			 * clock skew) still passes the complete set on
+			 */
+			if(walk_merge(walk, parent, node))
+			{
+				walk_push(walk, parent);
+			}
+		}
+		git_commit_free(commit);
+	}
+}
+
+/* Check whether a share of the branches contain each of the queries, one
+ * branch at a time, on a thread of its own
+ */
+static void *
+contains_worker(void *data)
+{
+	struct worker_struct *worker;
+	struct walk_struct walk;
+	struct walk_node_struct *node;
+	git_repository *repo;
+	const git_error *err;
+	ARENA *arena;
+	size_t n, q;
+
+	worker = (struct worker_struct *) data;
+	if(git_repository_open(&repo, worker->path))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", worker->progname, worker->path, err->message);
+		worker->failed = 1;
+		return NULL;
+	}
+	/* Each branch's walk re-uses the memory of the one before */
+	arena = arena_create();
+	for(;;)
+	{
+		n = __sync_fetch_and_add(&(worker->next), 1);
+		if(n >= worker->nbranches)
+		{
+			break;
+		}
+		memset(&walk, 0, sizeof(walk));
+		walk.repo = repo;
+		walk.graph = worker->graph;
+		walk.arena = arena;
+		walk.nwords = 1;
+		for(q = 0; q < worker->nqueries; q++)
+		{
+			if(worker->queries[q].node)
+			{
+				walk_target(&walk, &(worker->queries[q].oid));
+			}
+		}
+		contains_walk(&walk, &(worker->branches[n]), 1);
+		for(q = 0; q < worker->nqueries; q++)
+		{
+			if(!worker->queries[q].node)
+			{
+				continue;
+			}
+			node = walk_node(&walk, &(worker->queries[q].oid));
+			worker->results[n * worker->nqueries + q] = (node && (node->bits[0] & 1));
+		}
+		walk_free(&walk);
+		arena_reset(arena);
+	}
+	arena_free(arena);
+	git_repository_free(repo);
+	return NULL;
+}
+
+/* Check the branches in parallel, merging the results into the branch sets
+ * of the queries' nodes in reference order; returns -1 if any of the threads
+ * failed
+ */
+static int
+contains_parallel(REPO *repo, COMMIT_GRAPH *graph, const struct branch_struct *branches, size_t nbranches, const struct query_struct *queries, size_t nqueries, int jobs)
+{
+	struct worker_struct worker;
+	size_t n, q;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.path = repo->path;
+	worker.progname = repo->progname;
+	worker.graph = graph;
+	worker.branches = branches;
+	worker.nbranches = nbranches;
+	worker.queries = queries;
+	worker.nqueries = nqueries;
+	worker.results = (unsigned char *) xalloc(nbranches * nqueries + 1);
+	if((size_t) jobs > nbranches)
+	{
+		jobs = (int) nbranches;
+	}
+	run_threads(jobs, contains_worker, &worker);
+	if(worker.failed)
+	{
+		free(worker.results);
+		return -1;
+	}
+	for(n = 0; n < nbranches; n++)
+	{
+		for(q = 0; q < nqueries; q++)
+		{
+			if(worker.results[n * nqueries + q])
+			{
+				BITSET_SET(queries[q].node->bits, n);
+			}
+		}
+	}
+	free(worker.results);
 	return 0;
 }
 
+/* Determine the answers which aren't already known by walking the branches
+ * concerned, either all at once or (if jobs > 1) in parallel; returns -1 if
+ * they couldn't be determined
+ */
+static int
+resolve_walk(REPO *repo, COMMIT_GRAPH *graph, const struct branch_filter_struct *filter, struct query_struct *queries, size_t nqueries, int jobs)
+{
+	struct walk_struct walk;
+	struct branch_struct *sub;
+	size_t *map, nsub, n, q, k;
+	int r;
+
+	/* Only the branches with unanswered queries are walked */
+	sub = (struct branch_struct *) xalloc((filter->nbranches + 1) * sizeof(struct branch_struct));
+	map = (size_t *) xalloc((filter->nbranches + 1) * sizeof(size_t));
+	nsub = 0;
+	r = 0;
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		for(q = 0; q < nqueries && BITSET_TEST(queries[q].known, n); q++);
+		if(q < nqueries)
+		{
+			sub[nsub] = filter->branches[n];
+			map[nsub] = n;
+			nsub++;
+		}
+	}
+	if(nsub)
+	{
+		memset(&walk, 0, sizeof(walk));
+		walk.repo = repo->repo;
+		walk.graph = graph;
+		walk.arena = arena_create();
+		walk.nwords = nsub / 64 + 1;
+		for(q = 0; q < nqueries; q++)
+		{
+			for(k = 0; k < nsub && BITSET_TEST(queries[q].known, map[k]); k++);
+			if(k < nsub)
+			{
+				queries[q].node = walk_target(&walk, &(queries[q].oid));
+			}
+		}
+		if(jobs > 1)
+		{
+			r = contains_parallel(repo, graph, sub, nsub, queries, nqueries, jobs);
+		}
+		else
+		{
+			contains_walk(&walk, sub, nsub);
+		}
+		for(q = 0; q < nqueries; q++)
+		{
+			if(r || !queries[q].node)
+			{
+				continue;
+			}
+			for(k = 0; k < nsub; k++)
+			{
+				if(BITSET_TEST(queries[q].known, map[k]))
+				{
+					continue;
+				}
+				if(BITSET_TEST(queries[q].node->bits, k))
+				{
+					BITSET_SET(queries[q].contains, map[k]);
+				}
+				BITSET_SET(queries[q].known, map[k]);
+			}
+			queries[q].node = NULL;
+		}
+		walk_free(&walk);
+		arena_free(walk.arena);
+	}
+	free(map);
+	free(sub);
+	return r;
+}
+
+static int
+oid_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp((const git_oid *) a, (const git_oid *) b);
+}
+
+/* Collect the commits reachable from a branch's new tip but not its old one,
+ * sorted so that they can be searched
+ */
+static git_oid *
+new_commits(git_repository *repo, const git_oid *tip, const git_oid *oldtip, size_t *count)
+{
+	git_revwalk *walker;
+	git_oid *commits, oid;
+	size_t nalloc;
+
+	*count = 0;
+	nalloc = 64;
+	commits = (git_oid *) xalloc(nalloc * sizeof(git_oid));
+	if(git_revwalk_new(&walker, repo))
+	{
+		return commits;
+	}
+	git_revwalk_push(walker, tip);
+	git_revwalk_hide(walker, oldtip);
+	while(!git_revwalk_next(&oid, walker))
+	{
+		if(*count == nalloc)
+		{
+			nalloc *= 2;
+			commits = (git_oid *) xrealloc(commits, nalloc * sizeof(git_oid));
+		}
+		git_oid_cpy(&(commits[(*count)++]), &oid);
+	}
+	git_revwalk_free(walker);
+	qsort(commits, *count, sizeof(git_oid), oid_cmp);
+	return commits;
+}
+
+/* Answer as many queries as possible from the containment cache, returning
+ * nonzero if the cache will need to be updated afterwards
+ */
 static int
-ref_callback(git_reference *ref, void *data)
+resolve_cache(REPO *repo, COMMIT_GRAPH *graph, CONTAINS_CACHE *cache, const struct branch_filter_struct *filter, struct query_struct *queries, size_t nqueries)
+{
+	const struct branch_struct *branch;
+	const git_oid *oldtip;
+	git_oid *added;
+	size_t n, q, nadded;
+	int r, descends, dirty;
+
+	dirty = 0;
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		branch = &(filter->branches[n]);
+		oldtip = contains_cache_tip(cache, branch->name);
+		if(!oldtip || git_oid_cmp(oldtip, &(branch->tip)))
+		{
+			dirty = 1;
+		}
+		if(oldtip && !git_oid_cmp(oldtip, &(branch->tip)))
+		{
+			oldtip = NULL;
+		}
+		/* Whether the new tip descends from the old, and the commits added
+		 * since, are only determined if they're needed
+		 */
+		descends = -1;
+		added = NULL;
+		nadded = 0;
+		for(q = 0; q < nqueries; q++)
+		{
+			r = contains_cache_lookup(cache, &(branch->tip), &(queries[q].oid));
+			if(r < 0 && oldtip)
+			{
+				r = contains_cache_lookup(cache, oldtip, &(queries[q].oid));
+				if(r >= 0 && descends < 0)
+				{
+					descends = (commit_reachable(graph, repo->repo, &(branch->tip), oldtip) == 1);
+				}
+				if(r >= 0 && !descends)
+				{
+					r = -1;
+				}
+				else if(r == 0)
+				{
+					if(!added)
+					{
+						added = new_commits(repo->repo, &(branch->tip), oldtip, &nadded);
+					}
+					r = bsearch(&(queries[q].oid), added, nadded, sizeof(git_oid), oid_cmp) ? 1 : 0;
+				}
+				dirty = 1;
+			}
+			else if(r < 0)
+			{
+				dirty = 1;
+			}
+			if(r < 0)
+			{
+				continue;
+			}
+			if(r)
+			{
+				BITSET_SET(queries[q].contains, n);
+			}
+			BITSET_SET(queries[q].known, n);
+		}
+		free(added);
+	}
+	return dirty;
+}
+
+/* Determine whether the branch a Bloom filter was kept for still exists, so
+ * that the filters of branches which weren't checked this time (because the
+ * cache answered them, or they were excluded) are kept
+ */
+static int
+bloom_branch_exists(const char *name, void *data)
+{
+	git_oid oid;
+
+	return !git_reference_name_to_id(&oid, (git_repository *) data, name);
+}
+
+/* Answer the queries which aren't contained by a branch according to its
+ * Bloom filter, updating the filters as necessary
+ */
+static void
+resolve_bloom(REPO *repo, COMMIT_GRAPH *graph, const struct branch_filter_struct *filter, struct query_struct *queries, size_t nqueries)
+{
+	BRANCH_BLOOM *bloom;
+	const BLOOM_FILTER *bf;
+	size_t n, q;
+
+	bloom = branch_bloom_open(repo->repo);
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		for(q = 0; q < nqueries && BITSET_TEST(queries[q].known, n); q++);
+		if(q == nqueries)
+		{
+			continue;
+		}
+		bf = branch_bloom_get(bloom, repo->repo, graph, filter->branches[n].name, &(filter->branches[n].tip));
+		if(!bf)
+		{
+			continue;
+		}
+		for(; q < nqueries; q++)
+		{
+			if(!BITSET_TEST(queries[q].known, n) && !bloom_filter_test(bf, &(queries[q].oid)))
+			{
+				BITSET_SET(queries[q].known, n);
+			}
+		}
+	}
+	branch_bloom_write(bloom, repo->repo, bloom_branch_exists, repo->repo, repo->progname);
+	branch_bloom_close(bloom);
+}
+
+/* Record the answers to every query in the cache and write it back */
+static void
+update_cache(REPO *repo, CONTAINS_CACHE *cache, const struct branch_filter_struct *filter, const struct query_struct *queries, size_t nqueries)
+{
+	size_t n, q;
+
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		contains_cache_set_tip(cache, filter->branches[n].name, &(filter->branches[n].tip));
+		for(q = 0; q < nqueries; q++)
+		{
+			contains_cache_add(cache, &(filter->branches[n].tip), &(queries[q].oid), BITSET_TEST(queries[q].contains, n) != 0);
+		}
+	}
+	contains_cache_write(cache, repo->repo, repo->progname);
+}
+
+static int
+branch_callback(const struct ref_view_struct *ref, git_branch_t branch_type, void *data)
 {
 	struct branch_filter_struct *filter;
-	const char *ref_name;
-	int remote;
-	
-	if(!git_reference_is_branch(ref))
+	struct branch_struct *branch;
+	git_object *obj, *commit;
+	const git_oid *tip;
+	int r;
+
+	filter = (struct branch_filter_struct *) data;
+	/* A reference whose peeled object is known, or a branch, which refers
+	 * to a commit in the commit graph needs no objects read at all
+	 */
+	tip = ref->peeled ? ref->peeled : &(ref->oid);
+	commit = NULL;
+	if((!ref->peeled && branch_type == REF_TAG) || commit_graph_find(filter->graph, tip) == GRAPH_NONE)
+	{
+		/* Tags may point at anything, and only those which lead to
+		 * commits are of interest
+		 */
+		if(git_object_lookup(&obj, filter->repo, &(ref->oid), GIT_OBJ_ANY))
+		{
+			return 0;
+		}
+		r = git_object_peel(&commit, obj, GIT_OBJ_COMMIT);
+		git_object_free(obj);
+		if(r)
+		{
+			return 0;
+		}
+		tip = git_object_id(commit);
+	}
+	if(filter->nbranches == filter->nalloc)
+	{
+		filter->nalloc = filter->nalloc ? filter->nalloc * 2 : 64;
+		filter->branches = (struct branch_struct *) xrealloc(filter->branches, filter->nalloc * sizeof(struct branch_struct));
+	}
+	branch = &(filter->branches[filter->nbranches]);
+	branch->name = arena_strdup(filter->arena, ref->name);
+	branch->type = branch_type;
+	git_oid_cpy(&(branch->tip), tip);
+	branch->generation = GENERATION_INFINITY;
+	branch->time = 0;
+	if(commit)
+	{
+		git_object_free(commit);
+	}
+	filter->nbranches++;
+	return 0;
+}
+
+
+/* Obtain the generation number and commit time of a commit */
+static void
+commit_order(git_repository *repo, const COMMIT_GRAPH *graph, const git_oid *oid, uint32_t *generation, git_time_t *time)
+{
+	git_commit *commit;
+	uint32_t pos;
+
+	pos = commit_graph_find(graph, oid);
+	if(pos != GRAPH_NONE)
+	{
+		*generation = commit_graph_generation(graph, pos);
+		*time = commit_graph_time(graph, pos);
+		return;
+	}
+	*generation = GENERATION_INFINITY;
+	*time = 0;
+	if(!git_commit_lookup(&commit, repo, oid))
+	{
+		*time = git_commit_time(commit);
+		git_commit_free(commit);
+	}
+}
+
+static int
+tag_order_cmp(const void *a, const void *b)
+{
+	const struct branch_struct *ta, *tb;
+
+	ta = *((const struct branch_struct **) a);
+	tb = *((const struct branch_struct **) b);
+	if(ta->generation != tb->generation)
+	{
+		return ta->generation < tb->generation ? -1 : 1;
+	}
+	if(ta->time != tb->time)
+	{
+		return ta->time < tb->time ? -1 : 1;
+	}
+	return strcmp(ta->name, tb->name);
+}
+
+/* Return the collected tags, ordered from the oldest to the newest */
+static struct branch_struct **
+order_tags(git_repository *repo, const COMMIT_GRAPH *graph, struct branch_filter_struct *filter, size_t *count)
+{
+	struct branch_struct **tags;
+	size_t n;
+
+	tags = (struct branch_struct **) xalloc((filter->nbranches + 1) * sizeof(struct branch_struct *));
+	*count = 0;
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		if(filter->branches[n].type != REF_TAG)
+		{
+			continue;
+		}
+		commit_order(repo, graph, &(filter->branches[n].tip), &(filter->branches[n].generation), &(filter->branches[n].time));
+		tags[(*count)++] = &(filter->branches[n]);
+	}
+	qsort(tags, *count, sizeof(struct branch_struct *), tag_order_cmp);
+	return tags;
+}
+
+/* Find the earliest tag which contains a commit, or NULL if there isn't one */
+static const struct branch_struct *
+first_tag(git_repository *repo, const COMMIT_GRAPH *graph, struct branch_struct **tags, size_t ntags, const git_oid *target)
+{
+	uint32_t generation;
+	git_time_t time;
+	size_t lo, hi, mid;
+
+	commit_order(repo, graph, target, &generation, &time);
+	/* Skip the tags which are too old to contain the target: those with a
+	 * lower generation number or, where generation numbers aren't known, an
+	 * earlier commit time (allowing for clock skew)
+	 */
+	if(generation != GENERATION_INFINITY)
+	{
+		time = 0;
+	}
+	else
+	{
+		time -= CLOCK_SKEW_SLOP;
+	}
+	lo = 0;
+	hi = ntags;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(tags[mid]->generation < generation || (tags[mid]->generation == generation && tags[mid]->time < time))
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	for(; lo < ntags; lo++)
+	{
+		if(commit_reachable(graph, repo, &(tags[lo]->tip), target) == 1)
+		{
+			return tags[lo];
+		}
+	}
+	return NULL;
+}
+
+/* Determine which branches contain each query, and which of those form the
+ * frontier, by checking the branches in order of their tips' generation
+ * numbers and inferring the answer for any branch which descends from one
+ * already found to contain the query
+ */
+static void
+resolve_frontier(REPO *repo, COMMIT_GRAPH *graph, struct branch_filter_struct *filter, struct query_struct *queries, size_t nqueries)
+{
+	struct walk_struct walk;
+	struct walk_node_struct *node;
+	struct branch_struct *sub, **order;
+	size_t *map, nsub, nwords, n, k, j, q, w;
+	uint64_t *desc, *proven, *front;
+	uint32_t mingen, qgen;
+	git_time_t qtime;
+	int prevfront;
+
+	/* Branches whose tips are older than every query can't contain any */
+	mingen = GENERATION_INFINITY;
+	for(q = 0; q < nqueries; q++)
+	{
+		commit_order(repo->repo, graph, &(queries[q].oid), &qgen, &qtime);
+		if(qgen < mingen)
+		{
+			mingen = qgen;
+		}
+	}
+	sub = (struct branch_struct *) xalloc((filter->nbranches + 1) * sizeof(struct branch_struct));
+	map = (size_t *) xalloc((filter->nbranches + 1) * sizeof(size_t));
+	order = (struct branch_struct **) xalloc((filter->nbranches + 1) * sizeof(struct branch_struct *));
+	nsub = 0;
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		commit_order(repo->repo, graph, &(filter->branches[n].tip), &(filter->branches[n].generation), &(filter->branches[n].time));
+		if(filter->branches[n].generation >= mingen || !nqueries)
+		{
+			sub[nsub] = filter->branches[n];
+			map[nsub] = n;
+			order[nsub] = &(sub[nsub]);
+			nsub++;
+		}
+	}
+	qsort(order, nsub, sizeof(struct branch_struct *), tag_order_cmp);
+
+	/* Find, for each branch, the branches which descend from it: walking
+	 * from every tip with each tip as a target leaves each tip's node with
+	 * the set of branches which can reach it
+	 */
+	nwords = nsub / 64 + 1;
+	desc = (uint64_t *) xalloc((nsub + 1) * nwords * sizeof(uint64_t));
+	memset(&walk, 0, sizeof(walk));
+	walk.repo = repo->repo;
+	walk.graph = graph;
+	walk.arena = arena_create();
+	walk.nwords = nwords;
+	for(k = 0; k < nsub; k++)
+	{
+		walk_target(&walk, &(sub[k].tip));
+	}
+	contains_walk(&walk, sub, nsub);
+	for(k = 0; k < nsub; k++)
+	{
+		node = walk_node(&walk, &(sub[k].tip));
+		if(node)
+		{
+			memcpy(&(desc[k * nwords]), node->bits, nwords * sizeof(uint64_t));
+		}
+	}
+	walk_free(&walk);
+	arena_free(walk.arena);
+
+	proven = (uint64_t *) xalloc(nwords * sizeof(uint64_t));
+	front = (uint64_t *) xalloc(nwords * sizeof(uint64_t));
+	for(q = 0; q < nqueries; q++)
+	{
+		commit_order(repo->repo, graph, &(queries[q].oid), &qgen, &qtime);
+		memset(proven, 0, nwords * sizeof(uint64_t));
+		memset(front, 0, nwords * sizeof(uint64_t));
+		prevfront = 0;
+		for(j = 0; j < nsub; j++)
+		{
+			k = order[j] - sub;
+			n = map[k];
+			if(BITSET_TEST(proven, k))
+			{
+				/* Descended from a containing branch; a branch sharing its
+				 * tip with one on the frontier is on the frontier too
+				 */
+				BITSET_SET(queries[q].contains, n);
+				BITSET_SET(queries[q].known, n);
+				prevfront = (prevfront && !git_oid_cmp(&(order[j - 1]->tip), &(order[j]->tip)));
+				if(prevfront)
+				{
+					BITSET_SET(front, k);
+				}
+				continue;
+			}
+			if(!BITSET_TEST(queries[q].known, n))
+			{
+				if(sub[k].generation >= qgen && commit_reachable(graph, repo->repo, &(sub[k].tip), &(queries[q].oid)) == 1)
+				{
+					BITSET_SET(queries[q].contains, n);
+				}
+				BITSET_SET(queries[q].known, n);
+			}
+			prevfront = 0;
+			if(BITSET_TEST(queries[q].contains, n))
+			{
+				BITSET_SET(front, k);
+				for(w = 0; w < nwords; w++)
+				{
+					proven[w] |= desc[k * nwords + w];
+				}
+				prevfront = 1;
+			}
+		}
+		/* Without generation numbers, the tips may not have been checked in
+		 * strict ancestry order, so discard anything on the frontier which
+		 * descends from something else on it
+		 */
+		for(k = 0; k < nsub; k++)
+		{
+			if(!BITSET_TEST(front, k))
+			{
+				continue;
+			}
+			for(j = 0; j < nsub; j++)
+			{
+				if(j != k && BITSET_TEST(front, j) && BITSET_TEST(&(desc[j * nwords]), k) && git_oid_cmp(&(sub[j].tip), &(sub[k].tip)))
+				{
+					break;
+				}
+			}
+			if(j == nsub)
+			{
+				BITSET_SET(queries[q].frontier, map[k]);
+			}
+		}
+		/* Anything left unknown can't contain the query */
+		for(w = 0; w < filter->nbranches / 64 + 1; w++)
+		{
+			queries[q].known[w] = ~(uint64_t) 0;
+		}
+	}
+	free(front);
+	free(proven);
+	free(desc);
+	free(order);
+	free(map);
+	free(sub);
+}
+
+/* Determine whether a commit exists */
+static int
+commit_exists(git_repository *repo, const COMMIT_GRAPH *graph, const git_oid *oid)
+{
+	git_commit *commit;
+
+	if(commit_graph_find(graph, oid) != GRAPH_NONE)
+	{
+		return 1;
+	}
+	if(git_commit_lookup(&commit, repo, oid))
 	{
 		return 0;
 	}
-	remote = git_reference_is_remote(ref);
-	ref_name = git_reference_name(ref);
-	filter = (struct branch_filter_struct *) data;
+	git_commit_free(commit);
+	return 1;
+}
 
-	if(filter->type & GIT_BRANCH_LOCAL && !remote)
+/* Resolve a revision to the commit it refers to, using the object ID index
+ * (if there is one) for abbreviated commit IDs which aren't also the names of
+ * references; returns nonzero if it can't be resolved
+ */
+static int
+resolve_commit(git_repository *repo, const COMMIT_GRAPH *graph, const OID_INDEX *index, const char *spec, git_oid *out)
+{
+	git_object *obj, *peeled;
+	git_reference *ref;
+	size_t len;
+	int r;
+
+	len = strlen(spec);
+	r = 0;
+	if(len == GIT_OID_HEXSZ)
+	{
+		r = !git_oid_fromstr(out, spec);
+	}
+	else if(index && len == strspn(spec, "0123456789abcdefABCDEF"))
+	{
+		/* As with git_revparse_single(), a reference (such as a tag named
+		 * "2024") takes precedence over an abbreviation, and so is left for
+		 * it to resolve, as are ambiguous abbreviations
+		 */
+		if(!git_reference_dwim(&ref, repo, spec))
+		{
+			git_reference_free(ref);
+		}
+		else
+		{
+			r = (oid_index_lookup(index, spec, len, out) == 1);
+		}
+	}
+	if(r)
+	{
+		if(commit_exists(repo, graph, out))
+		{
+			return 0;
+		}
+		/* It may be an annotated tag */
+		if(git_object_lookup(&obj, repo, out, GIT_OBJ_ANY))
+		{
+			return -1;
+		}
+	}
+	else if(git_revparse_single(&obj, repo, spec))
 	{
-		return filter->cb(ref, ref_name, GIT_BRANCH_LOCAL, data);
+		return -1;
 	}
-	if(filter->type & GIT_BRANCH_REMOTE && remote)
+	r = git_object_peel(&peeled, obj, GIT_OBJ_COMMIT);
+	git_object_free(obj);
+	if(r)
 	{
-		return filter->cb(ref, ref_name, GIT_BRANCH_REMOTE, data);
+		return -1;
 	}
+	git_oid_cpy(out, git_object_id(peeled));
+	git_object_free(peeled);
 	return 0;
 }
 
+/* Read revisions from a stream, one per line, resolving each to a commit */
+static struct query_struct *
+read_queries(REPO *repo, COMMIT_GRAPH *graph, FILE *f, size_t *count)
+{
+	OID_INDEX *index;
+	struct query_struct *queries;
+	size_t nalloc, buflen;
+	char *buf, *p, *e;
+	ssize_t len;
+	git_oid oid;
+
+	queries = NULL;
+	*count = 0;
+	nalloc = 0;
+	buf = NULL;
+	buflen = 0;
+	index = oid_index_open(repo->repo);
+	while((len = getline(&buf, &buflen, f)) != -1)
+	{
+		for(p = buf; isspace(*p); p++);
+		for(e = strchr(p, 0); e > p && isspace(e[-1]); e--);
+		*e = 0;
+		if(!*p)
+		{
+			continue;
+		}
+		if(resolve_commit(repo->repo, graph, index, p, &oid))
+		{
+			fprintf(stderr, "%s: unable to find a commit for '%s'\n", repo->progname, p);
+			continue;
+		}
+		if(*count == nalloc)
+		{
+			nalloc = nalloc ? nalloc * 2 : 64;
+			queries = (struct query_struct *) xrealloc(queries, nalloc * sizeof(struct query_struct));
+		}
+		git_oid_cpy(&(queries[*count].oid), &oid);
+		(*count)++;
+	}
+	oid_index_close(index);
+	free(buf);
+	return queries;
+}
+
+/* The name of a reference's type, as reported */
+static const char *
+type_name(unsigned type)
+{
+	switch(type)
+	{
+	case GIT_BRANCH_LOCAL:
+		return "local";
+	case GIT_BRANCH_REMOTE:
+		return "remote";
+	case REF_TAG:
+		return "tag";
+	}
+	return "unknown";
+}
+
+/* Write a record pairing a commit with a reference which contains it */
+static void
+write_pair(OUTPUT *out, const git_oid *oid, const struct branch_struct *branch)
+{
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_printf(out, "%s (%s) contains ", branch->name, type_name(branch->type));
+		output_hex(out, oid);
+		output_putc(out, '\n');
+		return;
+	}
+	output_begin(out);
+	output_oid(out, "commit", oid);
+	output_string(out, "name", branch->name);
+	output_label(out, "type", type_name(branch->type));
+	output_end(out);
+}
+
+/* Write the commit x branch matrix for a batch of queries; -z and --binary
+ * write a record for each commit and branch which contains it instead
+ */
+static void
+write_matrix(OUTPUT *out, const struct branch_filter_struct *filter, const struct query_struct *queries, size_t nqueries)
+{
+	size_t c, n;
+	int first;
+
+	switch(output_format(out))
+	{
+	case OUTPUT_JSON:
+		output_puts(out, "{\"branches\":[");
+		for(n = 0; n < filter->nbranches; n++)
+		{
+			if(n)
+			{
+				output_putc(out, ',');
+			}
+			output_json_string(out, filter->branches[n].name);
+		}
+		output_puts(out, "],\"contains\":[");
+		for(c = 0; c < nqueries; c++)
+		{
+			output_puts(out, c ? ",{\"commit\":\"" : "{\"commit\":\"");
+			output_hex(out, &(queries[c].oid));
+			output_puts(out, "\",\"branches\":[");
+			first = 1;
+			for(n = 0; n < filter->nbranches; n++)
+			{
+				if(BITSET_TEST(queries[c].contains, n))
+				{
+					output_printf(out, first ? "%lu" : ",%lu", (unsigned long) n);
+					first = 0;
+				}
+			}
+			output_puts(out, "]}");
+		}
+		output_puts(out, "]}\n");
+		return;
+	case OUTPUT_NUL:
+	case OUTPUT_BINARY:
+		for(c = 0; c < nqueries; c++)
+		{
+			for(n = 0; n < filter->nbranches; n++)
+			{
+				if(BITSET_TEST(queries[c].contains, n))
+				{
+					write_pair(out, &(queries[c].oid), &(filter->branches[n]));
+				}
+			}
+		}
+		return;
+	}
+	output_puts(out, "commit");
+	for(n = 0; n < filter->nbranches; n++)
+	{
+		output_putc(out, '\t');
+		output_puts(out, filter->branches[n].name);
+	}
+	output_putc(out, '\n');
+	for(c = 0; c < nqueries; c++)
+	{
+		output_hex(out, &(queries[c].oid));
+		for(n = 0; n < filter->nbranches; n++)
+		{
+			output_putc(out, '\t');
+			output_putc(out, BITSET_TEST(queries[c].contains, n) ? '1' : '0');
+		}
+		output_putc(out, '\n');
+	}
+}
+
+/* Write the earliest tag containing each commit; -z and --binary write a
+ * record for each commit which has one instead
+ */
+static void
+write_first(OUTPUT *out, const struct query_struct *queries, const struct branch_struct **first, size_t nqueries)
+{
+	size_t c;
+
+	switch(output_format(out))
+	{
+	case OUTPUT_JSON:
+		output_puts(out, "{\"first\":[");
+		for(c = 0; c < nqueries; c++)
+		{
+			output_puts(out, c ? ",{\"commit\":\"" : "{\"commit\":\"");
+			output_hex(out, &(queries[c].oid));
+			output_puts(out, "\",\"tag\":");
+			if(first[c])
+			{
+				output_json_string(out, first[c]->name);
+			}
+			else
+			{
+				output_puts(out, "null");
+			}
+			output_putc(out, '}');
+		}
+		output_puts(out, "]}\n");
+		return;
+	case OUTPUT_NUL:
+	case OUTPUT_BINARY:
+		for(c = 0; c < nqueries; c++)
+		{
+			if(first[c])
+			{
+				write_pair(out, &(queries[c].oid), first[c]);
+			}
+		}
+		return;
+	}
+	output_puts(out, "commit\ttag\n");
+	for(c = 0; c < nqueries; c++)
+	{
+		output_hex(out, &(queries[c].oid));
+		output_putc(out, '\t');
+		output_puts(out, first[c] ? first[c]->name : "");
+		output_putc(out, '\n');
+	}
+}
+
+/* Find and report the earliest tag containing each of the queries */
+static void
+report_first(REPO *repo, COMMIT_GRAPH *graph, struct branch_filter_struct *filter, const struct query_struct *queries, size_t nqueries, int batch, OUTPUT *out)
+{
+	struct branch_struct **tags;
+	const struct branch_struct **found;
+	size_t q, ntags;
+
+	tags = order_tags(repo->repo, graph, filter, &ntags);
+	found = (const struct branch_struct **) xalloc((nqueries + 1) * sizeof(struct branch_struct *));
+	for(q = 0; q < nqueries; q++)
+	{
+		found[q] = first_tag(repo->repo, graph, tags, ntags, &(queries[q].oid));
+	}
+	if(batch)
+	{
+		write_first(out, queries, found, nqueries);
+	}
+	else if(found[0])
+	{
+		write_pair(out, &(queries[0].oid), found[0]);
+	}
+	free(found);
+	free(tags);
+}
+
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s COMMIT [PATH-TO-REPO]\nHonours GIT_DIR if set.\n", progname);
+	fprintf(stderr, "Usage: %s [OPTIONS] REVISION [PATH-TO-REPO]\n       %s [OPTIONS] --stdin [PATH-TO-REPO]\nHonours GIT_DIR if set. OPTIONS is one or more of:\n", progname, progname);
+	fprintf(stderr,
+			"  -h, --help    Print this usage message and exit\n"
+			"  --stdin       Read revisions from standard input, one per line, and\n"
+			"                write a matrix of which branches contain them\n"
+			"  --json        Write the matrix as JSON rather than tab-separated values\n"
+			"                (or, for a single revision, each containing reference\n"
+			"                as a JSON object on its own line)\n"
+			"  -z            Write the commit, name and type of each containing\n"
+			"                reference separated by tabs, ending each with NUL\n"
+			"  --binary      Write each commit and containing reference as the\n"
+			"                commit's 20-byte object ID followed by the reference's\n"
+			"                name, prefixed with its length as a 32-bit big-endian\n"
+			"                number\n"
+			"  -j, --jobs=N  Check each branch separately, using N threads (or one\n"
+			"                per processor if N is 0)\n"
+			"  --cache       Use (and update) the containment cache\n"
+			"  --tags        Check tags as well as branches\n"
+			"  --first       Report only the earliest tag containing each commit\n"
+			"  --bloom       Use (and update) the branches' Bloom filters to rule\n"
+			"                out branches which can't contain a commit\n"
+			"  --include=PATTERN  Only check references matching PATTERN (may be\n"
+			"                given more than once)\n"
+			"  --exclude=PATTERN  Don't check references matching PATTERN\n"
+			"  --frontier    Report only the containing references which don't\n"
+			"                descend from another containing reference\n");
 }
 
 int
-main(int argc, char **argv)
+branchfor_main(int argc, char **argv)
 {
-	git_buf pathbuf;
-	size_t size;
-	const char *path, *commit;
-	const git_error *err;
-	git_repository *repo;
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "stdin", no_argument, NULL, OPT_STDIN },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "cache", no_argument, NULL, OPT_CACHE },
+		{ "tags", no_argument, NULL, OPT_TAGS },
+		{ "first", no_argument, NULL, OPT_FIRST },
+		{ "bloom", no_argument, NULL, OPT_BLOOM },
+		{ "include", required_argument, NULL, OPT_INCLUDE },
+		{ "exclude", required_argument, NULL, OPT_EXCLUDE },
+		{ "frontier", no_argument, NULL, OPT_FRONTIER },
+		{ "binary", no_argument, NULL, OPT_BINARY },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *path;
+	REPO *repo;
 	struct branch_filter_struct filter;
+	REF_FILTER *refs;
+	struct query_struct *queries;
+	COMMIT_GRAPH *graph;
+	CONTAINS_CACHE *cache;
+	OUTPUT *out;
+	uint64_t *bits;
 	git_oid oid;
-	
-	path = NULL;
-	if(argc == 3)
+	size_t n, nqueries, nwords;
+	int c, batch, format, jobs, usecache, dirty, tags, first, usebloom, frontier;
+
+	batch = 0;
+	usecache = 0;
+	tags = 0;
+	first = 0;
+	usebloom = 0;
+	frontier = 0;
+	refs = ref_filter_create();
+	format = OUTPUT_TEXT;
+	jobs = 1;
+	while((c = getopt_long(argc, argv, "hj:z", longopts, NULL)) != -1)
 	{
-		path = argv[2];
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case OPT_STDIN:
+			batch = 1;
+			break;
+		case OPT_JSON:
+			format = OUTPUT_JSON;
+			break;
+		case 'z':
+			format = OUTPUT_NUL;
+			break;
+		case OPT_BINARY:
+			format = OUTPUT_BINARY;
+			break;
+		case OPT_CACHE:
+			usecache = 1;
+			break;
+		case OPT_TAGS:
+			tags = 1;
+			break;
+		case OPT_FIRST:
+			first = 1;
+			break;
+		case OPT_BLOOM:
+			usebloom = 1;
+			break;
+		case OPT_INCLUDE:
+			ref_filter_add(refs, optarg, 0);
+			break;
+		case OPT_EXCLUDE:
+			ref_filter_add(refs, optarg, 1);
+			break;
+		case OPT_FRONTIER:
+			frontier = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if(jobs < 1)
+			{
+				jobs = nprocessors();
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
 	}
-	else if(argc != 2)
+	if(argc - optind < !batch || argc - optind > !batch + 1)
 	{
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	commit = argv[1];
-	if(!path)
+	path = NULL;
+	if(argc - optind > !batch)
+	{
+		path = argv[optind + !batch];
+	}
+	if(jobs > 1)
 	{
-		path = getenv("GIT_DIR");
+		/* Required for libgit2 to be used from multiple threads */
+		git_libgit2_init();
 	}
-	memset(&pathbuf, 0, sizeof(pathbuf));
-	if(!path)
+	repo = repo_open(argv[0], path, SQLITE_OPEN_READONLY, 0);
+	if(!repo)
 	{
-		if(git_repository_discover(&pathbuf, ".", 0, "/"))
+		exit(EXIT_FAILURE);
+	}
+	graph = commit_graph_open(repo->repo);
+	memset(&filter, 0, sizeof(filter));
+	filter.repo = repo->repo;
+	filter.graph = graph;
+	filter.arena = repo->arena;
+	filter.cb = branch_callback;
+	filter.type = GIT_BRANCH_LOCAL | GIT_BRANCH_REMOTE;
+	if(tags)
+	{
+		filter.type |= REF_TAG;
+	}
+	if(first)
+	{
+		/* Only tags are considered when looking for the first release */
+		filter.type = REF_TAG;
+	}
+	ref_filter_foreach(refs, repo->repo, filter.type, filter.cb, &filter);
+	ref_filter_free(refs);
+
+	if(batch)
+	{
+		queries = read_queries(repo, graph, stdin, &nqueries);
+	}
+	else
+	{
+		if(resolve_commit(repo->repo, graph, NULL, argv[optind], &oid))
 		{
-			err = giterr_last();
-			fprintf(stderr, "%s: %s\n", path, err->message);
+			fprintf(stderr, "%s: unable to find a commit for '%s'\n", repo->progname, argv[optind]);
+			repo_close(repo);
 			exit(EXIT_FAILURE);
 		}
-		path = pathbuf.ptr;
+		queries = (struct query_struct *) xalloc(sizeof(struct query_struct));
+		git_oid_cpy(&(queries[0].oid), &oid);
+		nqueries = 1;
 	}
-	if(git_repository_open(&repo, path))
+	nwords = filter.nbranches / 64 + 1;
+	bits = (uint64_t *) xalloc((nqueries + 1) * 3 * nwords * sizeof(uint64_t));
+	for(n = 0; n < nqueries; n++)
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
+		queries[n].node = NULL;
+		queries[n].contains = &(bits[n * 3 * nwords]);
+		queries[n].known = &(bits[(n * 3 + 1) * nwords]);
+		queries[n].frontier = &(bits[(n * 3 + 2) * nwords]);
+	}
+	out = output_open(STDOUT_FILENO, format);
+	if(first)
+	{
+		report_first(repo, graph, &filter, queries, nqueries, batch, out);
+	}
+	else
+	{
+		cache = NULL;
+		dirty = 0;
+		if(usecache)
+		{
+			cache = contains_cache_open(repo->repo);
+			dirty = resolve_cache(repo, graph, cache, &filter, queries, nqueries);
+		}
+		if(usebloom)
+		{
+			resolve_bloom(repo, graph, &filter, queries, nqueries);
+		}
+		if(frontier)
+		{
+			resolve_frontier(repo, graph, &filter, queries, nqueries);
+		}
+		else if(resolve_walk(repo, graph, &filter, queries, nqueries, jobs))
+		{
+			/* The failing threads have already said why */
+			contains_cache_close(cache);
+			repo_close(repo);
+			exit(EXIT_FAILURE);
+		}
+		if(cache)
+		{
+			if(dirty)
+			{
+				update_cache(repo, cache, &filter, queries, nqueries);
+			}
+			contains_cache_close(cache);
+		}
+		for(n = 0; frontier && n < nqueries; n++)
+		{
+			memcpy(queries[n].contains, queries[n].frontier, nwords * sizeof(uint64_t));
+		}
+		if(batch)
+		{
+			write_matrix(out, &filter, queries, nqueries);
+		}
+		else
+		{
+			for(n = 0; n < filter.nbranches; n++)
+			{
+				if(BITSET_TEST(queries[0].contains, n))
+				{
+					write_pair(out, &oid, &(filter.branches[n]));
+				}
+			}
+		}
+	}
+	free(bits);
+	free(queries);
+	commit_graph_close(graph);
+	free(filter.branches);
+	if(output_close(out))
+	{
+		fprintf(stderr, "%s: failed to write output\n", repo->progname);
+		repo_close(repo);
 		exit(EXIT_FAILURE);
 	}
-	if(git_oid_fromstr(&oid, commit))
+	repo_close(repo);
+	if(jobs > 1)
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
-		exit(EXIT_FAILURE);		
+		git_libgit2_shutdown();
 	}
-	git_revwalk_new(&(filter.walker), repo);
-	filter.repo = repo;
-	filter.oid = &oid;
-	filter.cb = branch_callback;
-	filter.type = GIT_BRANCH_LOCAL | GIT_BRANCH_REMOTE;
-	git_reference_foreach(repo, ref_callback, &filter);
-	git_revwalk_free(filter.walker);
-	git_repository_free(repo);
-	git_buf_free(&pathbuf);
 	return 0;
 }
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return branchfor_main(argc, argv);
+}
+#endif
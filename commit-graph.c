@@ -0,0 +1,878 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "commit-graph.h"
+#include "refdb.h"
+
+/* The file is laid out as follows, with all integers stored big-endian:
+ *
+ *   "CGEN"                     Signature
+ *   uint32 version             Currently 1
+ *   uint32 count               The number of commits (N)
+ *   uint32 nextra              The number of extra parent edges (E)
+ *   uint32 fanout[256]         fanout[n] is the number of commits whose first
+ *                              OID byte is <= n
+ *   uint8 oids[N][20]          Commit OIDs, sorted
+ *   records[N]                 One per commit, in the same order as the OIDs:
+ *       uint32 parent1         Position of the first parent, or GRAPH_NONE
+ *       uint32 parent2         Position of the second parent, GRAPH_NONE, or
+ *                              (for octopus merges) GRAPH_EXTRA | the index
+ *                              of the first of the remaining parents in
+ *                              the extra edge list
+ *       uint32 generation
+ *       uint32 time_hi         Commit time (seconds since the epoch)
+ *       uint32 time_lo
+ *   uint32 extra[E]            Extra parent edges; the final parent of each
+ *                              octopus merge has GRAPH_EXTRA set
+ */
+
+#define GRAPH_SIGNATURE                 "CGEN"
+#define GRAPH_VERSION                   1
+#define GRAPH_EXTRA                     0x80000000U
+#define GRAPH_HEADER_SIZE               (16 + 256 * 4)
+#define GRAPH_RECORD_SIZE               20
+
+struct commit_graph_struct
+{
+	/* The mapped file */
+	const unsigned char *base;
+	size_t size;
+	uint32_t count;
+	uint32_t nextra;
+	const unsigned char *fanout;
+	const unsigned char *oids;
+	const unsigned char *records;
+	const unsigned char *extra;
+};
+
+/* An entry in the table being built by commit_graph_update() */
+struct graph_entry_struct
+{
+	git_oid oid;
+	uint32_t generation;
+	git_time_t time;
+	/* The parents of this commit, as an index into the parent OID list */
+	uint32_t nparents;
+	size_t firstparent;
+};
+
+/* The state used when pushing each reference's tip onto a revision walk */
+struct push_tips_struct
+{
+	git_revwalk *walker;
+	const COMMIT_GRAPH *graph;
+};
+
+struct graph_build_struct
+{
+	struct graph_entry_struct *entries;
+	size_t count;
+	size_t nalloc;
+	git_oid *parents;
+	size_t nparents;
+	size_t parentalloc;
+	/* The positions of new entries, hashed by OID */
+	size_t *table;
+	size_t tablesize;
+};
+
+/* A set of OIDs, used to track the commits visited by commit_graph_walk() */
+struct oid_set_struct
+{
+	git_oid *oids;
+	unsigned char *used;
+	size_t size;
+	size_t count;
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+static size_t
+oid_hash(const git_oid *oid)
+{
+	/* Object IDs are already uniformly distributed */
+	return (size_t) oid->id[0] << 24 | (size_t) oid->id[1] << 16 | (size_t) oid->id[2] << 8 | (size_t) oid->id[3];
+}
+
+/* Determine the path to a repository's commit graph */
+static char *
+graph_path(git_repository *repo)
+{
+	const char *gitdir;
+	char *path;
+
+	gitdir = git_repository_path(repo);
+	path = (char *) xalloc(strlen(gitdir) + strlen(GRAPH_FILENAME) + 8);
+	strcpy(path, gitdir);
+	if(path[0] && path[strlen(path) - 1] != '/')
+	{
+		strcat(path, "/");
+	}
+	strcat(path, GRAPH_FILENAME);
+	return path;
+}
+
+/* Map the commit graph of a repository, returning NULL if there isn't one (or
+ * it isn't valid)
+ */
+COMMIT_GRAPH *
+commit_graph_open(git_repository *repo)
+{
+	COMMIT_GRAPH *graph;
+	char *path;
+	struct stat sbuf;
+	void *base;
+	int fd;
+
+	path = graph_path(repo);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if(fd == -1)
+	{
+		return NULL;
+	}
+	if(fstat(fd, &sbuf) || sbuf.st_size < GRAPH_HEADER_SIZE)
+	{
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		return NULL;
+	}
+	graph = (COMMIT_GRAPH *) xalloc(sizeof(COMMIT_GRAPH));
+	graph->base = (const unsigned char *) base;
+	graph->size = sbuf.st_size;
+	graph->count = get32(graph->base + 8);
+	graph->nextra = get32(graph->base + 12);
+	graph->fanout = graph->base + 16;
+	graph->oids = graph->fanout + 256 * 4;
+	graph->records = graph->oids + (size_t) graph->count * GIT_OID_RAWSZ;
+	graph->extra = graph->records + (size_t) graph->count * GRAPH_RECORD_SIZE;
+	if(memcmp(graph->base, GRAPH_SIGNATURE, 4) ||
+	   get32(graph->base + 4) != GRAPH_VERSION ||
+	   get32(graph->fanout + 255 * 4) != graph->count ||
+	   graph->size != GRAPH_HEADER_SIZE + (size_t) graph->count * (GIT_OID_RAWSZ + GRAPH_RECORD_SIZE) + (size_t) graph->nextra * 4)
+	{
+		commit_graph_close(graph);
+		return NULL;
+	}
+	return graph;
+}
+
+/* Unmap a commit graph */
+void
+commit_graph_close(COMMIT_GRAPH *graph)
+{
+	if(!graph)
+	{
+		return;
+	}
+	munmap((void *) graph->base, graph->size);
+	free(graph);
+}
+
+/* Return the number of commits in the graph */
+uint32_t
+commit_graph_count(const COMMIT_GRAPH *graph)
+{
+	return graph ? graph->count : 0;
+}
+
+/* Find the position of a commit within the graph, returning GRAPH_NONE if it
+ * isn't present
+ */
+uint32_t
+commit_graph_find(const COMMIT_GRAPH *graph, const git_oid *oid)
+{
+	uint32_t lo, hi, mid;
+	int r;
+
+	if(!graph)
+	{
+		return GRAPH_NONE;
+	}
+	lo = oid->id[0] ? get32(graph->fanout + (oid->id[0] - 1) * 4) : 0;
+	hi = get32(graph->fanout + oid->id[0] * 4);
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		r = memcmp(graph->oids + (size_t) mid * GIT_OID_RAWSZ, oid->id, GIT_OID_RAWSZ);
+		if(!r)
+		{
+			return mid;
+		}
+		if(r < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return GRAPH_NONE;
+}
+
+/* Obtain the OID of the commit at a given position */
+void
+commit_graph_oid(const COMMIT_GRAPH *graph, uint32_t pos, git_oid *out)
+{
+	git_oid_fromraw(out, graph->oids + (size_t) pos * GIT_OID_RAWSZ);
+}
+
+/* Obtain the generation number of the commit at a given position */
+uint32_t
+commit_graph_generation(const COMMIT_GRAPH *graph, uint32_t pos)
+{
+	return get32(graph->records + (size_t) pos * GRAPH_RECORD_SIZE + 8);
+}
+
+/* Obtain the commit time of the commit at a given position */
+git_time_t
+commit_graph_time(const COMMIT_GRAPH *graph, uint32_t pos)
+{
+	const unsigned char *rec;
+
+	rec = graph->records + (size_t) pos * GRAPH_RECORD_SIZE;
+	return (git_time_t) ((uint64_t) get32(rec + 12) << 32 | get32(rec + 16));
+}
+
+/* Obtain the number of parents of the commit at a given position */
+unsigned int
+commit_graph_parentcount(const COMMIT_GRAPH *graph, uint32_t pos)
+{
+	const unsigned char *rec;
+	uint32_t p2, n;
+	unsigned int count;
+
+	rec = graph->records + (size_t) pos * GRAPH_RECORD_SIZE;
+	if(get32(rec) == GRAPH_NONE)
+	{
+		return 0;
+	}
+	p2 = get32(rec + 4);
+	if(p2 == GRAPH_NONE)
+	{
+		return 1;
+	}
+	if(!(p2 & GRAPH_EXTRA))
+	{
+		return 2;
+	}
+	count = 1;
+	for(n = p2 & ~GRAPH_EXTRA; n < graph->nextra; n++)
+	{
+		count++;
+		if(get32(graph->extra + (size_t) n * 4) & GRAPH_EXTRA)
+		{
+			break;
+		}
+	}
+	return count;
+}
+
+/* Obtain the position of the nth parent of the commit at a given position */
+uint32_t
+commit_graph_parent(const COMMIT_GRAPH *graph, uint32_t pos, unsigned int n)
+{
+	const unsigned char *rec;
+	uint32_t p2;
+
+	rec = graph->records + (size_t) pos * GRAPH_RECORD_SIZE;
+	if(n == 0)
+	{
+		return get32(rec);
+	}
+	p2 = get32(rec + 4);
+	if(!(p2 & GRAPH_EXTRA) || p2 == GRAPH_NONE)
+	{
+		return n == 1 ? p2 : GRAPH_NONE;
+	}
+	return get32(graph->extra + (size_t) ((p2 & ~GRAPH_EXTRA) + n - 1) * 4) & ~GRAPH_EXTRA;
+}
+
+/* Return the generation number of a commit, or GENERATION_INFINITY if it
+ * isn't in the graph (or there is no graph)
+ */
+uint32_t
+commit_generation(const COMMIT_GRAPH *graph, const git_oid *oid)
+{
+	uint32_t pos;
+
+	pos = commit_graph_find(graph, oid);
+	if(pos == GRAPH_NONE)
+	{
+		return GENERATION_INFINITY;
+	}
+	return commit_graph_generation(graph, pos);
+}
+
+/* Add an OID to a set, returning zero if it was already present */
+static int
+oid_set_add(struct oid_set_struct *set, const git_oid *oid)
+{
+	git_oid *oldoids;
+	unsigned char *oldused;
+	size_t c, n, oldsize;
+
+	if((set->count + 1) * 2 > set->size)
+	{
+		oldoids = set->oids;
+		oldused = set->used;
+		oldsize = set->size;
+		set->size = oldsize ? oldsize * 2 : 256;
+		set->oids = (git_oid *) xalloc(set->size * sizeof(git_oid));
+		set->used = (unsigned char *) xalloc(set->size);
+		for(c = 0; c < oldsize; c++)
+		{
+			if(!oldused[c])
+			{
+				continue;
+			}
+			for(n = oid_hash(&(oldoids[c])) & (set->size - 1); set->used[n]; n = (n + 1) & (set->size - 1));
+			git_oid_cpy(&(set->oids[n]), &(oldoids[c]));
+			set->used[n] = 1;
+		}
+		free(oldoids);
+		free(oldused);
+	}
+	for(n = oid_hash(oid) & (set->size - 1); set->used[n]; n = (n + 1) & (set->size - 1))
+	{
+		if(!git_oid_cmp(&(set->oids[n]), oid))
+		{
+			return 0;
+		}
+	}
+	git_oid_cpy(&(set->oids[n]), oid);
+	set->used[n] = 1;
+	set->count++;
+	return 1;
+}
+
+/* Visit every commit reachable from tip whose generation number is at least
+ * mingen (and every reachable commit which isn't in the graph), stopping as
+ * soon as the callback returns nonzero; returns the callback's result, zero if
+ * the walk completed, or -1 on error
+ */
+int
+commit_graph_walk(const COMMIT_GRAPH *graph, git_repository *repo, const git_oid *tip, uint32_t mingen, int (*cb)(const git_oid *oid, void *data), void *data)
+{
+	struct oid_set_struct seen;
+	git_oid *stack, oid, parent;
+	git_commit *obj;
+	size_t depth, stacksize;
+	uint32_t pos;
+	unsigned int c, count;
+	int result;
+
+	memset(&seen, 0, sizeof(seen));
+	stacksize = 64;
+	stack = (git_oid *) xalloc(stacksize * sizeof(git_oid));
+	git_oid_cpy(&(stack[0]), tip);
+	depth = 1;
+	oid_set_add(&seen, tip);
+	result = 0;
+	while(depth)
+	{
+		git_oid_cpy(&oid, &(stack[--depth]));
+		pos = commit_graph_find(graph, &oid);
+		obj = NULL;
+		if(pos != GRAPH_NONE)
+		{
+			/* Everything below this point is older still */
+			if(commit_graph_generation(graph, pos) < mingen)
+			{
+				continue;
+			}
+			count = commit_graph_parentcount(graph, pos);
+		}
+		else
+		{
+			if(git_commit_lookup(&obj, repo, &oid))
+			{
+				result = -1;
+				break;
+			}
+			count = git_commit_parentcount(obj);
+		}
+		result = cb(&oid, data);
+		if(result)
+		{
+			git_commit_free(obj);
+			break;
+		}
+		for(c = 0; c < count; c++)
+		{
+			if(obj)
+			{
+				git_oid_cpy(&parent, git_commit_parent_id(obj, c));
+			}
+			else
+			{
+				commit_graph_oid(graph, commit_graph_parent(graph, pos, c), &parent);
+			}
+			if(!oid_set_add(&seen, &parent))
+			{
+				continue;
+			}
+			if(depth == stacksize)
+			{
+				stacksize *= 2;
+				stack = (git_oid *) xrealloc(stack, stacksize * sizeof(git_oid));
+			}
+			git_oid_cpy(&(stack[depth++]), &parent);
+		}
+		git_commit_free(obj);
+	}
+	free(stack);
+	free(seen.oids);
+	free(seen.used);
+	return result;
+}
+
+static int
+reachable_cb(const git_oid *oid, void *data)
+{
+	return !git_oid_cmp(oid, (const git_oid *) data);
+}
+
+/* Determine whether ancestor is reachable from commit, never walking below
+ * the ancestor's generation number; returns 1 if it is, 0 if it isn't, or -1
+ * on error
+ */
+int
+commit_reachable(const COMMIT_GRAPH *graph, git_repository *repo, const git_oid *commit, const git_oid *ancestor)
+{
+	uint32_t agen;
+	int result;
+
+	if(!git_oid_cmp(commit, ancestor))
+	{
+		return 1;
+	}
+	if(!graph)
+	{
+		result = git_graph_descendant_of(repo, commit, ancestor);
+		return result < 0 ? -1 : result;
+	}
+	agen = commit_generation(graph, ancestor);
+	if(agen == GENERATION_INFINITY && commit_graph_find(graph, commit) != GRAPH_NONE)
+	{
+		/* The ancestor is newer than anything in the graph */
+		return 0;
+	}
+	return commit_graph_walk(graph, repo, commit, agen, reachable_cb, (void *) ancestor);
+}
+
+static struct graph_entry_struct *
+build_add(struct graph_build_struct *build, const git_oid *oid, uint32_t generation, git_time_t time)
+{
+	struct graph_entry_struct *entry;
+
+	if(build->count == build->nalloc)
+	{
+		build->nalloc = build->nalloc ? build->nalloc * 2 : 1024;
+		build->entries = (struct graph_entry_struct *) xrealloc(build->entries, build->nalloc * sizeof(struct graph_entry_struct));
+	}
+	entry = &(build->entries[build->count++]);
+	git_oid_cpy(&(entry->oid), oid);
+	entry->generation = generation;
+	entry->time = time;
+	entry->nparents = 0;
+	entry->firstparent = build->nparents;
+	return entry;
+}
+
+static void
+build_add_parent(struct graph_build_struct *build, struct graph_entry_struct *entry, const git_oid *oid)
+{
+	if(build->nparents == build->parentalloc)
+	{
+		build->parentalloc = build->parentalloc ? build->parentalloc * 2 : 1024;
+		build->parents = (git_oid *) xrealloc(build->parents, build->parentalloc * sizeof(git_oid));
+	}
+	git_oid_cpy(&(build->parents[build->nparents++]), oid);
+	entry->nparents++;
+}
+
+/* Record the position of a newly-added entry in the build's hash table */
+static void
+build_index(struct graph_build_struct *build, size_t index)
+{
+	size_t *oldtable;
+	size_t c, n, oldsize;
+
+	if((build->count + 1) * 2 > build->tablesize)
+	{
+		oldtable = build->table;
+		oldsize = build->tablesize;
+		build->tablesize = oldsize ? oldsize * 2 : 1024;
+		build->table = (size_t *) xalloc(build->tablesize * sizeof(size_t));
+		for(c = 0; c < oldsize; c++)
+		{
+			if(!oldtable[c])
+			{
+				continue;
+			}
+			for(n = oid_hash(&(build->entries[oldtable[c] - 1].oid)) & (build->tablesize - 1); build->table[n]; n = (n + 1) & (build->tablesize - 1));
+			build->table[n] = oldtable[c];
+		}
+		free(oldtable);
+	}
+	for(n = oid_hash(&(build->entries[index].oid)) & (build->tablesize - 1); build->table[n]; n = (n + 1) & (build->tablesize - 1));
+	build->table[n] = index + 1;
+}
+
+/* Find the generation number of an entry which has already been added */
+static uint32_t
+build_generation(struct graph_build_struct *build, const COMMIT_GRAPH *graph, const git_oid *oid)
+{
+	uint32_t pos;
+	size_t n;
+
+	pos = commit_graph_find(graph, oid);
+	if(pos != GRAPH_NONE)
+	{
+		return commit_graph_generation(graph, pos);
+	}
+	if(!build->tablesize)
+	{
+		return 0;
+	}
+	for(n = oid_hash(oid) & (build->tablesize - 1); build->table[n]; n = (n + 1) & (build->tablesize - 1))
+	{
+		if(!git_oid_cmp(&(build->entries[build->table[n] - 1].oid), oid))
+		{
+			return build->entries[build->table[n] - 1].generation;
+		}
+	}
+	return 0;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&(((const struct graph_entry_struct *) a)->oid), &(((const struct graph_entry_struct *) b)->oid));
+}
+
+/* Find the position of an OID within the sorted entries */
+static uint32_t
+build_find(const struct graph_build_struct *build, const git_oid *oid)
+{
+	struct graph_entry_struct key, *entry;
+
+	git_oid_cpy(&(key.oid), oid);
+	entry = (struct graph_entry_struct *) bsearch(&key, build->entries, build->count, sizeof(struct graph_entry_struct), entry_cmp);
+	if(!entry)
+	{
+		return GRAPH_NONE;
+	}
+	return (uint32_t) (entry - build->entries);
+}
+
+/* Write the sorted entries to a new file and move it into place */
+static int
+build_write(REPO *repo, struct graph_build_struct *build)
+{
+	unsigned char buf[GRAPH_HEADER_SIZE], rec[GRAPH_RECORD_SIZE];
+	uint32_t *extra, p, fanout[256];
+	size_t c, n, nextra, extraalloc;
+	struct graph_entry_struct *entry;
+	char *path, *tmppath;
+	FILE *f;
+	int fd;
+
+	qsort(build->entries, build->count, sizeof(struct graph_entry_struct), entry_cmp);
+	path = graph_path(repo->repo);
+	tmppath = (char *) xalloc(strlen(path) + 8);
+	strcpy(tmppath, path);
+	strcat(tmppath, ".lock");
+	/* The graph is only ever written on request, so a lock held by another
+	 * process is an error rather than something to skip quietly
+	 */
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if(fd == -1)
+	{
+		if(errno == EEXIST)
+		{
+			fprintf(stderr, "%s: %s: already exists; another process may be updating the commit graph\n", repo->progname, tmppath);
+		}
+		else
+		{
+			fprintf(stderr, "%s: %s: %s\n", repo->progname, tmppath, strerror(errno));
+		}
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	f = fdopen(fd, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", repo->progname, tmppath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	memset(fanout, 0, sizeof(fanout));
+	for(c = 0; c < build->count; c++)
+	{
+		fanout[build->entries[c].oid.id[0]]++;
+	}
+	for(c = 1; c < 256; c++)
+	{
+		fanout[c] += fanout[c - 1];
+	}
+	extra = NULL;
+	nextra = 0;
+	extraalloc = 0;
+	memcpy(buf, GRAPH_SIGNATURE, 4);
+	put32(buf + 4, GRAPH_VERSION);
+	put32(buf + 8, (uint32_t) build->count);
+	/* The extra edge count is filled in once it's known */
+	put32(buf + 12, 0);
+	for(c = 0; c < 256; c++)
+	{
+		put32(buf + 16 + c * 4, fanout[c]);
+	}
+	fwrite(buf, GRAPH_HEADER_SIZE, 1, f);
+	for(c = 0; c < build->count; c++)
+	{
+		fwrite(build->entries[c].oid.id, GIT_OID_RAWSZ, 1, f);
+	}
+	for(c = 0; c < build->count; c++)
+	{
+		entry = &(build->entries[c]);
+		put32(rec, entry->nparents > 0 ? build_find(build, &(build->parents[entry->firstparent])) : GRAPH_NONE);
+		if(entry->nparents > 2)
+		{
+			put32(rec + 4, GRAPH_EXTRA | (uint32_t) nextra);
+			for(n = 1; n < entry->nparents; n++)
+			{
+				if(nextra == extraalloc)
+				{
+					extraalloc = extraalloc ? extraalloc * 2 : 64;
+					extra = (uint32_t *) xrealloc(extra, extraalloc * sizeof(uint32_t));
+				}
+				p = build_find(build, &(build->parents[entry->firstparent + n]));
+				if(n + 1 == entry->nparents)
+				{
+					p |= GRAPH_EXTRA;
+				}
+				extra[nextra++] = p;
+			}
+		}
+		else
+		{
+			put32(rec + 4, entry->nparents > 1 ? build_find(build, &(build->parents[entry->firstparent + 1])) : GRAPH_NONE);
+		}
+		put32(rec + 8, entry->generation);
+		put32(rec + 12, (uint32_t) ((uint64_t) entry->time >> 32));
+		put32(rec + 16, (uint32_t) ((uint64_t) entry->time & 0xffffffff));
+		fwrite(rec, GRAPH_RECORD_SIZE, 1, f);
+	}
+	for(c = 0; c < nextra; c++)
+	{
+		put32(rec, extra[c]);
+		fwrite(rec, 4, 1, f);
+	}
+	free(extra);
+	put32(rec, (uint32_t) nextra);
+	if(fseek(f, 12, SEEK_SET) || fwrite(rec, 4, 1, f) != 1 || fclose(f))
+	{
+		fprintf(stderr, "%s: %s: %s\n", repo->progname, tmppath, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	if(rename(tmppath, path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", repo->progname, path, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	free(tmppath);
+	free(path);
+	return 0;
+}
+
+/* Push a reference's tip onto the walk, unless it's already in the graph (in
+ * which case it would be hidden anyway); references to anything other than
+ * commits are ignored, as they are by git_revwalk_push_glob()
+ */
+static int
+push_tip(const struct ref_view_struct *ref, void *data)
+{
+	struct push_tips_struct *tips;
+	const git_oid *tip;
+
+	tips = (struct push_tips_struct *) data;
+	tip = ref->peeled ? ref->peeled : &(ref->oid);
+	if(commit_graph_find(tips->graph, tip) == GRAPH_NONE)
+	{
+		git_revwalk_push(tips->walker, tip);
+	}
+	return 0;
+}
+
+/* Bring a repository's commit graph up to date, adding the commits reachable
+ * from its references which aren't already present (or rebuilding it from
+ * scratch if rebuild is nonzero); returns the number of commits added, or -1
+ * on error
+ */
+long
+commit_graph_update(REPO *repo, int rebuild)
+{
+	struct graph_build_struct build;
+	struct graph_entry_struct *entry;
+	struct push_tips_struct tips;
+	COMMIT_GRAPH *graph;
+	REFDB *db;
+	git_revwalk *walker;
+	git_commit *commit;
+	git_oid oid, parent;
+	const git_error *err;
+	unsigned char *haschild;
+	uint32_t c, n, count, generation, pgen;
+	size_t added;
+
+	graph = rebuild ? NULL : commit_graph_open(repo->repo);
+	if(git_revwalk_new(&walker, repo->repo))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s\n", repo->progname, err->message);
+		commit_graph_close(graph);
+		return -1;
+	}
+	/* Parents must be added before their children */
+	git_revwalk_sorting(walker, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+	tips.walker = walker;
+	tips.graph = graph;
+	db = refdb_open(repo->repo);
+	refdb_foreach(db, "refs/", push_tip, &tips);
+	refdb_close(db);
+	git_revwalk_push_head(walker);
+	/* Hide the existing graph's tips (the commits which aren't the parent of
+	 * any other), which hides everything in the graph because it's closed
+	 * under ancestry
+	 */
+	count = commit_graph_count(graph);
+	if(count)
+	{
+		haschild = (unsigned char *) xalloc(count);
+		for(c = 0; c < count; c++)
+		{
+			for(n = 0; n < commit_graph_parentcount(graph, c); n++)
+			{
+				haschild[commit_graph_parent(graph, c, n)] = 1;
+			}
+		}
+		for(c = 0; c < count; c++)
+		{
+			if(!haschild[c])
+			{
+				commit_graph_oid(graph, c, &oid);
+				git_revwalk_hide(walker, &oid);
+			}
+		}
+		free(haschild);
+	}
+	memset(&build, 0, sizeof(build));
+	while(!git_revwalk_next(&oid, walker))
+	{
+		if(commit_graph_find(graph, &oid) != GRAPH_NONE)
+		{
+			continue;
+		}
+		if(git_commit_lookup(&commit, repo->repo, &oid))
+		{
+			err = giterr_last();
+			fprintf(stderr, "%s: %s\n", repo->progname, err->message);
+			git_revwalk_free(walker);
+			commit_graph_close(graph);
+			return -1;
+		}
+		generation = 1;
+		entry = build_add(&build, &oid, 0, git_commit_time(commit));
+		count = git_commit_parentcount(commit);
+		for(c = 0; c < count; c++)
+		{
+			git_oid_cpy(&parent, git_commit_parent_id(commit, c));
+			/* Parents which are missing (for example, in a shallow clone)
+			 * are omitted, so that the commit is treated as a root
+			 */
+			pgen = build_generation(&build, graph, &parent);
+			if(!pgen)
+			{
+				continue;
+			}
+			if(pgen + 1 > generation)
+			{
+				generation = pgen + 1;
+			}
+			build_add_parent(&build, entry, &parent);
+		}
+		entry->generation = generation;
+		build_index(&build, build.count - 1);
+		git_commit_free(commit);
+	}
+	git_revwalk_free(walker);
+	added = build.count;
+	if(added || rebuild)
+	{
+		/* Carry the existing graph's entries over */
+		count = commit_graph_count(graph);
+		for(c = 0; c < count; c++)
+		{
+			commit_graph_oid(graph, c, &oid);
+			entry = build_add(&build, &oid, commit_graph_generation(graph, c), commit_graph_time(graph, c));
+			for(n = 0; n < commit_graph_parentcount(graph, c); n++)
+			{
+				commit_graph_oid(graph, commit_graph_parent(graph, c, n), &parent);
+				build_add_parent(&build, entry, &parent);
+			}
+		}
+		commit_graph_close(graph);
+		graph = NULL;
+		if(build_write(repo, &build))
+		{
+			added = (size_t) -1;
+		}
+	}
+	commit_graph_close(graph);
+	free(build.entries);
+	free(build.parents);
+	free(build.table);
+	return (long) added;
+}
@@ -0,0 +1,76 @@
+#ifndef COMMIT_GRAPH_H_
+# define COMMIT_GRAPH_H_               1
+
+# include <stdint.h>
+
+# include "utils.h"
+
+/* The commit graph file is a memory-mapped table, stored as
+ * $GIT_DIR/commit-generations, which records for each commit reachable from
+ * the repository's references its parents (as positions within the table),
+ * its generation number and its commit time.
+ *
+ * A commit's generation number is one greater than the largest generation
+ * number of its parents (root commits have a generation of 1), and so an
+ * ancestor always has a lower generation number than any of its descendants.
+ * Walks which are looking for a particular commit can stop descending as soon
+ * as they reach commits whose generation is not greater than the target's.
+ *
+ * Commits which aren't in the table (because they were created since it was
+ * last updated) are treated as having an infinite generation number: the
+ * table is always closed under ancestry, so such a commit can never be an
+ * ancestor of one which is present.
+ */
+
+# define GRAPH_FILENAME                 "commit-generations"
+# define GRAPH_NONE                     0xffffffffU
+# define GENERATION_INFINITY            0xffffffffU
+
+typedef struct commit_graph_struct COMMIT_GRAPH;
+
+/* Map the commit graph of a repository, returning NULL if there isn't one (or
+ * it isn't valid)
+ */
+COMMIT_GRAPH *commit_graph_open(git_repository *repo);
+/* Unmap a commit graph */
+void commit_graph_close(COMMIT_GRAPH *graph);
+/* Return the number of commits in the graph */
+uint32_t commit_graph_count(const COMMIT_GRAPH *graph);
+/* Find the position of a commit within the graph, returning GRAPH_NONE if it
+ * isn't present
+ */
+uint32_t commit_graph_find(const COMMIT_GRAPH *graph, const git_oid *oid);
+/* Obtain the OID of the commit at a given position */
+void commit_graph_oid(const COMMIT_GRAPH *graph, uint32_t pos, git_oid *out);
+/* Obtain the generation number of the commit at a given position */
+uint32_t commit_graph_generation(const COMMIT_GRAPH *graph, uint32_t pos);
+/* Obtain the commit time of the commit at a given position */
+git_time_t commit_graph_time(const COMMIT_GRAPH *graph, uint32_t pos);
+/* Obtain the number of parents of the commit at a given position */
+unsigned int commit_graph_parentcount(const COMMIT_GRAPH *graph, uint32_t pos);
+/* Obtain the position of the nth parent of the commit at a given position */
+uint32_t commit_graph_parent(const COMMIT_GRAPH *graph, uint32_t pos, unsigned int n);
+/* Return the generation number of a commit, or GENERATION_INFINITY if it
+ * isn't in the graph (or there is no graph)
+ */
+uint32_t commit_generation(const COMMIT_GRAPH *graph, const git_oid *oid);
+/* Visit every commit reachable from tip whose generation number is at least
+ * mingen (and every reachable commit which isn't in the graph), stopping as
+ * soon as the callback returns nonzero; returns the callback's result, zero if
+ * the walk completed, or -1 on error
+ */
+int commit_graph_walk(const COMMIT_GRAPH *graph, git_repository *repo, const git_oid *tip, uint32_t mingen, int (*cb)(const git_oid *oid, void *data), void *data);
+/* Determine whether ancestor is reachable from commit, never walking below
+ * the ancestor's generation number; returns 1 if it is, 0 if it isn't, or -1
+ * on error
+ */
+int commit_reachable(const COMMIT_GRAPH *graph, git_repository *repo, const git_oid *commit, const git_oid *ancestor);
+
+/* Bring a repository's commit graph up to date, adding the commits reachable
+ * from its references which aren't already present (or rebuilding it from
+ * scratch if rebuild is nonzero); returns the number of commits added, or -1
+ * on error
+ */
+long commit_graph_update(REPO *repo, int rebuild);
+
+#endif /*!COMMIT_GRAPH_H_*/
@@ -2,72 +2,296 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
 
 #include <git2.h>
 
+#include "config-table.h"
+#include "output.h"
+#include "multicall.h"
+
+#define OPT_JSON                        256
+#define OPT_BINARY                      257
+#define OPT_STDIN                       258
+#define OPT_CACHE                       259
+
+/* The default name of the cache file (see config-table.h), within $GIT_DIR */
+#define CACHE_NAME                      "getall.cache"
+
+/* In batch mode (-k, -e or --stdin), any number of variables, and regular
+ * expressions matching their names, are looked up in the same snapshot of
+ * the configuration, and each value is written along with the name of its
+ * variable
+ */
+struct query_struct
+{
+	char *pattern;
+	int regexp;
+};
+
+struct query_list_struct
+{
+	struct query_struct *queries;
+	size_t nqueries;
+	size_t nalloc;
+};
+
 static int
-config_callback(const git_config_entry *entry, void *data)
+config_callback(const char *name, const char *value, void *data)
 {
-	(void) data;
-	
-	puts(entry->value);
+	OUTPUT *out;
+
+	(void) name;
+
+	out = (OUTPUT *) data;
+	output_begin(out);
+	/* A variable without a value is written as an empty string */
+	output_string(out, "value", value ? value : "");
+	output_end(out);
 	return 0;
 }
 
+static int
+batch_callback(const char *name, const char *value, void *data)
+{
+	OUTPUT *out;
+
+	out = (OUTPUT *) data;
+	output_begin(out);
+	output_string(out, "name", name);
+	output_string(out, "value", value ? value : "");
+	output_end(out);
+	return 0;
+}
+
+static void
+add_query(struct query_list_struct *list, const char *pattern, int regexp)
+{
+	if(list->nqueries == list->nalloc)
+	{
+		list->nalloc = list->nalloc ? list->nalloc * 2 : 16;
+		list->queries = (struct query_struct *) realloc(list->queries, list->nalloc * sizeof(struct query_struct));
+		if(!list->queries)
+		{
+			fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) (list->nalloc * sizeof(struct query_struct)));
+			abort();
+		}
+	}
+	list->queries[list->nqueries].pattern = strdup(pattern);
+	if(!list->queries[list->nqueries].pattern)
+	{
+		fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) strlen(pattern) + 1);
+		abort();
+	}
+	list->queries[list->nqueries].regexp = regexp;
+	list->nqueries++;
+}
+
+/* Read variable names from standard input, one per line */
+static void
+read_queries(struct query_list_struct *list)
+{
+	char *line;
+	size_t size;
+	ssize_t len;
+
+	line = NULL;
+	size = 0;
+	while((len = getline(&line, &size, stdin)) != -1)
+	{
+		while(len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		{
+			line[--len] = 0;
+		}
+		if(len)
+		{
+			add_query(list, line, 0);
+		}
+	}
+	free(line);
+}
+
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s VAR [PATH-TO-REPO]\nHonours GIT_DIR if set.\n", progname);
+	fprintf(stderr, "Usage: %s [OPTIONS] VAR [PATH-TO-REPO]\n"
+			"       %s [OPTIONS] -k VAR|-e REGEX|--stdin... [PATH-TO-REPO]\n"
+			"Honours GIT_DIR if set. OPTIONS is one or more of:\n", progname, progname);
+	fprintf(stderr,
+			"  -h, --help         Print this usage message and exit\n"
+			"  -k, --key=VAR      Look up VAR (may be given more than once)\n"
+			"  -e, --regexp=REGEX Look up every variable whose name matches the\n"
+			"                     extended regular expression REGEX (may be given\n"
+			"                     more than once)\n"
+			"  --stdin            Look up each variable named on standard input, one\n"
+			"                     per line\n"
+			"  --cache[=FILE]     Keep the parsed configuration in FILE (by default,\n"
+			"                     " CACHE_NAME " within the repository), and use it for\n"
+			"                     as long as none of the configuration files change\n"
+			"  -z                 End each value with NUL rather than a newline\n"
+			"  --json             Write each value as a JSON object on its own line\n"
+			"  --binary           Write each value prefixed with its length as a 32-bit\n"
+			"                     big-endian number\n"
+			"With -k, -e or --stdin, each value is preceded by the name of its variable\n"
+			"(separated by a tab, unless --binary is given), and the values of each\n"
+			"variable are written in the order the variables were given.\n");
 }
 
 int
-main(int argc, char **argv)
+getall_main(int argc, char **argv)
 {
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "key", required_argument, NULL, 'k' },
+		{ "regexp", required_argument, NULL, 'e' },
+		{ "stdin", no_argument, NULL, OPT_STDIN },
+		{ "cache", optional_argument, NULL, OPT_CACHE },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "binary", no_argument, NULL, OPT_BINARY },
+		{ NULL, 0, NULL, 0 }
+	};
 	git_buf pathbuf;
 	const char *path = NULL;
 	const git_error *err;
-	git_repository *repo;
-	git_config *cfg;
+	struct query_list_struct list;
+	struct query_struct *query;
+	CONFIG_TABLE *table;
+	OUTPUT *out;
+	char *cachepath;
+	size_t n;
+	int c, format, batch, usestdin, usecache, r;
 	
-	if(argc == 3)
+	format = OUTPUT_TEXT;
+	memset(&list, 0, sizeof(list));
+	batch = 0;
+	usestdin = 0;
+	usecache = 0;
+	cachepath = NULL;
+	while((c = getopt_long(argc, argv, "hk:e:z", longopts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'k':
+			add_query(&list, optarg, 0);
+			batch = 1;
+			break;
+		case 'e':
+			add_query(&list, optarg, 1);
+			batch = 1;
+			break;
+		case OPT_STDIN:
+			usestdin = 1;
+			batch = 1;
+			break;
+		case OPT_CACHE:
+			usecache = 1;
+			free(cachepath);
+			cachepath = optarg ? strdup(optarg) : NULL;
+			break;
+		case 'z':
+			format = OUTPUT_NUL;
+			break;
+		case OPT_JSON:
+			format = OUTPUT_JSON;
+			break;
+		case OPT_BINARY:
+			format = OUTPUT_BINARY;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!batch && argc - optind >= 1)
+	{
+		add_query(&list, argv[optind], 0);
+		optind++;
+	}
+	else if(!batch)
 	{
-		path = argv[2];
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
 	}
-	else if(argc != 2)
+	if(argc - optind == 1)
+	{
+		path = argv[optind];
+	}
+	else if(argc - optind != 0)
 	{
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	if(usestdin)
+	{
+		read_queries(&list);
+	}
 	if(!path)
 	{
 		path = getenv("GIT_DIR");
 	}
+	/* Only the path to the repository is needed to find its configuration
+	 * files, so the repository isn't opened unless they must be read
+	 */
 	memset(&pathbuf, 0, sizeof(pathbuf));
-	if(!path)
+	if(git_repository_discover(&pathbuf, path ? path : ".", 0, "/"))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", argv[0], path ? path : ".", err->message);
+		exit(EXIT_FAILURE);
+	}
+	if(usecache && !cachepath)
 	{
-		if(git_repository_discover(&pathbuf, ".", 0, "/"))
+		cachepath = (char *) malloc(pathbuf.size + strlen(CACHE_NAME) + 2);
+		if(!cachepath)
 		{
-			err = giterr_last();
-			fprintf(stderr, "%s: %s\n", path, err->message);
-			exit(EXIT_FAILURE);
+			fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) (pathbuf.size + strlen(CACHE_NAME) + 2));
+			abort();
 		}
-		path = pathbuf.ptr;
+		sprintf(cachepath, "%s%s%s", pathbuf.ptr, (pathbuf.size && pathbuf.ptr[pathbuf.size - 1] == '/') ? "" : "/", CACHE_NAME);
 	}
-	if(git_repository_open(&repo, path))
+	table = config_table_open(pathbuf.ptr, cachepath, argv[0]);
+	if(!table)
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
 		exit(EXIT_FAILURE);
 	}
-	if(git_repository_config(&cfg, repo))
+	out = output_open(STDOUT_FILENO, format);
+	r = 0;
+	for(n = 0; n < list.nqueries; n++)
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
-		exit(EXIT_FAILURE);		
+		query = &(list.queries[n]);
+		if(query->regexp)
+		{
+			if(config_table_match(table, query->pattern, batch_callback, out) < 0)
+			{
+				fprintf(stderr, "%s: invalid regular expression '%s'\n", argv[0], query->pattern);
+				r = 1;
+			}
+		}
+		else
+		{
+			config_table_get(table, query->pattern, batch ? batch_callback : config_callback, out);
+		}
+		free(query->pattern);
 	}
-	git_config_get_multivar_foreach(cfg, argv[1], NULL, config_callback, NULL);
-	git_config_free(cfg);
-	git_repository_free(repo);
+	free(list.queries);
+	free(cachepath);
+	config_table_close(table);
 	git_buf_free(&pathbuf);
-	return 0;
+	if(output_close(out))
+	{
+		fprintf(stderr, "%s: failed to write output\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	return r ? EXIT_FAILURE : 0;
+}
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return getall_main(argc, argv);
 }
+#endif
@@ -0,0 +1,569 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config-table.h"
+
+/* The cache file consists of:
+ *
+ *   The magic number, CACHE_MAGIC
+ *   The number of source files, as a uint32_t
+ *   For each source file, a cache_source_struct followed by its path
+ *   The number of entries, as a uint32_t
+ *   The size of the string table, as a uint64_t
+ *   For each entry, a cache_entry_struct
+ *   The string table
+ *
+ * Everything is in the host's byte order: the cache is only ever read on the
+ * machine which wrote it.
+ */
+
+#define CACHE_MAGIC                     "GACFG01\n"
+#define CACHE_MAGIC_LEN                 8
+
+/* The offset of a NULL value (a variable with no value at all) */
+#define NO_VALUE                        UINT64_MAX
+
+struct cache_source_struct
+{
+	int64_t mtime;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint64_t ino;
+	uint32_t exists;
+	uint32_t pathlen;
+};
+
+struct cache_entry_struct
+{
+	/* Offsets into the string table */
+	uint64_t name;
+	uint64_t value;
+};
+
+struct source_struct
+{
+	char *path;
+	struct cache_source_struct info;
+};
+
+struct config_table_struct
+{
+	const char *progname;
+	/* The entries, in the order libgit2 enumerates them */
+	struct cache_entry_struct *entries;
+	uint32_t nentries;
+	uint32_t nalloc;
+	/* The indices of the entries, sorted by name (and then index) */
+	uint32_t *sorted;
+	char *strings;
+	uint64_t strsize;
+	uint64_t stralloc;
+	/* The configuration files the entries were read from */
+	struct source_struct sources[4];
+	uint32_t nsources;
+	/* Set if the configuration includes other files */
+	int includes;
+};
+
+static void *
+config_alloc(size_t size)
+{
+	void *ptr;
+
+	ptr = calloc(1, size);
+	if(!ptr)
+	{
+		fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) size);
+		abort();
+	}
+	return ptr;
+}
+
+static void *
+config_realloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if(!ptr)
+	{
+		fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) size);
+		abort();
+	}
+	return ptr;
+}
+
+/* Add a string to the string table, returning its offset */
+static uint64_t
+add_string(CONFIG_TABLE *table, const char *str)
+{
+	uint64_t offset;
+	size_t len;
+
+	len = strlen(str) + 1;
+	while(table->strsize + len > table->stralloc)
+	{
+		table->stralloc = table->stralloc ? table->stralloc * 2 : 4096;
+		table->strings = (char *) config_realloc(table->strings, table->stralloc);
+	}
+	offset = table->strsize;
+	memcpy(table->strings + offset, str, len);
+	table->strsize += len;
+	return offset;
+}
+
+/* Record a configuration file, and its current state */
+static void
+add_source(CONFIG_TABLE *table, const char *path)
+{
+	struct source_struct *source;
+	struct stat sbuf;
+
+	source = &(table->sources[table->nsources++]);
+	source->path = (char *) config_alloc(strlen(path) + 1);
+	strcpy(source->path, path);
+	source->info.pathlen = strlen(path);
+	if(stat(path, &sbuf))
+	{
+		return;
+	}
+	source->info.exists = 1;
+	source->info.mtime = sbuf.st_mtim.tv_sec;
+	source->info.mtime_nsec = sbuf.st_mtim.tv_nsec;
+	source->info.size = sbuf.st_size;
+	source->info.ino = sbuf.st_ino;
+}
+
+/* Determine which files the configuration is read from, in the current
+ * environment (the global and XDG files depend upon $HOME, for example)
+ */
+static void
+find_sources(CONFIG_TABLE *table, const char *gitdir)
+{
+	git_buf buf;
+	char *path;
+	size_t len;
+
+	len = strlen(gitdir);
+	path = (char *) config_alloc(len + 8);
+	strcpy(path, gitdir);
+	if(len && path[len - 1] != '/')
+	{
+		path[len++] = '/';
+	}
+	strcpy(path + len, "config");
+	add_source(table, path);
+	free(path);
+	memset(&buf, 0, sizeof(buf));
+	if(!git_config_find_global(&buf))
+	{
+		add_source(table, buf.ptr);
+	}
+	git_buf_free(&buf);
+	memset(&buf, 0, sizeof(buf));
+	if(!git_config_find_xdg(&buf))
+	{
+		add_source(table, buf.ptr);
+	}
+	git_buf_free(&buf);
+	memset(&buf, 0, sizeof(buf));
+	if(!git_config_find_system(&buf))
+	{
+		add_source(table, buf.ptr);
+	}
+	git_buf_free(&buf);
+}
+
+static int
+entry_callback(const git_config_entry *entry, void *data)
+{
+	CONFIG_TABLE *table;
+	struct cache_entry_struct *e;
+
+	table = (CONFIG_TABLE *) data;
+	if(!strncmp(entry->name, "include.", 8) || !strncmp(entry->name, "includeif.", 10))
+	{
+		table->includes = 1;
+	}
+	if(table->nentries == table->nalloc)
+	{
+		table->nalloc = table->nalloc ? table->nalloc * 2 : 64;
+		table->entries = (struct cache_entry_struct *) config_realloc(table->entries, table->nalloc * sizeof(struct cache_entry_struct));
+	}
+	e = &(table->entries[table->nentries++]);
+	e->name = add_string(table, entry->name);
+	e->value = entry->value ? add_string(table, entry->value) : NO_VALUE;
+	return 0;
+}
+
+/* Read the entries from a snapshot of the repository's configuration */
+static int
+read_config(CONFIG_TABLE *table, const char *gitdir)
+{
+	git_repository *repo;
+	git_config *cfg, *snapshot;
+	const git_error *err;
+
+	if(git_repository_open(&repo, gitdir))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", table->progname, gitdir, err->message);
+		return -1;
+	}
+	if(git_repository_config(&cfg, repo))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", table->progname, gitdir, err->message);
+		git_repository_free(repo);
+		return -1;
+	}
+	if(git_config_snapshot(&snapshot, cfg))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", table->progname, gitdir, err->message);
+		git_config_free(cfg);
+		git_repository_free(repo);
+		return -1;
+	}
+	git_config_foreach(snapshot, entry_callback, table);
+	git_config_free(snapshot);
+	git_config_free(cfg);
+	git_repository_free(repo);
+	return 0;
+}
+
+/* Read exactly len bytes from a cache file */
+static int
+read_exact(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+	char *p;
+
+	for(p = (char *) buf; len; p += r, len -= r)
+	{
+		r = read(fd, p, len);
+		if(r < 0 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r <= 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Load the entries from a cache file, if it exists and every one of the
+ * configuration files it was made from is as it was then
+ */
+static int
+load_cache(CONFIG_TABLE *table, const char *cachepath)
+{
+	char magic[CACHE_MAGIC_LEN];
+	struct cache_source_struct info;
+	char *path;
+	uint32_t n, c;
+	int fd, r;
+
+	fd = open(cachepath, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	r = -1;
+	path = NULL;
+	if(read_exact(fd, magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, CACHE_MAGIC_LEN) ||
+	   read_exact(fd, &n, sizeof(n)) || n != table->nsources)
+	{
+		goto done;
+	}
+	for(c = 0; c < n; c++)
+	{
+		if(read_exact(fd, &info, sizeof(info)) || info.pathlen != table->sources[c].info.pathlen)
+		{
+			goto done;
+		}
+		path = (char *) config_realloc(path, info.pathlen + 1);
+		if(read_exact(fd, path, info.pathlen) || memcmp(path, table->sources[c].path, info.pathlen) ||
+		   memcmp(&info, &(table->sources[c].info), sizeof(info)))
+		{
+			goto done;
+		}
+	}
+	if(read_exact(fd, &(table->nentries), sizeof(table->nentries)) ||
+	   read_exact(fd, &(table->strsize), sizeof(table->strsize)) ||
+	   table->strsize > SIZE_MAX / 2)
+	{
+		goto done;
+	}
+	table->nalloc = table->nentries;
+	table->entries = (struct cache_entry_struct *) config_realloc(table->entries, (table->nentries + 1) * sizeof(struct cache_entry_struct));
+	table->stralloc = table->strsize + 1;
+	table->strings = (char *) config_realloc(table->strings, table->stralloc);
+	if(read_exact(fd, table->entries, table->nentries * sizeof(struct cache_entry_struct)) ||
+	   read_exact(fd, table->strings, table->strsize))
+	{
+		goto done;
+	}
+	/* Make sure that every string lies within the table and is terminated */
+	table->strings[table->strsize] = 0;
+	for(c = 0; c < table->nentries; c++)
+	{
+		if(table->entries[c].name >= table->strsize ||
+		   (table->entries[c].value != NO_VALUE && table->entries[c].value >= table->strsize))
+		{
+			goto done;
+		}
+	}
+	r = 0;
+done:
+	if(r)
+	{
+		table->nentries = 0;
+		table->strsize = 0;
+	}
+	free(path);
+	close(fd);
+	return r;
+}
+
+/* Save the entries to a cache file, replacing it atomically */
+static void
+save_cache(CONFIG_TABLE *table, const char *cachepath)
+{
+	char *tmppath;
+	uint32_t c;
+	FILE *f;
+	int ok;
+
+	tmppath = (char *) config_alloc(strlen(cachepath) + 32);
+	sprintf(tmppath, "%s.%lu", cachepath, (unsigned long) getpid());
+	f = fopen(tmppath, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", table->progname, tmppath, strerror(errno));
+		free(tmppath);
+		return;
+	}
+	fwrite(CACHE_MAGIC, CACHE_MAGIC_LEN, 1, f);
+	fwrite(&(table->nsources), sizeof(table->nsources), 1, f);
+	for(c = 0; c < table->nsources; c++)
+	{
+		fwrite(&(table->sources[c].info), sizeof(struct cache_source_struct), 1, f);
+		fwrite(table->sources[c].path, table->sources[c].info.pathlen, 1, f);
+	}
+	fwrite(&(table->nentries), sizeof(table->nentries), 1, f);
+	fwrite(&(table->strsize), sizeof(table->strsize), 1, f);
+	fwrite(table->entries, sizeof(struct cache_entry_struct), table->nentries, f);
+	fwrite(table->strings, 1, table->strsize, f);
+	ok = !ferror(f);
+	if(fclose(f))
+	{
+		ok = 0;
+	}
+	if(!ok || rename(tmppath, cachepath))
+	{
+		fprintf(stderr, "%s: %s: %s\n", table->progname, cachepath, strerror(errno));
+		unlink(tmppath);
+	}
+	free(tmppath);
+}
+
+static const CONFIG_TABLE *sort_table;
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	uint32_t ia, ib;
+	int r;
+
+	ia = *(const uint32_t *) a;
+	ib = *(const uint32_t *) b;
+	r = strcmp(sort_table->strings + sort_table->entries[ia].name, sort_table->strings + sort_table->entries[ib].name);
+	if(r)
+	{
+		return r;
+	}
+	return ia < ib ? -1 : ia > ib;
+}
+
+/* Obtain the configuration of the repository at gitdir, from the cache file
+ * at cachepath if it's up to date (or that file is NULL), and otherwise from
+ * a snapshot, which is then saved to the cache file; returns NULL (having
+ * reported the reason) if the configuration can't be read
+ */
+CONFIG_TABLE *
+config_table_open(const char *gitdir, const char *cachepath, const char *progname)
+{
+	CONFIG_TABLE *table;
+	uint32_t c;
+
+	table = (CONFIG_TABLE *) config_alloc(sizeof(CONFIG_TABLE));
+	table->progname = progname;
+	find_sources(table, gitdir);
+	if(!cachepath || load_cache(table, cachepath))
+	{
+		if(read_config(table, gitdir))
+		{
+			config_table_close(table);
+			return NULL;
+		}
+		if(cachepath && !table->includes)
+		{
+			save_cache(table, cachepath);
+		}
+	}
+	table->sorted = (uint32_t *) config_alloc((table->nentries + 1) * sizeof(uint32_t));
+	for(c = 0; c < table->nentries; c++)
+	{
+		table->sorted[c] = c;
+	}
+	sort_table = table;
+	qsort(table->sorted, table->nentries, sizeof(uint32_t), entry_cmp);
+	return table;
+}
+
+/* Free a configuration table */
+void
+config_table_close(CONFIG_TABLE *table)
+{
+	uint32_t c;
+
+	if(!table)
+	{
+		return;
+	}
+	for(c = 0; c < table->nsources; c++)
+	{
+		free(table->sources[c].path);
+	}
+	free(table->entries);
+	free(table->sorted);
+	free(table->strings);
+	free(table);
+}
+
+/* Convert a variable name to the form libgit2 gives entries: the section and
+ * the variable name are case-insensitive, and so are lower-cased, but any
+ * subsection isn't
+ */
+static char *
+normalise_name(const char *name)
+{
+	char *norm, *first, *last, *p;
+
+	first = strchr(name, '.');
+	last = strrchr(name, '.');
+	if(!first || first == name || !last[1])
+	{
+		return NULL;
+	}
+	norm = (char *) config_alloc(strlen(name) + 1);
+	strcpy(norm, name);
+	first = norm + (first - name);
+	last = norm + (last - name);
+	for(p = norm; p < first; p++)
+	{
+		*p = tolower((unsigned char) *p);
+	}
+	for(p = last; *p; p++)
+	{
+		*p = tolower((unsigned char) *p);
+	}
+	return norm;
+}
+
+static const char *
+entry_value(const CONFIG_TABLE *table, uint32_t n)
+{
+	return table->entries[n].value == NO_VALUE ? NULL : table->strings + table->entries[n].value;
+}
+
+/* Invoke a callback with the name and value (which may be NULL) of each
+ * entry for a variable, stopping as soon as the callback returns nonzero
+ * and returning its result
+ */
+int
+config_table_get(const CONFIG_TABLE *table, const char *name, int (*cb)(const char *name, const char *value, void *data), void *data)
+{
+	const char *entry;
+	char *norm;
+	uint32_t lo, hi, mid, n;
+	int r;
+
+	norm = normalise_name(name);
+	if(!norm)
+	{
+		return 0;
+	}
+	/* Find the first entry with the name */
+	lo = 0;
+	hi = table->nentries;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(strcmp(table->strings + table->entries[table->sorted[mid]].name, norm) < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	r = 0;
+	for(; lo < table->nentries && !r; lo++)
+	{
+		n = table->sorted[lo];
+		entry = table->strings + table->entries[n].name;
+		if(strcmp(entry, norm))
+		{
+			break;
+		}
+		r = cb(entry, entry_value(table, n), data);
+	}
+	free(norm);
+	return r;
+}
+
+/* Invoke a callback with each entry whose name matches an extended regular
+ * expression, as config_table_get() does; returns -1 if the expression is
+ * invalid
+ */
+int
+config_table_match(const CONFIG_TABLE *table, const char *regexp, int (*cb)(const char *name, const char *value, void *data), void *data)
+{
+	const char *entry;
+	regex_t re;
+	uint32_t n;
+	int r;
+
+	if(regcomp(&re, regexp, REG_EXTENDED|REG_NOSUB))
+	{
+		return -1;
+	}
+	r = 0;
+	for(n = 0; n < table->nentries && !r; n++)
+	{
+		entry = table->strings + table->entries[n].name;
+		if(!regexec(&re, entry, 0, NULL, 0))
+		{
+			r = cb(entry, entry_value(table, n), data);
+		}
+	}
+	regfree(&re);
+	return r;
+}
@@ -0,0 +1,41 @@
+#ifndef CONFIG_TABLE_H_
+# define CONFIG_TABLE_H_                1
+
+# include <git2.h>
+
+/* A configuration table holds every entry of a repository's configuration,
+ * taken from a single snapshot of it, so that any number of variables (or
+ * regular expressions matching their names) can be looked up without the
+ * configuration files being parsed again for each.
+ *
+ * The table may also be saved to a cache file, along with the path, size,
+ * modification time and inode of each of the configuration files it was
+ * read from (the repository's own, and the global, XDG and system files);
+ * while none of them has changed, the table is loaded from the cache,
+ * without the repository even being opened. Configurations which include
+ * other files are never cached, because the included files can't be
+ * tracked.
+ */
+
+typedef struct config_table_struct CONFIG_TABLE;
+
+/* Obtain the configuration of the repository at gitdir, from the cache file
+ * at cachepath if it's up to date (or that file is NULL), and otherwise from
+ * a snapshot, which is then saved to the cache file; returns NULL (having
+ * reported the reason) if the configuration can't be read
+ */
+CONFIG_TABLE *config_table_open(const char *gitdir, const char *cachepath, const char *progname);
+/* Free a configuration table */
+void config_table_close(CONFIG_TABLE *table);
+/* Invoke a callback with the name and value (which may be NULL) of each
+ * entry for a variable, stopping as soon as the callback returns nonzero
+ * and returning its result
+ */
+int config_table_get(const CONFIG_TABLE *table, const char *name, int (*cb)(const char *name, const char *value, void *data), void *data);
+/* Invoke a callback with each entry whose name matches an extended regular
+ * expression, as config_table_get() does; returns -1 if the expression is
+ * invalid
+ */
+int config_table_match(const CONFIG_TABLE *table, const char *regexp, int (*cb)(const char *name, const char *value, void *data), void *data);
+
+#endif /*!CONFIG_TABLE_H_*/
@@ -0,0 +1,462 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include "contains-cache.h"
+
+/* The file is laid out as follows, with all integers stored big-endian:
+ *
+ *   "BFC1"                     Signature
+ *   uint32 nrecords
+ *   uint32 nnames
+ *   records[nrecords]          Sorted by tip, then target:
+ *       uint8 tip[20]
+ *       uint8 target[20]
+ *       uint8 contains         1 if the tip contains the target, 0 if not
+ *   names[nnames]              Sorted by name:
+ *       uint16 length
+ *       char name[length]
+ *       uint8 tip[20]
+ */
+
+#define CACHE_SIGNATURE                 "BFC1"
+#define CACHE_HEADER_SIZE               12
+#define CACHE_RECORD_SIZE               (GIT_OID_RAWSZ * 2 + 1)
+
+struct cache_name_struct
+{
+	char *name;
+	git_oid tip;
+};
+
+struct cache_record_struct
+{
+	unsigned char data[CACHE_RECORD_SIZE];
+	/* Newly-added records take precedence over those loaded from disk */
+	size_t index;
+};
+
+struct contains_cache_struct
+{
+	/* The file's contents */
+	unsigned char *buf;
+	size_t size;
+	const unsigned char *records;
+	uint32_t nrecords;
+	/* The names and tips loaded from the file */
+	struct cache_name_struct *names;
+	uint32_t nnames;
+	/* Records and tips added since the cache was loaded */
+	struct cache_record_struct *added;
+	size_t nadded;
+	size_t addedalloc;
+	struct cache_name_struct *tips;
+	size_t ntips;
+	size_t tipalloc;
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static void
+put32(unsigned char *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+/* Determine the path to a repository's containment cache */
+static char *
+cache_path(git_repository *repo)
+{
+	const char *gitdir;
+	char *path;
+
+	gitdir = git_repository_path(repo);
+	path = (char *) xalloc(strlen(gitdir) + strlen(CONTAINS_CACHE_FILENAME) + 8);
+	strcpy(path, gitdir);
+	if(path[0] && path[strlen(path) - 1] != '/')
+	{
+		strcat(path, "/");
+	}
+	strcat(path, CONTAINS_CACHE_FILENAME);
+	return path;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct cache_name_struct *) a)->name, ((const struct cache_name_struct *) b)->name);
+}
+
+static int
+record_cmp(const void *a, const void *b)
+{
+	const struct cache_record_struct *ra, *rb;
+	int r;
+
+	ra = (const struct cache_record_struct *) a;
+	rb = (const struct cache_record_struct *) b;
+	r = memcmp(ra->data, rb->data, GIT_OID_RAWSZ * 2);
+	if(r)
+	{
+		return r;
+	}
+	return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+static int
+tip_cmp(const void *a, const void *b)
+{
+	return memcmp(a, ((const struct cache_name_struct *) b)->tip.id, GIT_OID_RAWSZ);
+}
+
+static int
+tip_sort_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&(((const struct cache_name_struct *) a)->tip), &(((const struct cache_name_struct *) b)->tip));
+}
+
+/* Load a repository's containment cache, returning an empty cache if there
+ * isn't one (or it isn't valid)
+ */
+CONTAINS_CACHE *
+contains_cache_open(git_repository *repo)
+{
+	CONTAINS_CACHE *cache;
+	char *path;
+	FILE *f;
+	long size;
+	const unsigned char *p, *end;
+	uint32_t c, len;
+
+	cache = (CONTAINS_CACHE *) xalloc(sizeof(CONTAINS_CACHE));
+	path = cache_path(repo);
+	f = fopen(path, "rb");
+	free(path);
+	if(!f)
+	{
+		return cache;
+	}
+	if(fseek(f, 0, SEEK_END) || (size = ftell(f)) < CACHE_HEADER_SIZE || fseek(f, 0, SEEK_SET))
+	{
+		fclose(f);
+		return cache;
+	}
+	cache->buf = (unsigned char *) xalloc(size);
+	cache->size = size;
+	if(fread(cache->buf, size, 1, f) != 1 || memcmp(cache->buf, CACHE_SIGNATURE, 4))
+	{
+		fclose(f);
+		free(cache->buf);
+		cache->buf = NULL;
+		return cache;
+	}
+	fclose(f);
+	p = cache->buf + CACHE_HEADER_SIZE;
+	end = cache->buf + cache->size;
+	cache->nrecords = get32(cache->buf + 4);
+	if((size_t) (end - p) / CACHE_RECORD_SIZE < cache->nrecords)
+	{
+		cache->nrecords = 0;
+		return cache;
+	}
+	cache->records = p;
+	p += (size_t) cache->nrecords * CACHE_RECORD_SIZE;
+	cache->nnames = get32(cache->buf + 8);
+	cache->names = (struct cache_name_struct *) xalloc((cache->nnames + 1) * sizeof(struct cache_name_struct));
+	for(c = 0; c < cache->nnames; c++)
+	{
+		if(end - p < 2)
+		{
+			break;
+		}
+		len = (uint32_t) p[0] << 8 | p[1];
+		p += 2;
+		if((size_t) (end - p) < len + GIT_OID_RAWSZ)
+		{
+			break;
+		}
+		cache->names[c].name = (char *) xalloc(len + 1);
+		memcpy(cache->names[c].name, p, len);
+		p += len;
+		git_oid_fromraw(&(cache->names[c].tip), p);
+		p += GIT_OID_RAWSZ;
+	}
+	cache->nnames = c;
+	return cache;
+}
+
+/* Free a containment cache */
+void
+contains_cache_close(CONTAINS_CACHE *cache)
+{
+	size_t c;
+
+	if(!cache)
+	{
+		return;
+	}
+	for(c = 0; c < cache->nnames; c++)
+	{
+		free(cache->names[c].name);
+	}
+	for(c = 0; c < cache->ntips; c++)
+	{
+		free(cache->tips[c].name);
+	}
+	free(cache->names);
+	free(cache->tips);
+	free(cache->added);
+	free(cache->buf);
+	free(cache);
+}
+
+/* Look up whether a tip contains a target, returning 1 if it does, 0 if it
+ * doesn't, or -1 if the answer isn't known
+ */
+int
+contains_cache_lookup(const CONTAINS_CACHE *cache, const git_oid *tip, const git_oid *target)
+{
+	unsigned char key[GIT_OID_RAWSZ * 2];
+	const unsigned char *rec;
+	uint32_t lo, hi, mid;
+	int r;
+
+	memcpy(key, tip->id, GIT_OID_RAWSZ);
+	memcpy(key + GIT_OID_RAWSZ, target->id, GIT_OID_RAWSZ);
+	lo = 0;
+	hi = cache->nrecords;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		rec = cache->records + (size_t) mid * CACHE_RECORD_SIZE;
+		r = memcmp(rec, key, sizeof(key));
+		if(!r)
+		{
+			return rec[GIT_OID_RAWSZ * 2] ? 1 : 0;
+		}
+		if(r < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+/* Return the tip recorded for a reference when the cache was last written, or
+ * NULL if there isn't one
+ */
+const git_oid *
+contains_cache_tip(const CONTAINS_CACHE *cache, const char *name)
+{
+	struct cache_name_struct key, *entry;
+
+	if(!cache->nnames)
+	{
+		return NULL;
+	}
+	key.name = (char *) name;
+	entry = (struct cache_name_struct *) bsearch(&key, cache->names, cache->nnames, sizeof(struct cache_name_struct), name_cmp);
+	return entry ? &(entry->tip) : NULL;
+}
+
+/* Record whether a tip contains a target */
+void
+contains_cache_add(CONTAINS_CACHE *cache, const git_oid *tip, const git_oid *target, int contains)
+{
+	struct cache_record_struct *rec;
+
+	if(cache->nadded == cache->addedalloc)
+	{
+		cache->addedalloc = cache->addedalloc ? cache->addedalloc * 2 : 256;
+		cache->added = (struct cache_record_struct *) xrealloc(cache->added, cache->addedalloc * sizeof(struct cache_record_struct));
+	}
+	rec = &(cache->added[cache->nadded]);
+	memcpy(rec->data, tip->id, GIT_OID_RAWSZ);
+	memcpy(rec->data + GIT_OID_RAWSZ, target->id, GIT_OID_RAWSZ);
+	rec->data[GIT_OID_RAWSZ * 2] = contains ? 1 : 0;
+	rec->index = cache->nadded;
+	cache->nadded++;
+}
+
+/* Record the current tip of a reference, replacing the one loaded for it;
+ * only the answers for the tips of named references are retained when the
+ * cache is written
+ */
+void
+contains_cache_set_tip(CONTAINS_CACHE *cache, const char *name, const git_oid *tip)
+{
+	if(cache->ntips == cache->tipalloc)
+	{
+		cache->tipalloc = cache->tipalloc ? cache->tipalloc * 2 : 64;
+		cache->tips = (struct cache_name_struct *) xrealloc(cache->tips, cache->tipalloc * sizeof(struct cache_name_struct));
+	}
+	cache->tips[cache->ntips].name = xstrdup(name);
+	git_oid_cpy(&(cache->tips[cache->ntips].tip), tip);
+	cache->ntips++;
+}
+
+/* Write the cache back to the repository, unless another process holds the
+ * lock on it (in which case nothing is written)
+ */
+int
+contains_cache_write(CONTAINS_CACHE *cache, git_repository *repo, const char *progname)
+{
+	struct cache_record_struct *records;
+	struct cache_name_struct *names, *bytip;
+	unsigned char hdr[CACHE_HEADER_SIZE];
+	size_t c, n, count, nnames, len;
+	char *path, *tmppath;
+	FILE *f;
+	int fd, busy, r;
+
+	/* Merge the tips recorded in this run with the names loaded from disk,
+	 * so that branches which weren't queried this time keep theirs; where
+	 * both have a name, the tip recorded now wins
+	 */
+	qsort(cache->tips, cache->ntips, sizeof(struct cache_name_struct), name_cmp);
+	names = (struct cache_name_struct *) xalloc((cache->ntips + cache->nnames + 1) * sizeof(struct cache_name_struct));
+	nnames = 0;
+	for(c = n = 0; c < cache->ntips || n < cache->nnames;)
+	{
+		if(c == cache->ntips)
+		{
+			r = 1;
+		}
+		else if(n == cache->nnames)
+		{
+			r = -1;
+		}
+		else
+		{
+			r = strcmp(cache->tips[c].name, cache->names[n].name);
+		}
+		if(r > 0)
+		{
+			names[nnames++] = cache->names[n++];
+			continue;
+		}
+		if(!nnames || strcmp(names[nnames - 1].name, cache->tips[c].name))
+		{
+			names[nnames++] = cache->tips[c];
+		}
+		c++;
+		if(!r)
+		{
+			n++;
+		}
+	}
+	/* Merge the new records with those loaded from disk for tips which are
+	 * still named, discarding the rest
+	 */
+	bytip = (struct cache_name_struct *) xalloc((nnames + 1) * sizeof(struct cache_name_struct));
+	memcpy(bytip, names, nnames * sizeof(struct cache_name_struct));
+	qsort(bytip, nnames, sizeof(struct cache_name_struct), tip_sort_cmp);
+	records = (struct cache_record_struct *) xalloc((cache->nadded + cache->nrecords + 1) * sizeof(struct cache_record_struct));
+	memcpy(records, cache->added, cache->nadded * sizeof(struct cache_record_struct));
+	count = cache->nadded;
+	for(c = 0; c < cache->nrecords; c++)
+	{
+		if(!bsearch(cache->records + c * CACHE_RECORD_SIZE, bytip, nnames, sizeof(struct cache_name_struct), tip_cmp))
+		{
+			continue;
+		}
+		memcpy(records[count].data, cache->records + c * CACHE_RECORD_SIZE, CACHE_RECORD_SIZE);
+		records[count].index = cache->nadded + c;
+		count++;
+	}
+	free(bytip);
+	qsort(records, count, sizeof(struct cache_record_struct), record_cmp);
+	for(c = n = 0; c < count; c++)
+	{
+		if(n && !memcmp(records[n - 1].data, records[c].data, GIT_OID_RAWSZ * 2))
+		{
+			continue;
+		}
+		records[n++] = records[c];
+	}
+	count = n;
+
+	path = cache_path(repo);
+	tmppath = (char *) xalloc(strlen(path) + 8);
+	strcpy(tmppath, path);
+	strcat(tmppath, ".lock");
+	/* The lock is created exclusively, as git does, so that concurrent runs
+	 * can't interleave their records in it: if another process already
+	 * holds it, its cache is as good as this one, and is left to be written
+	 */
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if(fd == -1)
+	{
+		busy = (errno == EEXIST);
+		if(!busy)
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, tmppath, strerror(errno));
+		}
+		free(names);
+		free(records);
+		free(tmppath);
+		free(path);
+		return busy ? 0 : -1;
+	}
+	f = fdopen(fd, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, tmppath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(names);
+		free(records);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	memcpy(hdr, CACHE_SIGNATURE, 4);
+	put32(hdr + 4, (uint32_t) count);
+	put32(hdr + 8, (uint32_t) nnames);
+	fwrite(hdr, CACHE_HEADER_SIZE, 1, f);
+	for(c = 0; c < count; c++)
+	{
+		fwrite(records[c].data, CACHE_RECORD_SIZE, 1, f);
+	}
+	for(c = 0; c < nnames; c++)
+	{
+		len = strlen(names[c].name);
+		hdr[0] = (len >> 8) & 0xff;
+		hdr[1] = len & 0xff;
+		fwrite(hdr, 2, 1, f);
+		fwrite(names[c].name, len, 1, f);
+		fwrite(names[c].tip.id, GIT_OID_RAWSZ, 1, f);
+	}
+	free(names);
+	free(records);
+	if(fclose(f) || rename(tmppath, path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		unlink(tmppath);
+		free(tmppath);
+		free(path);
+		return -1;
+	}
+	free(tmppath);
+	free(path);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef CONTAINS_CACHE_H_
+# define CONTAINS_CACHE_H_             1
+
+# include "utils.h"
+
+/* The containment cache, stored as $GIT_DIR/branchfor-cache, records the
+ * answers to previous containment queries: whether the commit at the tip of
+ * a branch has a particular commit as an ancestor. Because commits are
+ * immutable, an answer keyed by (tip, target) never becomes stale; the cache
+ * also records the tip of each branch when it was last queried, so that
+ * answers for a branch's new tip can be derived from those for its old one.
+ */
+
+# define CONTAINS_CACHE_FILENAME        "branchfor-cache"
+
+typedef struct contains_cache_struct CONTAINS_CACHE;
+
+/* Load a repository's containment cache, returning an empty cache if there
+ * isn't one (or it isn't valid)
+ */
+CONTAINS_CACHE *contains_cache_open(git_repository *repo);
+/* Free a containment cache */
+void contains_cache_close(CONTAINS_CACHE *cache);
+/* Look up whether a tip contains a target, returning 1 if it does, 0 if it
+ * doesn't, or -1 if the answer isn't known
+ */
+int contains_cache_lookup(const CONTAINS_CACHE *cache, const git_oid *tip, const git_oid *target);
+/* Return the tip recorded for a reference when the cache was last written, or
+ * NULL if there isn't one
+ */
+const git_oid *contains_cache_tip(const CONTAINS_CACHE *cache, const char *name);
+/* Record whether a tip contains a target */
+void contains_cache_add(CONTAINS_CACHE *cache, const git_oid *tip, const git_oid *target, int contains);
+/* Record the current tip of a reference, replacing the one loaded for it;
+ * only the answers for the tips of named references are retained when the
+ * cache is written
+ */
+void contains_cache_set_tip(CONTAINS_CACHE *cache, const char *name, const git_oid *tip);
+/* Write the cache back to the repository, unless another process holds the
+ * lock on it (in which case nothing is written)
+ */
+int contains_cache_write(CONTAINS_CACHE *cache, git_repository *repo, const char *progname);
+
+#endif /*!CONTAINS_CACHE_H_*/
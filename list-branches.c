@@ -2,102 +2,1081 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
 
 #include <git2.h>
 
+#include "utils.h"
+#include "ref-filter.h"
+#include "refwatch.h"
+#include "output.h"
+#include "multicall.h"
+
+#define OPT_JSON                        256
+#define OPT_BINARY                      257
+#define OPT_WATCH                       258
+#define OPT_BASE                        259
+
+/* With --verbose, each branch is described by the date and author of its tip
+ * commit and, if it has an upstream branch (or --base is given), how far
+ * ahead of and behind that it is. These are computed by jobs, one for each
+ * distinct pair of tip and base commit, so that branches which are at the
+ * same commit as each other (such as a local branch and a remote one which
+ * is up to date with it) are only described once; a branch which is at the
+ * same commit as its base needs no walk at all. The jobs are run on a number
+ * of threads, each with a repository object of its own, and the branches are
+ * written in name order as soon as the jobs for them have finished.
+ *
+ * The jobs are sorted by base commit, and those which share a base form a
+ * group, which a single thread counts with a single walk (see count_group())
+ * rather than one for each branch, so that the history leading to the base
+ * is only walked once however many branches are compared with it. Jobs with
+ * no base are grouped in runs of JOB_CHUNK.
+ */
+#define JOB_CHUNK                       16
+
 struct branch_filter_struct
 {
 	unsigned type;
-	int (*cb)(git_reference *ref, const char *branch_name, git_branch_t type, void *data);
+	int (*cb)(const struct ref_view_struct *ref, git_branch_t type, void *data);
 	void *data;
 };
 
-static int
-branch_callback(git_reference *ref, const char *branch_name, git_branch_t branch_type, void *data)
+/* With --watch, the matching branches are scanned again whenever the
+ * references change (see refwatch.h)
+ */
+struct branch_watch_struct
+{
+	REF_FILTER *refs;
+	git_repository *repo;
+	unsigned type;
+};
+
+struct verbose_job_struct
+{
+	git_oid tip;
+	git_oid base;
+	int hasbase;
+	/* Set once the job has been run */
+	int done;
+	/* Set if the ahead and behind counts are known */
+	int counted;
+	size_t ahead;
+	size_t behind;
+	/* The committer date of the tip, in ISO 8601 form */
+	char date[32];
+	/* The author of the tip, as "name <email>" */
+	char *author;
+};
+
+/* A run of jobs which are run together by one thread */
+struct job_group_struct
+{
+	size_t start;
+	size_t end;
+};
+
+struct verbose_branch_struct
+{
+	char *name;
+	git_branch_t type;
+	git_oid oid;
+	/* The name of the upstream branch (or the base given with --base), if
+	 * there is one
+	 */
+	char *upstream;
+	/* The commit the branch is compared with, unless the upstream branch no
+	 * longer exists
+	 */
+	int hasbase;
+	git_oid base;
+	/* The index of the job which describes the branch */
+	size_t job;
+};
+
+struct verbose_struct
+{
+	/* The repository path, for each thread to open for itself */
+	const char *path;
+	const char *progname;
+	/* The repository, for resolving upstream branches while collecting */
+	git_repository *repo;
+	/* The repository's arena, from which the branches' names are allocated
+	 * while collecting (the threads allocate nothing from it)
+	 */
+	ARENA *arena;
+	/* The base given with --base, if any */
+	const char *basename;
+	const git_oid *base;
+	struct verbose_branch_struct *branches;
+	size_t nbranches;
+	size_t nalloc;
+	struct verbose_job_struct *jobs;
+	size_t njobs;
+	struct job_group_struct *groups;
+	size_t ngroups;
+	/* The index of the next group of jobs to run */
+	size_t next;
+	/* The number of branches written so far */
+	size_t written;
+	/* Held while marking jobs as done and writing branches */
+	pthread_mutex_t lock;
+	OUTPUT *out;
+};
+
+/* A commit visited while counting how far a group of tips are ahead of and
+ * behind their base
+ */
+struct count_node_struct
+{
+	git_oid oid;
+	git_time_t time;
+	/* Set while the node is queued */
+	int queued;
+	/* Which of the tips (bits 0 to ntips - 1) and the base (bit ntips) can
+	 * reach the commit
+	 */
+	uint64_t bits[1];
+};
+
+struct count_walk_struct
+{
+	git_repository *repo;
+	/* The arena from which the nodes are allocated */
+	ARENA *arena;
+	size_t ntips;
+	/* The number of 64-bit words in each node's set */
+	size_t nwords;
+	/* The set of every tip (and the base) which was found; a node whose set
+	 * is equal to this is reachable from all of them
+	 */
+	uint64_t *full;
+	/* An open-addressed hash table of visited commits */
+	struct count_node_struct **table;
+	size_t tablesize;
+	size_t count;
+	/* A max-heap of queued nodes ordered by commit time */
+	struct count_node_struct **heap;
+	size_t heapcount;
+	size_t heapsize;
+	/* The number of queued nodes which aren't reachable from everything */
+	size_t live;
+};
+
+static const char *
+type_name(git_branch_t branch_type)
 {
-	const char *type;
-	
-	(void) ref;
-	(void) data;
-	
 	switch(branch_type)
 	{
 	case GIT_BRANCH_LOCAL:
-		type = "local";
-		break;
+		return "local";
 	case GIT_BRANCH_REMOTE:
-		type = "remote";
-		break;
+		return "remote";
 	default:
-		type = "unknown";
+		return "unknown";
+	}
+}
+
+static int
+branch_callback(const struct ref_view_struct *ref, git_branch_t branch_type, void *data)
+{
+	OUTPUT *out;
+	const char *type;
+	
+	out = (OUTPUT *) data;
+	type = type_name(branch_type);
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_printf(out, "%s (%s)\n", ref->name, type);
+		return 0;
+	}
+	output_begin(out);
+	output_oid(out, "oid", &(ref->oid));
+	output_string(out, "name", ref->name);
+	output_label(out, "type", type);
+	output_end(out);
+	return 0;
+}
+
+/* Collect a branch for --verbose, along with the commit it's compared with */
+static int
+verbose_collect(const struct ref_view_struct *ref, git_branch_t branch_type, void *data)
+{
+	struct verbose_struct *v;
+	struct verbose_branch_struct *branch;
+	struct verbose_job_struct *job;
+	git_buf buf;
+
+	v = (struct verbose_struct *) data;
+	if(v->nbranches == v->nalloc)
+	{
+		v->nalloc = v->nalloc ? v->nalloc * 2 : 256;
+		v->branches = (struct verbose_branch_struct *) xrealloc(v->branches, v->nalloc * sizeof(struct verbose_branch_struct));
+		v->jobs = (struct verbose_job_struct *) xrealloc(v->jobs, v->nalloc * sizeof(struct verbose_job_struct));
+	}
+	/* Each branch has a job of its own until they're de-duplicated */
+	branch = &(v->branches[v->nbranches]);
+	job = &(v->jobs[v->nbranches]);
+	v->nbranches++;
+	memset(branch, 0, sizeof(struct verbose_branch_struct));
+	memset(job, 0, sizeof(struct verbose_job_struct));
+	branch->name = arena_strdup(v->arena, ref->name);
+	branch->type = branch_type;
+	git_oid_cpy(&(branch->oid), &(ref->oid));
+	git_oid_cpy(&(job->tip), &(ref->oid));
+	if(v->base)
+	{
+		branch->upstream = arena_strdup(v->arena, v->basename);
+		git_oid_cpy(&(branch->base), v->base);
+		branch->hasbase = 1;
+	}
+	else if(branch_type == GIT_BRANCH_LOCAL)
+	{
+		memset(&buf, 0, sizeof(buf));
+		if(!git_branch_upstream_name(&buf, v->repo, ref->name))
+		{
+			branch->upstream = arena_strdup(v->arena, buf.ptr);
+			branch->hasbase = !git_reference_name_to_id(&(branch->base), v->repo, buf.ptr);
+		}
+		git_buf_free(&buf);
+	}
+	job->hasbase = branch->hasbase;
+	git_oid_cpy(&(job->base), &(branch->base));
+	return 0;
+}
+
+static int
+job_cmp(const void *a, const void *b)
+{
+	const struct verbose_job_struct *ja, *jb;
+	int r;
+
+	ja = (const struct verbose_job_struct *) a;
+	jb = (const struct verbose_job_struct *) b;
+	if(ja->hasbase != jb->hasbase)
+	{
+		return ja->hasbase - jb->hasbase;
+	}
+	if(ja->hasbase)
+	{
+		r = git_oid_cmp(&(ja->base), &(jb->base));
+		if(r)
+		{
+			return r;
+		}
+	}
+	return git_oid_cmp(&(ja->tip), &(jb->tip));
+}
+
+/* Sort the jobs by base commit, merge the duplicates, point each branch at
+ * its job, and divide the jobs into groups
+ */
+static void
+verbose_jobs(struct verbose_struct *v)
+{
+	struct verbose_job_struct key, *job;
+	size_t c, n, start;
+
+	if(!v->nbranches)
+	{
+		return;
+	}
+	qsort(v->jobs, v->nbranches, sizeof(struct verbose_job_struct), job_cmp);
+	n = 1;
+	for(c = 1; c < v->nbranches; c++)
+	{
+		if(job_cmp(&(v->jobs[n - 1]), &(v->jobs[c])))
+		{
+			v->jobs[n++] = v->jobs[c];
+		}
+	}
+	v->njobs = n;
+	for(c = 0; c < v->nbranches; c++)
+	{
+		memset(&key, 0, sizeof(key));
+		git_oid_cpy(&(key.tip), &(v->branches[c].oid));
+		key.hasbase = v->branches[c].hasbase;
+		git_oid_cpy(&(key.base), &(v->branches[c].base));
+		job = (struct verbose_job_struct *) bsearch(&key, v->jobs, v->njobs, sizeof(struct verbose_job_struct), job_cmp);
+		v->branches[c].job = job - v->jobs;
+	}
+	v->groups = (struct job_group_struct *) xalloc(v->njobs * sizeof(struct job_group_struct));
+	for(start = 0; start < v->njobs; start = c)
+	{
+		job = &(v->jobs[start]);
+		for(c = start + 1; c < v->njobs; c++)
+		{
+			if(v->jobs[c].hasbase != job->hasbase)
+			{
+				break;
+			}
+			if(job->hasbase ? git_oid_cmp(&(job->base), &(v->jobs[c].base)) != 0 : c - start == JOB_CHUNK)
+			{
+				break;
+			}
+		}
+		v->groups[v->ngroups].start = start;
+		v->groups[v->ngroups].end = c;
+		v->ngroups++;
+	}
+}
+
+/* Describe a branch tip */
+static void
+describe_job(git_repository *repo, struct verbose_job_struct *job)
+{
+	git_commit *commit;
+	const git_signature *sig;
+	struct tm tm;
+	int hours, minutes;
+	char sign;
+	size_t len;
+
+	if(git_commit_lookup(&commit, repo, &(job->tip)))
+	{
+		return;
+	}
+	sig = git_commit_committer(commit);
+	gmgittime(&(sig->when), &tm, &hours, &minutes, &sign);
+	len = strftime(job->date, sizeof(job->date), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(job->date + len, sizeof(job->date) - len, "%c%02d:%02d", sign, hours, minutes);
+	sig = git_commit_author(commit);
+	job->author = (char *) xalloc(strlen(sig->name) + strlen(sig->email) + 4);
+	sprintf(job->author, "%s <%s>", sig->name, sig->email);
+	git_commit_free(commit);
+}
+
+static size_t
+count_hash(const git_oid *oid)
+{
+	/* Object IDs are already uniformly distributed */
+	return (size_t) oid->id[0] << 24 | (size_t) oid->id[1] << 16 | (size_t) oid->id[2] << 8 | (size_t) oid->id[3];
+}
+
+/* Look up a commit in the walk's table, adding it if it isn't present */
+static struct count_node_struct *
+count_node(struct count_walk_struct *walk, const git_oid *oid)
+{
+	struct count_node_struct *node, **oldtable;
+	size_t c, n, oldsize;
+	git_commit *commit;
+
+	if((walk->count + 1) * 2 > walk->tablesize)
+	{
+		oldtable = walk->table;
+		oldsize = walk->tablesize;
+		walk->tablesize = oldsize ? oldsize * 2 : 1024;
+		walk->table = (struct count_node_struct **) xalloc(walk->tablesize * sizeof(struct count_node_struct *));
+		for(c = 0; c < oldsize; c++)
+		{
+			if(!oldtable[c])
+			{
+				continue;
+			}
+			for(n = count_hash(&(oldtable[c]->oid)) & (walk->tablesize - 1); walk->table[n]; n = (n + 1) & (walk->tablesize - 1));
+			walk->table[n] = oldtable[c];
+		}
+		free(oldtable);
+	}
+	for(n = count_hash(oid) & (walk->tablesize - 1); walk->table[n]; n = (n + 1) & (walk->tablesize - 1))
+	{
+		if(!git_oid_cmp(&(walk->table[n]->oid), oid))
+		{
+			return walk->table[n];
+		}
+	}
+	if(git_commit_lookup(&commit, walk->repo, oid))
+	{
+		return NULL;
+	}
+	node = (struct count_node_struct *) arena_alloc(walk->arena, sizeof(struct count_node_struct) + (walk->nwords - 1) * sizeof(uint64_t));
+	git_oid_cpy(&(node->oid), oid);
+	node->time = git_commit_time(commit);
+	git_commit_free(commit);
+	walk->table[n] = node;
+	walk->count++;
+	return node;
+}
+
+/* Determine whether a commit is reachable from every tip and the base */
+static int
+count_full(const struct count_walk_struct *walk, const struct count_node_struct *node)
+{
+	size_t c;
+
+	for(c = 0; c < walk->nwords; c++)
+	{
+		if(node->bits[c] != walk->full[c])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+count_push(struct count_walk_struct *walk, struct count_node_struct *node)
+{
+	struct count_node_struct *tmp;
+	size_t c, parent;
+
+	if(node->queued)
+	{
+		return;
+	}
+	node->queued = 1;
+	if(!count_full(walk, node))
+	{
+		walk->live++;
+	}
+	if(walk->heapcount == walk->heapsize)
+	{
+		walk->heapsize = walk->heapsize ? walk->heapsize * 2 : 256;
+		walk->heap = (struct count_node_struct **) xrealloc(walk->heap, walk->heapsize * sizeof(struct count_node_struct *));
+	}
+	c = walk->heapcount++;
+	walk->heap[c] = node;
+	while(c)
+	{
+		parent = (c - 1) / 2;
+		if(walk->heap[c]->time <= walk->heap[parent]->time)
+		{
+			break;
+		}
+		tmp = walk->heap[parent];
+		walk->heap[parent] = walk->heap[c];
+		walk->heap[c] = tmp;
+		c = parent;
+	}
+}
+
+static struct count_node_struct *
+count_pop(struct count_walk_struct *walk)
+{
+	struct count_node_struct *node, *tmp;
+	size_t c, child;
+
+	if(!walk->heapcount)
+	{
+		return NULL;
+	}
+	node = walk->heap[0];
+	node->queued = 0;
+	if(!count_full(walk, node))
+	{
+		walk->live--;
+	}
+	walk->heap[0] = walk->heap[--walk->heapcount];
+	c = 0;
+	for(;;)
+	{
+		child = c * 2 + 1;
+		if(child >= walk->heapcount)
+		{
+			break;
+		}
+		if(child + 1 < walk->heapcount && walk->heap[child + 1]->time > walk->heap[child]->time)
+		{
+			child++;
+		}
+		if(walk->heap[child]->time <= walk->heap[c]->time)
+		{
+			break;
+		}
+		tmp = walk->heap[child];
+		walk->heap[child] = walk->heap[c];
+		walk->heap[c] = tmp;
+		c = child;
+	}
+	return node;
+}
+
+/* Merge the set of a child into that of its parent, returning nonzero if
+ * the parent gained anything
+ */
+static int
+count_merge(struct count_walk_struct *walk, struct count_node_struct *parent, const struct count_node_struct *child)
+{
+	size_t c;
+	uint64_t added;
+	int wasfull;
+
+	wasfull = count_full(walk, parent);
+	added = 0;
+	for(c = 0; c < walk->nwords; c++)
+	{
+		added |= child->bits[c] & ~parent->bits[c];
+		parent->bits[c] |= child->bits[c];
+	}
+	/* A queued node which has become reachable from everything no longer
+	 * keeps the walk going
+	 */
+	if(added && parent->queued && !wasfull && count_full(walk, parent))
+	{
+		walk->live--;
 	}
-	printf("%s (%s)\n", branch_name, type);
+	return added != 0;
+}
+
+/* Count how far each of a group of tips is ahead of and behind their common
+ * base, with a single walk: the sets of tips (and the base) which can reach
+ * each commit are propagated from them in commit time order, as
+ * git_graph_ahead_behind() does for a single pair, until every queued commit
+ * can be reached from all of them. A tip is then ahead by each commit which
+ * it can reach and the base can't, and behind by each which the base can
+ * reach and it can't.
+ */
+static void
+count_group(git_repository *repo, ARENA *arena, struct verbose_job_struct *jobs, size_t njobs)
+{
+	struct count_walk_struct walk;
+	struct count_node_struct *node, *parent;
+	struct verbose_job_struct **tips;
+	git_commit *commit;
+	unsigned int c, count;
+	size_t n, w, bit;
+	uint64_t m;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.repo = repo;
+	walk.arena = arena;
+	/* A tip which is at the base is level with it, and needs no walk */
+	tips = (struct verbose_job_struct **) arena_alloc(arena, (njobs + 1) * sizeof(struct verbose_job_struct *));
+	for(n = 0; n < njobs; n++)
+	{
+		if(!git_oid_cmp(&(jobs[n].tip), &(jobs[n].base)))
+		{
+			jobs[n].counted = 1;
+		}
+		else
+		{
+			tips[walk.ntips++] = &(jobs[n]);
+		}
+	}
+	if(!walk.ntips)
+	{
+		return;
+	}
+	walk.nwords = walk.ntips / 64 + 1;
+	walk.full = (uint64_t *) arena_alloc(arena, walk.nwords * sizeof(uint64_t));
+	node = count_node(&walk, &(tips[0]->base));
+	if(!node)
+	{
+		free(walk.table);
+		return;
+	}
+	node->bits[walk.ntips / 64] |= (uint64_t) 1 << (walk.ntips % 64);
+	walk.full[walk.ntips / 64] |= (uint64_t) 1 << (walk.ntips % 64);
+	for(n = 0; n < walk.ntips; n++)
+	{
+		node = count_node(&walk, &(tips[n]->tip));
+		if(node)
+		{
+			node->bits[n / 64] |= (uint64_t) 1 << (n % 64);
+			walk.full[n / 64] |= (uint64_t) 1 << (n % 64);
+		}
+	}
+	/* Nothing is queued until the full set is known */
+	for(n = 0; n < walk.tablesize; n++)
+	{
+		if(walk.table[n])
+		{
+			count_push(&walk, walk.table[n]);
+		}
+	}
+	while(walk.live && (node = count_pop(&walk)))
+	{
+		if(git_commit_lookup(&commit, repo, &(node->oid)))
+		{
+			continue;
+		}
+		count = git_commit_parentcount(commit);
+		for(c = 0; c < count; c++)
+		{
+			parent = count_node(&walk, git_commit_parent_id(commit, c));
+			/* A commit is re-queued whenever it gains anything, so that a
+			 * parent which was visited before one of its children (because
+			 * of clock skew) still passes the complete set on
+			 */
+			if(parent && count_merge(&walk, parent, node))
+			{
+				count_push(&walk, parent);
+			}
+		}
+		git_commit_free(commit);
+	}
+	/* Anything still queued is reachable from everything, and so counts
+	 * towards nothing
+	 */
+	for(n = 0; n < walk.tablesize; n++)
+	{
+		node = walk.table[n];
+		if(!node)
+		{
+			continue;
+		}
+		for(w = 0; w < walk.nwords; w++)
+		{
+			/* The base's own bit is never set in a tip's mask */
+			m = walk.full[w];
+			if(w == walk.ntips / 64)
+			{
+				m &= ~((uint64_t) 1 << (walk.ntips % 64));
+			}
+			if(node->bits[walk.ntips / 64] & ((uint64_t) 1 << (walk.ntips % 64)))
+			{
+				for(m &= ~node->bits[w]; m; m &= m - 1)
+				{
+					bit = w * 64 + __builtin_ctzll(m);
+					tips[bit]->behind++;
+				}
+			}
+			else
+			{
+				for(m &= node->bits[w]; m; m &= m - 1)
+				{
+					bit = w * 64 + __builtin_ctzll(m);
+					tips[bit]->ahead++;
+				}
+			}
+		}
+	}
+	for(n = 0; n < walk.ntips; n++)
+	{
+		if(walk.full[n / 64] & ((uint64_t) 1 << (n % 64)))
+		{
+			tips[n]->counted = 1;
+		}
+	}
+	free(walk.table);
+	free(walk.heap);
+}
+
+/* Shorten the name of an upstream branch for display */
+static const char *
+short_name(const char *name)
+{
+	if(!strncmp(name, "refs/heads/", 11))
+	{
+		return name + 11;
+	}
+	if(!strncmp(name, "refs/remotes/", 13))
+	{
+		return name + 13;
+	}
+	return name;
+}
+
+static void
+write_verbose(OUTPUT *out, const struct verbose_branch_struct *branch, const struct verbose_job_struct *job)
+{
+	const char *type, *author;
+
+	type = type_name(branch->type);
+	author = job->author ? job->author : "";
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_printf(out, "%s (%s) %s %s", branch->name, type, job->date, author);
+		if(branch->upstream && job->counted)
+		{
+			output_printf(out, " [%s: ahead %lu, behind %lu]", short_name(branch->upstream), (unsigned long) job->ahead, (unsigned long) job->behind);
+		}
+		else if(branch->upstream)
+		{
+			output_printf(out, " [%s: gone]", short_name(branch->upstream));
+		}
+		output_putc(out, '\n');
+		return;
+	}
+	output_begin(out);
+	output_oid(out, "oid", &(branch->oid));
+	output_string(out, "name", branch->name);
+	output_label(out, "type", type);
+	output_string(out, "date", job->date);
+	output_string(out, "author", author);
+	output_string(out, "upstream", branch->upstream ? branch->upstream : "");
+	/* Without this, a branch whose upstream is gone (or whose counts
+	 * couldn't be determined) would look level with it
+	 */
+	output_number(out, "counted", job->counted ? 1 : 0);
+	output_number(out, "ahead", job->ahead);
+	output_number(out, "behind", job->behind);
+	output_end(out);
+}
+
+/* Write the branches whose jobs have finished, up to the first one whose job
+ * hasn't (or all of them, if all is set)
+ */
+static void
+write_ready(struct verbose_struct *v, int all)
+{
+	const struct verbose_branch_struct *branch;
+	size_t start;
+
+	start = v->written;
+	while(v->written < v->nbranches)
+	{
+		branch = &(v->branches[v->written]);
+		if(!all && !v->jobs[branch->job].done)
+		{
+			break;
+		}
+		write_verbose(v->out, branch, &(v->jobs[branch->job]));
+		v->written++;
+	}
+	if(v->written != start)
+	{
+		output_flush(v->out);
+	}
+}
+
+/* Run groups of jobs on a thread of its own until there are none left */
+static void *
+verbose_worker(void *data)
+{
+	struct verbose_struct *v;
+	git_repository *repo;
+	const git_error *err;
+	ARENA *arena;
+	size_t g, start, end, n;
+
+	v = (struct verbose_struct *) data;
+	if(git_repository_open(&repo, v->path))
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", v->progname, v->path, err->message);
+		return NULL;
+	}
+	/* Each group's walk re-uses the memory of the one before */
+	arena = arena_create();
+	for(;;)
+	{
+		g = __sync_fetch_and_add(&(v->next), 1);
+		if(g >= v->ngroups)
+		{
+			break;
+		}
+		start = v->groups[g].start;
+		end = v->groups[g].end;
+		for(n = start; n < end; n++)
+		{
+			describe_job(repo, &(v->jobs[n]));
+		}
+		if(v->jobs[start].hasbase)
+		{
+			count_group(repo, arena, &(v->jobs[start]), end - start);
+			arena_reset(arena);
+		}
+		pthread_mutex_lock(&(v->lock));
+		for(n = start; n < end; n++)
+		{
+			v->jobs[n].done = 1;
+		}
+		write_ready(v, 0);
+		pthread_mutex_unlock(&(v->lock));
+	}
+	arena_free(arena);
+	git_repository_free(repo);
+	return NULL;
+}
+
+/* List the branches accepted by a filter along with their tip metadata and
+ * ahead/behind counts
+ */
+static void
+list_verbose(const REF_FILTER *refs, git_repository *repo, ARENA *arena, const char *progname, unsigned types, const char *basename, int jobs, OUTPUT *out)
+{
+	struct verbose_struct v;
+	git_object *obj, *commit;
+	git_oid base;
+	size_t c;
+
+	memset(&v, 0, sizeof(v));
+	v.path = git_repository_path(repo);
+	v.progname = progname;
+	v.repo = repo;
+	v.arena = arena;
+	v.out = out;
+	if(basename)
+	{
+		if(git_revparse_single(&obj, repo, basename))
+		{
+			fprintf(stderr, "%s: %s: %s\n", progname, basename, giterr_last()->message);
+			exit(EXIT_FAILURE);
+		}
+		if(git_object_peel(&commit, obj, GIT_OBJ_COMMIT))
+		{
+			fprintf(stderr, "%s: %s: not a commit\n", progname, basename);
+			exit(EXIT_FAILURE);
+		}
+		git_oid_cpy(&base, git_object_id(commit));
+		git_object_free(commit);
+		git_object_free(obj);
+		v.basename = basename;
+		v.base = &base;
+	}
+	ref_filter_foreach(refs, repo, types, verbose_collect, &v);
+	verbose_jobs(&v);
+	if((size_t) jobs > v.ngroups)
+	{
+		jobs = (int) v.ngroups;
+	}
+	pthread_mutex_init(&(v.lock), NULL);
+	run_threads(jobs, verbose_worker, &v);
+	pthread_mutex_destroy(&(v.lock));
+	/* Anything left over couldn't be described */
+	write_ready(&v, 1);
+	for(c = 0; c < v.njobs; c++)
+	{
+		free(v.jobs[c].author);
+	}
+	free(v.branches);
+	free(v.jobs);
+	free(v.groups);
+}
+
+static int
+watch_add_callback(const struct ref_view_struct *ref, git_branch_t branch_type, void *data)
+{
+	(void) branch_type;
+
+	refwatch_add((REFWATCH *) data, ref->name, &(ref->oid), NULL);
+	return 0;
+}
+
+static int
+watch_scan(REFWATCH *watch, void *data)
+{
+	struct branch_watch_struct *bw;
+
+	bw = (struct branch_watch_struct *) data;
+	return ref_filter_foreach(bw->refs, bw->repo, bw->type, watch_add_callback, watch);
+}
+
+/* Write a change in the same form as git's reference-transaction hook is
+ * given it: the old and new object IDs and the name
+ */
+static int
+watch_callback(int change, const char *name, const git_oid *oldoid, const git_oid *newoid, const git_oid *peeled, void *data)
+{
+	OUTPUT *out;
+
+	(void) peeled;
+
+	out = (OUTPUT *) data;
+	if(change == REFWATCH_SETTLED)
+	{
+		return output_flush(out);
+	}
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_hex(out, oldoid);
+		output_putc(out, ' ');
+		output_hex(out, newoid);
+		output_putc(out, ' ');
+		output_puts(out, name);
+		output_putc(out, '\n');
+		return 0;
+	}
+	output_begin(out);
+	output_oid(out, "old", oldoid);
+	output_oid(out, "new", newoid);
+	output_string(out, "name", name);
+	output_end(out);
 	return 0;
 }
 
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s [PATH-TO-REPO]\nHonours GIT_DIR if set.\n", progname);
+	fprintf(stderr, "Usage: %s [OPTIONS] [PATH-TO-REPO]\nHonours GIT_DIR if set. OPTIONS is one or more of:\n", progname);
+	fprintf(stderr,
+			"  -h, --help              Print this usage message and exit\n"
+			"  -i, --include=PATTERN   Only list branches matching PATTERN (may be\n"
+			"                          given more than once)\n"
+			"  -x, --exclude=PATTERN   Don't list branches matching PATTERN\n"
+			"  -z                      Write the object ID, name and type of each\n"
+			"                          branch separated by tabs, ending each with NUL\n"
+			"  --json                  Write each branch as a JSON object on its own line\n"
+			"  --binary                Write each branch as its 20-byte object ID\n"
+			"                          followed by its name, prefixed with its length\n"
+			"                          as a 32-bit big-endian number\n"
+			"  -v, --verbose           Also give the date and author of each branch's\n"
+			"                          tip, and how far ahead of and behind its\n"
+			"                          upstream branch it is; in JSON and binary\n"
+			"                          output, 'counted' is 0 where that isn't known\n"
+			"                          (such as where the upstream branch is gone)\n"
+			"  --base=REV              Compare every branch with REV rather than its\n"
+			"                          upstream branch (implies --verbose)\n"
+			"  -j, --jobs=N            With --verbose, use N threads (by default, one\n"
+			"                          per processor)\n"
+			"  --watch                 List the branches as created, then keep running\n"
+			"                          and write a record for each branch created,\n"
+			"                          updated or deleted: its old object ID, new\n"
+			"                          object ID and name, where the old ID of a new\n"
+			"                          branch and the new ID of a deleted one are all\n"
+			"                          zeroes (as for git's reference-transaction hook)\n");
 }
 
 int
-main(int argc, char **argv)
+listbranch_main(int argc, char **argv)
 {
-	git_buf pathbuf;
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "include", required_argument, NULL, 'i' },
+		{ "exclude", required_argument, NULL, 'x' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "base", required_argument, NULL, OPT_BASE },
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "binary", no_argument, NULL, OPT_BINARY },
+		{ "watch", no_argument, NULL, OPT_WATCH },
+		{ NULL, 0, NULL, 0 }
+	};
 	const char *path;
-	const git_error *err;
-	git_repository *repo;
-	git_branch_iterator *iter;
-	git_branch_t type;
-	git_reference *ref;
+	REPO *repo;
+	REF_FILTER *refs;
+	OUTPUT *out;
+	REFWATCH *watch;
+	const char *basename;
+	int c, format, watching, verbose, jobs;
 	
 	struct branch_filter_struct filter;
+	struct branch_watch_struct bw;
 
+	refs = ref_filter_create();
+	format = OUTPUT_TEXT;
+	watching = 0;
+	verbose = 0;
+	basename = NULL;
+	jobs = 0;
+	while((c = getopt_long(argc, argv, "hi:x:zvj:", longopts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'i':
+			ref_filter_add(refs, optarg, 0);
+			break;
+		case 'x':
+			ref_filter_add(refs, optarg, 1);
+			break;
+		case 'z':
+			format = OUTPUT_NUL;
+			break;
+		case OPT_JSON:
+			format = OUTPUT_JSON;
+			break;
+		case OPT_BINARY:
+			format = OUTPUT_BINARY;
+			break;
+		case OPT_WATCH:
+			watching = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case OPT_BASE:
+			verbose = 1;
+			basename = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
 	path = NULL;
-	if(argc == 2)
+	if(argc - optind == 1)
 	{
-		path = argv[1];
+		path = argv[optind];
 	}
-	else if(argc != 1)
+	else if(argc - optind != 0)
 	{
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	if(!path)
+	if(verbose && watching)
 	{
-		path = getenv("GIT_DIR");
+		fprintf(stderr, "%s: --verbose can't be used with --watch\n", argv[0]);
+		exit(EXIT_FAILURE);
 	}
-	memset(&pathbuf, 0, sizeof(pathbuf));
-	if(!path)
+	if(verbose && jobs < 1)
 	{
-		if(git_repository_discover(&pathbuf, ".", 0, "/"))
-		{
-			err = giterr_last();
-			fprintf(stderr, "%s: %s\n", path, err->message);
-			exit(EXIT_FAILURE);
-		}
-		path = pathbuf.ptr;
+		jobs = nprocessors();
 	}
-	if(git_repository_open(&repo, path))
+	if(verbose && jobs > 1)
+	{
+		/* Required for libgit2 to be used from multiple threads */
+		git_libgit2_init();
+	}
+	/* Neither the configuration nor the releases database is needed, so
+	 * opening the repository loads neither
+	 */
+	repo = repo_open(argv[0], path, SQLITE_OPEN_READONLY, 0);
+	if(!repo)
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
 		exit(EXIT_FAILURE);
 	}
 	/* Only available in HEAD:
 	git_branch_foreach(repo, GIT_BRANCH_LOCAL, branch_callback, NULL);
 	 */
-	filter.data = NULL;
+	out = output_open(STDOUT_FILENO, format);
+	filter.data = out;
 	filter.cb = branch_callback;
 	filter.type = GIT_BRANCH_LOCAL | GIT_BRANCH_REMOTE;
-	git_branch_iterator_new(&iter, repo, filter.type);
-	while(git_branch_next(&ref, &type, iter) == 0)
+	if(watching)
+	{
+		bw.refs = refs;
+		bw.repo = repo->repo;
+		bw.type = filter.type;
+		watch = refwatch_open(repo->repo, argv[0], watch_scan, &bw);
+		if(!watch)
+		{
+			exit(EXIT_FAILURE);
+		}
+		/* This only returns if something goes wrong */
+		refwatch_run(watch, watch_callback, out);
+		refwatch_close(watch);
+		output_close(out);
+		exit(EXIT_FAILURE);
+	}
+	if(verbose)
 	{
-		filter.cb(ref, git_reference_name(ref), type, filter.data);
+		list_verbose(refs, repo->repo, repo->arena, argv[0], filter.type, basename, jobs, out);
+	}
+	else
+	{
+		/* Only the names of matching branches are needed, so nothing is
+		 * looked up or resolved for the rest
+		 */
+		ref_filter_foreach(refs, repo->repo, filter.type, filter.cb, filter.data);
+	}
+	ref_filter_free(refs);
+	repo_close(repo);
+	if(verbose && jobs > 1)
+	{
+		git_libgit2_shutdown();
+	}
+	if(output_close(out))
+	{
+		fprintf(stderr, "%s: failed to write output\n", argv[0]);
+		exit(EXIT_FAILURE);
 	}
-	git_branch_iterator_free(iter);
-	git_repository_free(repo);
-	git_buf_free(&pathbuf);
 	return 0;
 }
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return listbranch_main(argc, argv);
+}
+#endif
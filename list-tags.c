@@ -2,103 +2,613 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <limits.h>
+#include <stdint.h>
+#include <getopt.h>
 
-#include <git2.h>
+#include "utils.h"
+#include "refdb.h"
+#include "refwatch.h"
+#include "output.h"
+#include "multicall.h"
+
+/* Tags are listed by reading packed-refs directly rather than by looking up
+ * and resolving each reference through libgit2 (see refdb.h). When
+ * packed-refs records peeled objects, an annotated tag can be peeled without
+ * reading any objects at all; loose tags, and packed tags without peeled
+ * information, are peeled by looking up the object.
+ */
+
+#define TAGS_PREFIX                     "refs/tags/"
+
+#define OPT_JSON                        256
+#define OPT_BINARY                      257
+#define OPT_SORT                        258
+#define OPT_WATCH                       259
+#define OPT_RELEASES                    260
+
+/* With --sort=version, each tag is given a sort key when it is collected: the
+ * key built by version_key() from the version check_release_tag() finds in
+ * its name, or an empty key for tags which aren't releases, so that they sort
+ * first. The tags are then sorted by comparing the first eight bytes of the
+ * keys as integers, and the rest with memcmp() only where those are equal;
+ * tags with equal keys remain in name order.
+ */
+
+#define SORT_NAME                       0
+#define SORT_VERSION                    1
+
+/* With --releases, the rows of the releases table are given sort keys in the
+ * same way and sorted likewise, so that the release tags and the releases
+ * can be joined in a single pass over both, without querying the database
+ * for each tag (it can't sort by Debian version itself).
+ */
 
 struct tag_filter_struct
 {
-	int (*cb)(const char *tag_name, git_oid *oid, void *data);
+	int (*cb)(const char *tag_name, const git_oid *oid, const git_oid *peeled, void *data);
 	void *data;
 	git_repository *repo;
 };
 
+struct tag_struct
+{
+	/* The first eight bytes of the sort key, as a big-endian integer */
+	uint64_t prefix;
+	/* The sort key, as an offset into the key buffer */
+	size_t key;
+	size_t keylen;
+	/* The order in which the tag was found */
+	size_t index;
+	/* Allocated from the repository's arena */
+	char *name;
+	git_oid oid;
+	git_oid peeled;
+};
+
+/* The rest of a row of the releases table, whose version is the name of the
+ * tag_struct with the same index
+ */
+struct release_row_struct
+{
+	char *branch;
+	char *state;
+	char *built;
+};
+
+struct tag_list_struct
+{
+	/* The repository, whose release tag prefixes are used */
+	REPO *repo;
+	struct tag_struct *tags;
+	size_t ntags;
+	size_t nalloc;
+	unsigned char *keys;
+	size_t keysize;
+	size_t keyalloc;
+	/* The releases, when the list holds rows of the releases table */
+	struct release_row_struct *rows;
+};
+
 static int
-tag_callback(const char *tag_name, git_oid *oid, void *data)
-{
-	char buf[GIT_OID_HEXSZ + 1];
-	
-	(void) data;
-	
-	git_oid_tostr(buf, sizeof(buf), oid);
-	printf("%s -> %s\n", tag_name, buf);
+tag_callback(const char *tag_name, const git_oid *oid, const git_oid *peeled, void *data)
+{
+	OUTPUT *out;
+
+	out = (OUTPUT *) data;
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_puts(out, tag_name);
+		output_puts(out, " -> ");
+		output_hex(out, oid);
+		output_putc(out, ' ');
+		output_hex(out, peeled);
+		output_putc(out, '\n');
+		return 0;
+	}
+	output_begin(out);
+	output_oid(out, "oid", oid);
+	output_oid(out, "peeled", peeled);
+	output_string(out, "name", tag_name);
+	output_end(out);
 	return 0;
 }
 
+/* Peel a tag whose peeled object isn't already known */
+static void
+peel_tag(git_repository *repo, const git_oid *oid, git_oid *peeled)
+{
+	git_object *obj, *target;
+
+	git_oid_cpy(peeled, oid);
+	if(git_object_lookup(&obj, repo, oid, GIT_OBJ_ANY))
+	{
+		return;
+	}
+	if(git_object_type(obj) == GIT_OBJ_TAG && !git_object_peel(&target, obj, GIT_OBJ_ANY))
+	{
+		git_oid_cpy(peeled, git_object_id(target));
+		git_object_free(target);
+	}
+	git_object_free(obj);
+}
+
 static int
-ref_callback(git_reference *ref, void *data)
+ref_callback(const struct ref_view_struct *ref, void *data)
 {
 	struct tag_filter_struct *filter;
-	git_reference *resolved;
-	git_oid oid;
-	
-	if(!git_reference_is_tag(ref))
+	git_oid peeled;
+
+	filter = (struct tag_filter_struct *) data;
+	if(ref->peeled)
+	{
+		return filter->cb(ref->name, &(ref->oid), ref->peeled, filter->data);
+	}
+	peel_tag(filter->repo, &(ref->oid), &peeled);
+	return filter->cb(ref->name, &(ref->oid), &peeled, filter->data);
+}
+
+/* Add an entry to a list, with the sort key for its version (if it has one) */
+static struct tag_struct *
+add_tag(struct tag_list_struct *list, const char *name, const char *version)
+{
+	struct tag_struct *tag;
+	unsigned char *key;
+	size_t c;
+
+	if(list->ntags == list->nalloc)
+	{
+		list->nalloc = list->nalloc ? list->nalloc * 2 : 256;
+		list->tags = (struct tag_struct *) xrealloc(list->tags, list->nalloc * sizeof(struct tag_struct));
+	}
+	if(list->keysize + VERSION_KEY_MAX > list->keyalloc)
+	{
+		list->keyalloc = list->keyalloc ? list->keyalloc * 2 : 256 * VERSION_KEY_MAX;
+		list->keys = (unsigned char *) xrealloc(list->keys, list->keyalloc);
+	}
+	tag = &(list->tags[list->ntags]);
+	memset(tag, 0, sizeof(struct tag_struct));
+	tag->name = arena_strdup(list->repo->arena, name);
+	tag->index = list->ntags;
+	tag->key = list->keysize;
+	key = list->keys + list->keysize;
+	if(version)
+	{
+		tag->keylen = version_key(version, key, VERSION_KEY_MAX);
+	}
+	/* Keys contain no zero bytes, so padding the prefix with them doesn't
+	 * change the order
+	 */
+	for(c = 0; c < 8; c++)
+	{
+		tag->prefix = (tag->prefix << 8) | (c < tag->keylen ? key[c] : 0);
+	}
+	list->keysize += tag->keylen;
+	list->ntags++;
+	return tag;
+}
+
+/* Collect a tag, along with its sort key */
+static int
+collect_callback(const char *tag_name, const git_oid *oid, const git_oid *peeled, void *data)
+{
+	struct tag_list_struct *list;
+	struct tag_struct *tag;
+
+	list = (struct tag_list_struct *) data;
+	tag = add_tag(list, tag_name, check_release_tag(list->repo, tag_name));
+	git_oid_cpy(&(tag->oid), oid);
+	git_oid_cpy(&(tag->peeled), peeled);
+	return 0;
+}
+
+/* Collect a row of the releases table */
+static int
+release_row_cb(void *data, int ncols, char **values, char **columns)
+{
+	struct tag_list_struct *list;
+	struct release_row_struct *row;
+	size_t n;
+
+	(void) ncols;
+	(void) columns;
+
+	list = (struct tag_list_struct *) data;
+	n = list->nalloc;
+	add_tag(list, values[0], values[0]);
+	if(list->nalloc != n || !list->rows)
+	{
+		list->rows = (struct release_row_struct *) xrealloc(list->rows, list->nalloc * sizeof(struct release_row_struct));
+	}
+	row = &(list->rows[list->ntags - 1]);
+	row->branch = arena_strdup(list->repo->arena, values[1]);
+	row->state = arena_strdup(list->repo->arena, values[2] ? values[2] : "");
+	row->built = arena_strdup(list->repo->arena, values[3] ? values[3] : "");
+	return 0;
+}
+
+/* Compare the sort keys of two entries, which may belong to different lists */
+static int
+key_cmp(const unsigned char *keys_a, const struct tag_struct *ta, const unsigned char *keys_b, const struct tag_struct *tb)
+{
+	size_t len;
+	int r;
+
+	if(ta->prefix != tb->prefix)
+	{
+		return ta->prefix < tb->prefix ? -1 : 1;
+	}
+	if(ta->keylen > 8 || tb->keylen > 8)
+	{
+		len = ta->keylen < tb->keylen ? ta->keylen : tb->keylen;
+		r = memcmp(keys_a + ta->key, keys_b + tb->key, len);
+		if(r)
+		{
+			return r;
+		}
+		if(ta->keylen != tb->keylen)
+		{
+			return ta->keylen < tb->keylen ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+static const unsigned char *sort_keys;
+
+static int
+tag_cmp(const void *a, const void *b)
+{
+	const struct tag_struct *ta, *tb;
+	int r;
+
+	ta = (const struct tag_struct *) a;
+	tb = (const struct tag_struct *) b;
+	r = key_cmp(sort_keys, ta, sort_keys, tb);
+	if(r)
+	{
+		return r;
+	}
+	return ta->index < tb->index ? -1 : ta->index > tb->index;
+}
+
+static void
+sort_list(struct tag_list_struct *list)
+{
+	sort_keys = list->keys;
+	qsort(list->tags, list->ntags, sizeof(struct tag_struct), tag_cmp);
+}
+
+/* Sort the collected tags and write them out, in reverse if asked to */
+static void
+write_sorted(struct tag_list_struct *list, int reverse, OUTPUT *out)
+{
+	struct tag_struct *tag;
+	size_t c;
+
+	sort_list(list);
+	for(c = 0; c < list->ntags; c++)
+	{
+		tag = &(list->tags[reverse ? list->ntags - c - 1 : c]);
+		tag_callback(tag->name, &(tag->oid), &(tag->peeled), out);
+	}
+	free(list->tags);
+	free(list->keys);
+}
+
+static void
+write_release(OUTPUT *out, const struct tag_struct *tag, const char *version, const struct release_row_struct *row)
+{
+	output_begin(out);
+	output_string(out, "version", version);
+	output_oid(out, "peeled", &(tag->peeled));
+	output_string(out, "name", tag->name);
+	output_string(out, "branch", row ? row->branch : "");
+	output_string(out, "state", row ? row->state : "");
+	output_string(out, "built", row ? row->built : "");
+	output_end(out);
+}
+
+/* Sort the collected tags and the rows of the releases table by version, and
+ * write each release tag along with each of its releases
+ */
+static int
+write_releases(REPO *repo, struct tag_list_struct *list, OUTPUT *out)
+{
+	struct tag_list_struct rows;
+	const struct tag_struct *tag, *row;
+	const char *version;
+	char *err;
+	size_t t, r, c;
+	int found;
+
+	memset(&rows, 0, sizeof(rows));
+	rows.repo = repo;
+	err = NULL;
+	if(sqlite3_exec(repo_db(repo), "SELECT \"release\", \"branch\", \"state\", \"built\" FROM \"releases\"", release_row_cb, (void *) &rows, &err))
+	{
+		fprintf(stderr, "%s: %s\n", repo->progname, err);
+		sqlite3_free(err);
+		return -1;
+	}
+	sort_list(list);
+	sort_list(&rows);
+	r = 0;
+	for(t = 0; t < list->ntags; t++)
+	{
+		tag = &(list->tags[t]);
+		/* Tags which aren't releases have empty keys, and sort first */
+		if(!tag->keylen)
+		{
+			continue;
+		}
+		version = check_release_tag(repo, tag->name);
+		while(r < rows.ntags && key_cmp(rows.keys, &(rows.tags[r]), list->keys, tag) < 0)
+		{
+			r++;
+		}
+		/* Versions which sort equally needn't be identical, so each row
+		 * with an equal key is checked (this is also where more than one
+		 * tag names the same version, or a release was built for more than
+		 * one branch)
+		 */
+		found = 0;
+		for(c = r; c < rows.ntags && !key_cmp(rows.keys, &(rows.tags[c]), list->keys, tag); c++)
+		{
+			row = &(rows.tags[c]);
+			if(!strcmp(row->name, version))
+			{
+				write_release(out, tag, version, &(rows.rows[row->index]));
+				found = 1;
+			}
+		}
+		if(!found)
+		{
+			write_release(out, tag, version, NULL);
+		}
+	}
+	free(list->tags);
+	free(list->keys);
+	free(rows.tags);
+	free(rows.keys);
+	free(rows.rows);
+	return 0;
+}
+
+static int
+watch_add_callback(const char *tag_name, const git_oid *oid, const git_oid *peeled, void *data)
+{
+	refwatch_add((REFWATCH *) data, tag_name, oid, peeled);
+	return 0;
+}
+
+/* With --watch, the tags are scanned again whenever the references change
+ * (see refwatch.h)
+ */
+static int
+watch_scan(REFWATCH *watch, void *data)
+{
+	struct tag_filter_struct filter;
+	REFDB *db;
+	int r;
+
+	filter.cb = watch_add_callback;
+	filter.data = watch;
+	filter.repo = (git_repository *) data;
+	db = refdb_open(filter.repo);
+	r = refdb_foreach(db, TAGS_PREFIX, ref_callback, &filter);
+	refdb_close(db);
+	return r;
+}
+
+/* Write a change in the same form as git's reference-transaction hook is
+ * given it, followed by the object the tag now peels to
+ */
+static int
+watch_callback(int change, const char *name, const git_oid *oldoid, const git_oid *newoid, const git_oid *peeled, void *data)
+{
+	OUTPUT *out;
+
+	out = (OUTPUT *) data;
+	if(change == REFWATCH_SETTLED)
 	{
+		return output_flush(out);
+	}
+	if(output_format(out) == OUTPUT_TEXT)
+	{
+		output_hex(out, oldoid);
+		output_putc(out, ' ');
+		output_hex(out, newoid);
+		output_putc(out, ' ');
+		output_puts(out, name);
+		output_putc(out, ' ');
+		output_hex(out, peeled);
+		output_putc(out, '\n');
 		return 0;
 	}
-	filter = (struct tag_filter_struct *) data;
-	resolved = NULL;
-	git_reference_resolve(&resolved, ref);
-	git_oid_cpy(&oid, git_reference_target(resolved));
-	git_reference_free(resolved);
-	return filter->cb(git_reference_name(ref), &oid, filter->data);
+	output_begin(out);
+	output_oid(out, "old", oldoid);
+	output_oid(out, "new", newoid);
+	output_oid(out, "peeled", peeled);
+	output_string(out, "name", name);
+	output_end(out);
 	return 0;
 }
 
 static void
 usage(const char *progname)
 {
-	fprintf(stderr, "Usage: %s [PATH-TO-REPO]\nHonours GIT_DIR if set.\n", progname);
+	fprintf(stderr, "Usage: %s [OPTIONS] [PATH-TO-REPO]\nHonours GIT_DIR if set.\nLists each tag, the object it refers to, and the object it peels to.\nOPTIONS is one or more of:\n", progname);
+	fprintf(stderr,
+			"  -h, --help    Print this usage message and exit\n"
+			"  --sort=KEY    Sort the tags by KEY, which is either 'name' (the\n"
+			"                default) or 'version' (release tags by their version\n"
+			"                numbers, after any other tags); prefix it with '-' to\n"
+			"                sort in descending order\n"
+			"  -z            Write the object ID, peeled object ID and name of each tag\n"
+			"                separated by tabs, ending each with NUL\n"
+			"  --json        Write each tag as a JSON object on its own line\n"
+			"  --binary      Write each tag as its 20-byte object ID and 20-byte peeled\n"
+			"                object ID, followed by its name, prefixed with its length\n"
+			"                as a 32-bit big-endian number\n"
+			"  --watch       List the tags as created, then keep running and write a\n"
+			"                record for each tag created, updated or deleted: its old\n"
+			"                object ID, new object ID, name and peeled object ID, where\n"
+			"                the old ID of a new tag and the new ID of a deleted one\n"
+			"                are all zeroes\n"
+			"  --releases    List only release tags, sorted by version, each joined\n"
+			"                with the rows of the releases database for its version:\n"
+			"                the version, the peeled object ID and name of the tag, and\n"
+			"                the release's branch, state and build time (empty if\n"
+			"                nothing has been recorded for the version); a version\n"
+			"                released on more than one branch has a record for each\n");
 }
 
 int
-main(int argc, char **argv)
+listtag_main(int argc, char **argv)
 {
-	git_buf pathbuf;
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "binary", no_argument, NULL, OPT_BINARY },
+		{ "sort", required_argument, NULL, OPT_SORT },
+		{ "watch", no_argument, NULL, OPT_WATCH },
+		{ "releases", no_argument, NULL, OPT_RELEASES },
+		{ NULL, 0, NULL, 0 }
+	};
 	const char *path;
-	const git_error *err;
-	git_repository *repo;
+	REPO *repo;
 	struct tag_filter_struct filter;
-	
+	struct tag_list_struct list;
+	const char *key;
+	REFDB *db;
+	REFWATCH *watch;
+	OUTPUT *out;
+	int c, format, sort, reverse, watching, releases;
+
+	format = OUTPUT_TEXT;
+	sort = SORT_NAME;
+	reverse = 0;
+	watching = 0;
+	releases = 0;
+	while((c = getopt_long(argc, argv, "hz", longopts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'z':
+			format = OUTPUT_NUL;
+			break;
+		case OPT_JSON:
+			format = OUTPUT_JSON;
+			break;
+		case OPT_BINARY:
+			format = OUTPUT_BINARY;
+			break;
+		case OPT_SORT:
+			key = optarg;
+			reverse = (*key == '-');
+			if(reverse)
+			{
+				key++;
+			}
+			if(!strcmp(key, "name"))
+			{
+				sort = SORT_NAME;
+			}
+			else if(!strcmp(key, "version"))
+			{
+				sort = SORT_VERSION;
+			}
+			else
+			{
+				fprintf(stderr, "%s: unsupported sort key '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_WATCH:
+			watching = 1;
+			break;
+		case OPT_RELEASES:
+			releases = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
 	path = NULL;
-	if(argc == 2)
+	if(argc - optind == 1)
 	{
-		path = argv[1];
+		path = argv[optind];
 	}
-	else if(argc != 1)
+	else if(argc - optind != 0)
 	{
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	if(!path)
+	repo = repo_open(argv[0], path, SQLITE_OPEN_READONLY, releases);
+	if(!repo)
+	{
+		exit(EXIT_FAILURE);
+	}
+	memset(&filter, 0, sizeof(filter));
+	out = output_open(STDOUT_FILENO, format);
+	if(watching)
+	{
+		watch = refwatch_open(repo->repo, argv[0], watch_scan, repo->repo);
+		if(!watch)
+		{
+			exit(EXIT_FAILURE);
+		}
+		/* This only returns if something goes wrong */
+		refwatch_run(watch, watch_callback, out);
+		refwatch_close(watch);
+		output_close(out);
+		exit(EXIT_FAILURE);
+	}
+	filter.data = out;
+	filter.cb = tag_callback;
+	filter.repo = repo->repo;
+	memset(&list, 0, sizeof(list));
+	list.repo = repo;
+	if(sort != SORT_NAME || reverse || releases)
 	{
-		path = getenv("GIT_DIR");
+		/* Tags are enumerated in name order, so they need only be
+		 * collected first if they're to be written in some other order
+		 */
+		filter.data = &list;
+		filter.cb = collect_callback;
 	}
-	memset(&pathbuf, 0, sizeof(pathbuf));
-	if(!path)
+	db = refdb_open(repo->repo);
+	refdb_foreach(db, TAGS_PREFIX, ref_callback, &filter);
+	refdb_close(db);
+	if(releases)
 	{
-		if(git_repository_discover(&pathbuf, ".", 0, "/"))
+		if(write_releases(repo, &list, out))
 		{
-			err = giterr_last();
-			fprintf(stderr, "%s: %s\n", path, err->message);
+			output_close(out);
 			exit(EXIT_FAILURE);
 		}
-		path = pathbuf.ptr;
 	}
-	if(git_repository_open(&repo, path))
+	else if(filter.cb == collect_callback)
+	{
+		write_sorted(&list, reverse, out);
+	}
+	repo_close(repo);
+	if(output_close(out))
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s\n", path, err->message);
+		fprintf(stderr, "%s: failed to write output\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	/* Only available in HEAD:
-	git_tag_foreach(repo, tag_callback, NULL);
-	 */
-	filter.data = NULL;
-	filter.cb = tag_callback;
-	filter.repo = repo;
-	git_reference_foreach(repo, ref_callback, &filter);
-	git_repository_free(repo);
-	git_buf_free(&pathbuf);
 	return 0;
 }
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return listtag_main(argc, argv);
+}
+#endif
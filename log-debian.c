@@ -5,6 +5,9 @@
 #include <ctype.h>
 
 #include "utils.h"
+#include "commit-graph.h"
+#include "refdb.h"
+#include "multicall.h"
 
 /* Output a changelog in Debian format:
 
@@ -21,11 +24,30 @@ package (version) branch; urgency=low
 struct tag_match_struct
 {
 	REPO *repo;
-	const git_oid *oid;
 	char *buf;
 	size_t buflen;
 };
 
+struct release_tag_struct
+{
+	/* The commit the tag leads to */
+	git_oid commit;
+	/* The order in which the tag was found */
+	size_t index;
+	char *version;
+};
+
+/* The release tags, sorted by commit, so that each commit being logged can be
+ * matched with a binary search rather than by visiting every tag
+ */
+struct tag_table_struct
+{
+	REPO *repo;
+	struct release_tag_struct *tags;
+	size_t ntags;
+	size_t nalloc;
+};
+
 static void
 usage(const char *progname)
 {
@@ -38,24 +60,118 @@ usage(const char *progname)
 }
 
 static int
-tag_callback(const char *tag_name, git_oid *oid, void *data)
+tag_callback(const struct ref_view_struct *ref, void *data)
 {
-	struct tag_match_struct *match;
+	struct tag_table_struct *table;
+	struct release_tag_struct *tag;
+	git_object *obj, *peeled;
 	const char *t;
 	
-	match = (struct tag_match_struct *) data;
-	t = check_release_tag(tag_name);
+	table = (struct tag_table_struct *) data;
+	t = check_release_tag(table->repo, ref->name);
 	if(!t)
 	{
 		return 0;
 	}
-	if(git_oid_cmp(oid, match->oid))
+	if(table->ntags == table->nalloc)
+	{
+		table->nalloc = table->nalloc ? table->nalloc * 2 : 32;
+		table->tags = (struct release_tag_struct *) xrealloc(table->tags, table->nalloc * sizeof(struct release_tag_struct));
+	}
+	tag = &(table->tags[table->ntags]);
+	if(ref->peeled)
+	{
+		/* packed-refs records the object the tag leads to */
+		git_oid_cpy(&(tag->commit), ref->peeled);
+	}
+	else if(!git_object_lookup(&obj, table->repo->repo, &(ref->oid), GIT_OBJ_ANY))
+	{
+		if(git_object_peel(&peeled, obj, GIT_OBJ_COMMIT))
+		{
+			git_object_free(obj);
+			return 0;
+		}
+		git_oid_cpy(&(tag->commit), git_object_id(peeled));
+		git_object_free(peeled);
+		git_object_free(obj);
+	}
+	else
 	{
 		return 0;
 	}
-	strncpy(match->buf, t, match->buflen);
-	match->buf[match->buflen - 1] = 0;
-	return 1;
+	tag->index = table->ntags;
+	tag->version = arena_strdup(table->repo->arena, t);
+	table->ntags++;
+	return 0;
+}
+
+static int
+release_tag_cmp(const void *a, const void *b)
+{
+	const struct release_tag_struct *ta, *tb;
+	int r;
+
+	ta = (const struct release_tag_struct *) a;
+	tb = (const struct release_tag_struct *) b;
+	r = git_oid_cmp(&(ta->commit), &(tb->commit));
+	if(r)
+	{
+		return r;
+	}
+	return ta->index < tb->index ? -1 : ta->index > tb->index;
+}
+
+/* Collect the release tags and sort them by commit; where several release
+ * tags lead to the same commit, the first one (in name order) is used
+ */
+static void
+collect_release_tags(struct tag_table_struct *table)
+{
+	REFDB *db;
+	size_t c, n;
+
+	db = refdb_open(table->repo->repo);
+	refdb_foreach(db, "refs/tags/", tag_callback, (void *) table);
+	refdb_close(db);
+	qsort(table->tags, table->ntags, sizeof(struct release_tag_struct), release_tag_cmp);
+	for(c = n = 0; c < table->ntags; c++)
+	{
+		if(n && !git_oid_cmp(&(table->tags[n - 1].commit), &(table->tags[c].commit)))
+		{
+			continue;
+		}
+		table->tags[n++] = table->tags[c];
+	}
+	table->ntags = n;
+}
+
+/* Find the release tag for a commit, if there is one */
+static const char *
+find_release_tag(const struct tag_table_struct *table, const git_oid *oid)
+{
+	size_t lo, hi, mid;
+	int r;
+
+	lo = 0;
+	hi = table->ntags;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		r = git_oid_cmp(&(table->tags[mid].commit), oid);
+		if(!r)
+		{
+			return table->tags[mid].version;
+		}
+		if(r < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return NULL;
 }
 
 static int
@@ -80,14 +196,26 @@ static const char *
 commit_is_release(REPO *repo, git_commit *commit, const char *branchname)
 {
 	static char version[64];
+	static struct tag_table_struct *table;
 	const git_oid *id;
+	const char *t;
 	char oidstr[GIT_OID_HEXSZ+1];
 	struct tag_match_struct match;
 	char sqlbuf[256];
+	sqlite3 *db;
 	char *err;
 
 	if(!commit)
 	{
+		/* The log is complete, so the tags (if they were collected) are no
+		 * longer needed
+		 */
+		if(table)
+		{
+			free(table->tags);
+			free(table);
+			table = NULL;
+		}
 		return NULL;
 	}
 	id = git_commit_id(commit);  
@@ -95,13 +223,14 @@ commit_is_release(REPO *repo, git_commit *commit, const char *branchname)
 	match.repo = repo;
 	match.buf = version;
 	match.buflen = sizeof(version);
-	if(repo->db)
+	db = repo_db(repo);
+	if(db)
 	{
 		git_oid_fmt(oidstr, id);
 		oidstr[GIT_OID_HEXSZ] = 0;
 		sprintf(sqlbuf, "SELECT \"release\" FROM \"releases\" WHERE \"branch\" = '%s' AND \"commit\" = '%s'", branchname, oidstr);
 		err = NULL;
-		if(sqlite3_exec(repo->db, sqlbuf, release_exists_cb, (void *) &match, &err))
+		if(sqlite3_exec(db, sqlbuf, release_exists_cb, (void *) &match, &err))
 		{
 			fprintf(stderr, "%s: %s\n", repo->progname, err);
 			exit(EXIT_FAILURE);
@@ -112,14 +241,20 @@ commit_is_release(REPO *repo, git_commit *commit, const char *branchname)
 		}
 		return NULL;
 	}
-	match.oid = id;
-
-	git_tag_foreach(repo->repo, tag_callback, (void *) &match);
-	if(version[0])
+	if(!table)
 	{
-		return version;
+		table = (struct tag_table_struct *) xalloc(sizeof(struct tag_table_struct));
+		table->repo = repo;
+		collect_release_tags(table);
 	}
-	return NULL;
+	t = find_release_tag(table, id);
+	if(!t)
+	{
+		return NULL;
+	}
+	strncpy(version, t, sizeof(version));
+	version[sizeof(version) - 1] = 0;
+	return version;
 }
 
 static int
@@ -201,14 +336,14 @@ log_commit(REPO *repo, git_commit *commit, const char *branchname)
 	if(!relsig)
 	{
 		relsig = sig;
-		printf("%s (%s) %s; urgency=low\n\n", repo->name, vers, branchname);
+		printf("%s (%s) %s; urgency=low\n\n", repo_name(repo), vers, branchname);
 	}
 	log_commit_message(git_commit_message(commit));
 	return 1;
 }
 
 int
-main(int argc, char **argv)
+debian_changelog_main(int argc, char **argv)
 {
 	const char *path, *branch, *startcommit;
 	const git_error *err;
@@ -220,6 +355,7 @@ main(int argc, char **argv)
 	git_commit *commit;
 	char oidstr[GIT_OID_HEXSZ+1];
 	REPO *repo;
+	COMMIT_GRAPH *graph;
 	int c, started;
 
 	startcommit = NULL;
@@ -289,6 +425,24 @@ main(int argc, char **argv)
 	/* Find the tip of the branch */
 	tip = git_reference_target(ref);
 	git_oid_cpy(&oid, tip);
+	if(startcommit)
+	{
+		/* Check that the starting commit is on the branch before walking its
+		 * history; with a commit graph, this stops at the starting commit's
+		 * generation rather than walking to the root
+		 */
+		graph = commit_graph_open(repo->repo);
+		if(commit_reachable(graph, repo->repo, &oid, &startoid) == 0)
+		{
+			git_oid_fmt(oidstr, &startoid);
+			oidstr[GIT_OID_HEXSZ] = 0;
+			fprintf(stderr, "%s: commit '%s' does not appear on branch '%s'\n", repo->progname, oidstr, branch);
+			commit_graph_close(graph);
+			repo_close(repo);
+			exit(EXIT_FAILURE);
+		}
+		commit_graph_close(graph);
+	}
 	/* Create a walker for the log entries for this branch */
 	git_revwalk_new(&walker, repo->repo);
 	git_revwalk_sorting(walker, GIT_SORT_TOPOLOGICAL);
@@ -353,3 +507,11 @@ main(int argc, char **argv)
 	repo_close(repo);
 	return 0;
 }
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return debian_changelog_main(argc, argv);
+}
+#endif
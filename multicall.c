@@ -0,0 +1,344 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* A single binary containing every tool, which runs the tool it was invoked
+ * as (so that it can be installed as a set of links named after the tools),
+ * or else the one named by its first argument.
+ *
+ * With --script, it runs a sequence of tools, one per line of the script, in
+ * the same process. The repository is opened once, before the first of them
+ * runs, and shared by all of them (see repo_share()), so that the work of
+ * opening it, mapping its pack indexes, and whatever libgit2 has cached by
+ * then is done only once, however many tools a hook runs. The script stops
+ * at the first tool which fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <git2.h>
+
+#include "utils.h"
+#include "multicall.h"
+
+struct command_struct
+{
+	const char *name;
+	int (*main)(int argc, char **argv);
+};
+
+static const struct command_struct commands[] = {
+	{ "listbranch", listbranch_main },
+	{ "listtag", listtag_main },
+	{ "getall", getall_main },
+	{ "branchfor", branchfor_main },
+	{ "git-debian-changelog", debian_changelog_main },
+	{ "git-track-releases", track_releases_main },
+	{ "git-update-generations", update_generations_main },
+	{ "git-ref-changes", ref_changes_main },
+	{ NULL, NULL }
+};
+
+struct script_struct
+{
+	char **lines;
+	size_t nlines;
+	size_t nalloc;
+};
+
+/* Find a tool by name; the "git-" which begins some of their names may be
+ * left out
+ */
+static const struct command_struct *
+find_command(const char *name)
+{
+	const struct command_struct *cmd;
+
+	for(cmd = commands; cmd->name; cmd++)
+	{
+		if(!strcmp(cmd->name, name) || (!strncmp(cmd->name, "git-", 4) && !strcmp(cmd->name + 4, name)))
+		{
+			return cmd;
+		}
+	}
+	return NULL;
+}
+
+static int
+run_command(const struct command_struct *cmd, int argc, char **argv)
+{
+	int r;
+
+	/* Resetting optind to zero makes getopt() start afresh, forgetting
+	 * anything it remembers from the last tool's arguments
+	 */
+	optind = 0;
+	r = cmd->main(argc, argv);
+	fflush(stdout);
+	return r;
+}
+
+/* Read a script, from standard input if the path is "-" */
+static int
+read_script(const char *progname, const char *path, struct script_struct *script)
+{
+	FILE *f;
+	char *line;
+	size_t size;
+	ssize_t len;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(errno));
+		return -1;
+	}
+	line = NULL;
+	size = 0;
+	while((len = getline(&line, &size, f)) != -1)
+	{
+		while(len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		{
+			line[--len] = 0;
+		}
+		if(script->nlines == script->nalloc)
+		{
+			script->nalloc = script->nalloc ? script->nalloc * 2 : 16;
+			script->lines = (char **) xrealloc(script->lines, script->nalloc * sizeof(char *));
+		}
+		script->lines[script->nlines++] = xstrdup(line);
+	}
+	free(line);
+	if(f != stdin)
+	{
+		fclose(f);
+	}
+	return 0;
+}
+
+/* Split a line of a script into words, in place: words are separated by
+ * whitespace, and may be quoted with single or double quotes; outside single
+ * quotes, a backslash escapes the character which follows it, and a word
+ * beginning with '#' begins a comment. Returns the number of words (the list
+ * of which is terminated with NULL), or -1 if a quote isn't closed
+ */
+static int
+split_line(char *line, char ***words, size_t *nalloc)
+{
+	char *r, *w;
+	int argc, quote;
+
+	argc = 0;
+	r = line;
+	for(;;)
+	{
+		while(*r == ' ' || *r == '\t')
+		{
+			r++;
+		}
+		if(!*r || *r == '#')
+		{
+			break;
+		}
+		if((size_t) argc + 2 > *nalloc)
+		{
+			*nalloc = *nalloc ? *nalloc * 2 : 16;
+			*words = (char **) xrealloc(*words, *nalloc * sizeof(char *));
+		}
+		(*words)[argc++] = w = r;
+		quote = 0;
+		while(*r && (quote || (*r != ' ' && *r != '\t')))
+		{
+			if(*r == quote)
+			{
+				quote = 0;
+			}
+			else if(!quote && (*r == '\'' || *r == '"'))
+			{
+				quote = *r;
+			}
+			else if(*r == '\\' && quote != '\'' && r[1])
+			{
+				*w++ = *++r;
+			}
+			else
+			{
+				*w++ = *r;
+			}
+			r++;
+		}
+		if(quote)
+		{
+			return -1;
+		}
+		if(*r)
+		{
+			r++;
+		}
+		*w = 0;
+	}
+	if(!*nalloc)
+	{
+		*nalloc = 1;
+		*words = (char **) xalloc(sizeof(char *));
+	}
+	(*words)[argc] = NULL;
+	return argc;
+}
+
+/* Run each line of a script against a single, shared, repository */
+static int
+run_script(const char *progname, const char *scriptpath, const char *path)
+{
+	struct script_struct script;
+	const struct command_struct *cmd;
+	char **words;
+	size_t n, nalloc;
+	REPO *repo;
+	int argc, r;
+
+	memset(&script, 0, sizeof(script));
+	if(read_script(progname, scriptpath, &script))
+	{
+		return EXIT_FAILURE;
+	}
+	repo = repo_open(progname, path, SQLITE_OPEN_READONLY, 0);
+	if(!repo)
+	{
+		return EXIT_FAILURE;
+	}
+	repo_share(repo);
+	words = NULL;
+	nalloc = 0;
+	r = 0;
+	for(n = 0; !r && n < script.nlines; n++)
+	{
+		argc = split_line(script.lines[n], &words, &nalloc);
+		if(argc < 0)
+		{
+			fprintf(stderr, "%s: %s:%lu: unterminated quote\n", progname, scriptpath, (unsigned long) n + 1);
+			r = EXIT_FAILURE;
+			break;
+		}
+		if(!argc)
+		{
+			continue;
+		}
+		cmd = find_command(words[0]);
+		if(!cmd)
+		{
+			fprintf(stderr, "%s: %s:%lu: unknown command '%s'\n", progname, scriptpath, (unsigned long) n + 1, words[0]);
+			r = EXIT_FAILURE;
+			break;
+		}
+		r = run_command(cmd, argc, words);
+	}
+	repo_share(NULL);
+	repo_close(repo);
+	for(n = 0; n < script.nlines; n++)
+	{
+		free(script.lines[n]);
+	}
+	free(script.lines);
+	free(words);
+	return r;
+}
+
+static void
+usage(const char *progname)
+{
+	const struct command_struct *cmd;
+
+	fprintf(stderr, "Usage: %s COMMAND [ARGS...]\n"
+			"       %s [OPTIONS] [PATH-TO-REPO]\n"
+			"Honours GIT_DIR if set. OPTIONS is one or more of:\n", progname, progname);
+	fprintf(stderr,
+			"  -h, --help          Print this usage message and exit\n"
+			"  -s, --script=FILE   Run each line of FILE (or standard input, if FILE is\n"
+			"                      '-') as a command, in a single process which opens\n"
+			"                      the repository only once, stopping at the first\n"
+			"                      command which fails; each line consists of a\n"
+			"                      command and its arguments, which may be quoted\n"
+			"                      as in the shell, and '#' begins a comment\n"
+			"If invoked by (or via a link with) the name of a command, that command is\n"
+			"run. The commands are:\n");
+	for(cmd = commands; cmd->name; cmd++)
+	{
+		fprintf(stderr, "  %s\n", cmd->name);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "script", required_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const struct command_struct *cmd;
+	const char *name, *script, *path;
+	int c, r;
+
+	name = strrchr(argv[0], '/');
+	name = name ? name + 1 : argv[0];
+	/* libgit2 is initialised once for the whole process, so that the tools
+	 * which initialise and shut it down themselves (to use it from several
+	 * threads) never shut it down while the shared repository is open
+	 */
+	git_libgit2_init();
+	cmd = find_command(name);
+	if(cmd)
+	{
+		r = run_command(cmd, argc, argv);
+		git_libgit2_shutdown();
+		return r;
+	}
+	if(argc > 1 && argv[1][0] != '-')
+	{
+		cmd = find_command(argv[1]);
+		if(!cmd)
+		{
+			fprintf(stderr, "%s: unknown command '%s'\n", name, argv[1]);
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		r = run_command(cmd, argc - 1, argv + 1);
+		git_libgit2_shutdown();
+		return r;
+	}
+	script = NULL;
+	while((c = getopt_long(argc, argv, "hs:", longopts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 's':
+			script = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	path = NULL;
+	if(argc - optind == 1)
+	{
+		path = argv[optind];
+	}
+	if(!script || argc - optind > 1)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	r = run_script(name, script, path);
+	git_libgit2_shutdown();
+	return r;
+}
@@ -0,0 +1,18 @@
+#ifndef MULTICALL_H_
+# define MULTICALL_H_                   1
+
+/* The entry point of each of the tools. Each tool's own main() (which is
+ * left out when it's compiled with MULTICALL defined, to be linked into the
+ * multi-call binary instead) simply calls it.
+ */
+
+int listbranch_main(int argc, char **argv);
+int listtag_main(int argc, char **argv);
+int getall_main(int argc, char **argv);
+int branchfor_main(int argc, char **argv);
+int debian_changelog_main(int argc, char **argv);
+int track_releases_main(int argc, char **argv);
+int update_generations_main(int argc, char **argv);
+int ref_changes_main(int argc, char **argv);
+
+#endif /*!MULTICALL_H_*/
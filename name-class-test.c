@@ -0,0 +1,421 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+/* Checks each implementation of name_class_span() against a plain loop over
+ * the class's predicate (make check), and times them over a large set of
+ * reference names (make bench).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "name-class.h"
+
+#define OPT_BENCH                       256
+
+/* The longest string checked, and the alignments it's checked at */
+#define CHECK_LEN_MAX                   64
+#define CHECK_ALIGN_MAX                 31
+
+/* The number of names timed by default, and the least time (in seconds)
+ * spent timing each implementation
+ */
+#define BENCH_NAMES                     1000000
+#define BENCH_SECONDS                   0.5
+
+struct class_struct
+{
+	const char *name;
+	int (*pred)(int c);
+	/* Whether the set can be expressed with nibble tables, and so whether
+	 * each of the vector implementations is expected to be available
+	 */
+	int vector;
+};
+
+/* The characters of a release branch's name, as in check_release_branch() */
+static int
+is_branch_char(int c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_';
+}
+
+/* The characters of the remainder of a release tag's version, as in
+ * tag-pattern.c
+ */
+static int
+is_version(int c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c == '~' || c == '@';
+}
+
+static int
+is_digit(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* Every byte, including those with the top bit set */
+static int
+is_any(int c)
+{
+	(void) c;
+
+	return 1;
+}
+
+/* Only bytes with the top bit set */
+static int
+is_high(int c)
+{
+	return c >= 0x80;
+}
+
+/* A set whose bytes, grouped by high nibble, form more than eight distinct
+ * sets of low nibbles, and so must be classified one byte at a time
+ */
+static int
+is_scattered(int c)
+{
+	return ((c >> 4) + 1) & (c & 0x0f);
+}
+
+static const struct class_struct classes[] = {
+	{ "branch", is_branch_char, 1 },
+	{ "version", is_version, 1 },
+	{ "digit", is_digit, 1 },
+	{ "any", is_any, 1 },
+	{ "high", is_high, 1 },
+	{ "scattered", is_scattered, 0 },
+	{ NULL, NULL, 0 }
+};
+
+static const char *const impl_names[] = { "scalar", "ssse3", "avx2" };
+
+#define IMPL_COUNT                      3
+
+/* The span of a string according to the predicate alone */
+static size_t
+expected_span(int (*pred)(int c), const unsigned char *s)
+{
+	size_t n;
+
+	for(n = 0; s[n] && pred(s[n]); n++);
+	return n;
+}
+
+/* Check one implementation for one class: a run of members of every length
+ * up to CHECK_LEN_MAX, at every alignment up to CHECK_ALIGN_MAX, followed by
+ * every byte value, followed in turn by a NUL and then more members (which
+ * the vector paths will read, and must ignore); then a run of members which
+ * ends at the end of a page followed by one which can't be read
+ */
+static int
+check_class(const char *progname, const struct class_struct *class, const NAME_CLASS *cls, int impl, unsigned char *pages, size_t pagesize)
+{
+	unsigned char members[256], *s;
+	size_t nmembers, len, align, c, want, got;
+	int v, failures;
+
+	nmembers = 0;
+	for(v = 1; v < 256; v++)
+	{
+		if(class->pred(v))
+		{
+			members[nmembers++] = (unsigned char) v;
+		}
+	}
+	failures = 0;
+	for(align = 0; align <= CHECK_ALIGN_MAX; align++)
+	{
+		s = pages + 64 + align;
+		for(len = 0; len <= CHECK_LEN_MAX; len++)
+		{
+			for(v = 0; v < 256; v++)
+			{
+				/* Vary which members are used from one string to the next */
+				for(c = 0; c < len; c++)
+				{
+					s[c] = members[(c * 7 + len + align) % nmembers];
+				}
+				s[len] = (unsigned char) v;
+				s[len + 1] = 0;
+				for(c = len + 2; c < len + 2 + 64; c++)
+				{
+					s[c] = members[c % nmembers];
+				}
+				want = expected_span(class->pred, s);
+				got = name_class_span(cls, (const char *) s);
+				if(got != want && failures++ < 10)
+				{
+					fprintf(stderr, "%s: %s, %s: length %lu, alignment %lu, byte 0x%02x: span %lu, expected %lu\n", progname, impl_names[impl], class->name, (unsigned long) len, (unsigned long) align, v, (unsigned long) got, (unsigned long) want);
+				}
+			}
+		}
+	}
+	/* The page which follows this one can't be read, so reading beyond it
+	 * would fault
+	 */
+	for(len = 0; len <= CHECK_LEN_MAX; len++)
+	{
+		s = pages + pagesize - len - 1;
+		for(c = 0; c < len; c++)
+		{
+			s[c] = members[(c * 7 + len) % nmembers];
+		}
+		s[len] = 0;
+		got = name_class_span(cls, (const char *) s);
+		if(got != len && failures++ < 10)
+		{
+			fprintf(stderr, "%s: %s, %s: length %lu at the end of a page: span %lu\n", progname, impl_names[impl], class->name, (unsigned long) len, (unsigned long) got);
+		}
+	}
+	return failures;
+}
+
+/* Check every implementation the processor supports, for every class */
+static int
+check(const char *progname)
+{
+	const struct class_struct *class;
+	NAME_CLASS cls;
+	unsigned char *pages;
+	size_t pagesize;
+	int impl, failures, n;
+
+	pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	pages = (unsigned char *) mmap(NULL, pagesize * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(pages == MAP_FAILED || mprotect(pages + pagesize, pagesize, PROT_NONE))
+	{
+		perror(progname);
+		return -1;
+	}
+	failures = 0;
+	for(impl = 0; impl < IMPL_COUNT; impl++)
+	{
+		for(class = classes; class->name; class++)
+		{
+			name_class_init(&cls, class->pred);
+			if(cls.vector != class->vector)
+			{
+				fprintf(stderr, "%s: %s: %s be expressed with nibble tables\n", progname, class->name, class->vector ? "can't" : "shouldn't");
+				failures++;
+				continue;
+			}
+			if(name_class_use(&cls, impl))
+			{
+				/* Sets which can't be expressed with the tables are only ever
+				 * classified one byte at a time
+				 */
+				if(class->vector)
+				{
+					printf("%s: not supported by this processor\n", impl_names[impl]);
+					break;
+				}
+				continue;
+			}
+			if(!class->vector && impl != NAME_CLASS_SCALAR)
+			{
+				fprintf(stderr, "%s: %s: used for %s\n", progname, impl_names[impl], class->name);
+				failures++;
+				continue;
+			}
+			n = check_class(progname, class, &cls, impl, pages, pagesize);
+			printf("%s: %s: %s\n", impl_names[impl], class->name, n ? "FAILED" : "ok");
+			failures += n;
+		}
+	}
+	munmap(pages, pagesize * 2);
+	return failures;
+}
+
+/* Append a random string of characters drawn from a set to a buffer */
+static char *
+random_name(char *p, const char *chars, size_t minlen, size_t maxlen)
+{
+	size_t len, nchars, c;
+
+	nchars = strlen(chars);
+	len = minlen + (size_t) rand() % (maxlen - minlen + 1);
+	for(c = 0; c < len; c++)
+	{
+		*p++ = chars[(size_t) rand() % nchars];
+	}
+	return p;
+}
+
+/* Build a set of names like those which are classified in practice: release
+ * branches' names (which check_release_branch() spans whole) and the
+ * versions which follow a release tag's prefix (which the tag pattern spans
+ * from the first digit), along with the longer names of topic branches
+ */
+static char *
+bench_names(size_t count, char ***names)
+{
+	static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	char *buf, *p;
+	size_t n;
+
+	buf = (char *) malloc(count * 80);
+	*names = (char **) malloc(count * sizeof(char *));
+	if(!buf || !*names)
+	{
+		fprintf(stderr, "failed to allocate the names\n");
+		abort();
+	}
+	srand(1);
+	p = buf;
+	for(n = 0; n < count; n++)
+	{
+		(*names)[n] = p;
+		switch(n % 4)
+		{
+		case 0:
+			p += sprintf(p, "release-%d-%d", rand() % 20, rand() % 100);
+			break;
+		case 1:
+			p += sprintf(p, "%d.%d.%d", rand() % 20, rand() % 100, rand() % 1000);
+			if(rand() % 4 == 0)
+			{
+				p += sprintf(p, "-rc%d", rand() % 10);
+			}
+			break;
+		case 2:
+			p = random_name(p, "abcdefghijklmnopqrstuvwxyz-_", 16, 60);
+			break;
+		default:
+			p = random_name(p, alnum, 4, 24);
+		}
+		*p++ = 0;
+	}
+	return buf;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time each implementation over a set of names, using the version class
+ * (the larger of the two used in practice)
+ */
+static int
+bench(size_t count)
+{
+	NAME_CLASS cls;
+	char *buf, **names;
+	size_t n, bytes, passes, total;
+	double start, elapsed;
+	int impl;
+
+	buf = bench_names(count, &names);
+	bytes = 0;
+	for(n = 0; n < count; n++)
+	{
+		bytes += strlen(names[n]);
+	}
+	printf("%lu names, %.1f bytes each on average\n", (unsigned long) count, (double) bytes / count);
+	name_class_init(&cls, is_version);
+	for(impl = 0; impl < IMPL_COUNT; impl++)
+	{
+		if(name_class_use(&cls, impl))
+		{
+			printf("%-8s not supported by this processor\n", impl_names[impl]);
+			continue;
+		}
+		total = 0;
+		passes = 0;
+		start = now();
+		do
+		{
+			for(n = 0; n < count; n++)
+			{
+				total += name_class_span(&cls, names[n]);
+			}
+			passes++;
+			elapsed = now() - start;
+		}
+		while(elapsed < BENCH_SECONDS);
+		/* The total is checked so that the spans can't be optimised away */
+		if(total != bytes * passes)
+		{
+			fprintf(stderr, "%s: spanned %lu bytes, expected %lu\n", impl_names[impl], (unsigned long) total, (unsigned long) (bytes * passes));
+			return -1;
+		}
+		printf("%-8s %7.2f ns/name %8.1f MB/s\n", impl_names[impl], elapsed * 1e9 / (count * passes), bytes * passes / elapsed / 1e6);
+	}
+	free(names);
+	free(buf);
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS]\n", progname);
+	fprintf(stderr,
+			"Checks each implementation of name_class_span() supported by this\n"
+			"processor against the predicate it was built from. OPTIONS is one or\n"
+			"more of:\n"
+			"  -h, --help           Print this usage message and exit\n"
+			"  --bench[=COUNT]      Instead, time each implementation over COUNT\n"
+			"                       generated names (by default, %d)\n", BENCH_NAMES);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "bench", optional_argument, NULL, OPT_BENCH },
+		{ NULL, 0, NULL, 0 }
+	};
+	size_t count;
+	int c;
+
+	count = 0;
+	while((c = getopt_long(argc, argv, "h", longopts, NULL)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case OPT_BENCH:
+			count = optarg ? strtoul(optarg, NULL, 10) : BENCH_NAMES;
+			if(!count)
+			{
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(argc != optind)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(count)
+	{
+		return bench(count) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if(check(argv[0]))
+	{
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
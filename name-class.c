@@ -0,0 +1,194 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define NAME_CLASS_X86                 1
+# include <immintrin.h>
+#endif
+
+#include "name-class.h"
+
+/* Classify one byte at a time */
+static size_t
+span_scalar(const NAME_CLASS *cls, const unsigned char *s)
+{
+	const unsigned char *p;
+
+	for(p = s; cls->member[*p]; p++);
+	return p - s;
+}
+
+#ifdef NAME_CLASS_X86
+
+/* Classify sixteen bytes at a time; the first block is aligned down to a
+ * sixteen-byte boundary, and the bytes before the start of the string are
+ * ignored
+ */
+static size_t __attribute__((target("ssse3")))
+span_ssse3(const NAME_CLASS *cls, const unsigned char *s)
+{
+	const unsigned char *p;
+	__m128i lo, hi, nibble, zero, v, m;
+	unsigned int bad;
+
+	lo = _mm_loadu_si128((const __m128i *) cls->lo);
+	hi = _mm_loadu_si128((const __m128i *) cls->hi);
+	nibble = _mm_set1_epi8(0x0f);
+	zero = _mm_setzero_si128();
+	p = (const unsigned char *) ((uintptr_t) s & ~(uintptr_t) 15);
+	bad = ~0U << (s - p);
+	for(;;)
+	{
+		v = _mm_load_si128((const __m128i *) p);
+		m = _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)), _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+		bad &= (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(m, zero));
+		if(bad)
+		{
+			return (p + __builtin_ctz(bad)) - s;
+		}
+		p += 16;
+		bad = ~0U;
+	}
+}
+
+/* Classify thirty-two bytes at a time, as span_ssse3() does (PSHUFB works
+ * within each half of the register, so each half has its own copy of the
+ * tables)
+ */
+static size_t __attribute__((target("avx2")))
+span_avx2(const NAME_CLASS *cls, const unsigned char *s)
+{
+	const unsigned char *p;
+	__m256i lo, hi, nibble, zero, v, m;
+	unsigned int bad;
+
+	lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) cls->lo));
+	hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) cls->hi));
+	nibble = _mm256_set1_epi8(0x0f);
+	zero = _mm256_setzero_si256();
+	p = (const unsigned char *) ((uintptr_t) s & ~(uintptr_t) 31);
+	bad = ~0U << (s - p);
+	for(;;)
+	{
+		v = _mm256_load_si256((const __m256i *) p);
+		m = _mm256_and_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)), _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+		bad &= (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(m, zero));
+		if(bad)
+		{
+			return (p + __builtin_ctz(bad)) - s;
+		}
+		p += 32;
+		bad = ~0U;
+	}
+}
+
+#endif /*NAME_CLASS_X86*/
+
+/* Build the nibble tables for a set, returning nonzero if it can't be
+ * expressed with them: each distinct set of low nibbles (among the high
+ * nibbles which have any members) is given a bit of its own
+ */
+static int
+build_tables(NAME_CLASS *cls)
+{
+	unsigned int sets[16], set;
+	size_t nsets, n;
+	int h, l;
+
+	memset(cls->lo, 0, sizeof(cls->lo));
+	memset(cls->hi, 0, sizeof(cls->hi));
+	nsets = 0;
+	for(h = 0; h < 16; h++)
+	{
+		set = 0;
+		for(l = 0; l < 16; l++)
+		{
+			if(cls->member[(h << 4) | l])
+			{
+				set |= 1U << l;
+			}
+		}
+		if(!set)
+		{
+			continue;
+		}
+		for(n = 0; n < nsets && sets[n] != set; n++);
+		if(n == nsets)
+		{
+			if(nsets == 8)
+			{
+				return -1;
+			}
+			sets[nsets++] = set;
+		}
+		cls->hi[h] |= (unsigned char) (1U << n);
+		for(l = 0; l < 16; l++)
+		{
+			if(set & (1U << l))
+			{
+				cls->lo[l] |= (unsigned char) (1U << n);
+			}
+		}
+	}
+	return 0;
+}
+
+/* Initialise a class with the set of bytes for which a predicate is true */
+void
+name_class_init(NAME_CLASS *cls, int (*pred)(int c))
+{
+	int c;
+
+	for(c = 0; c < 256; c++)
+	{
+		cls->member[c] = c && pred(c);
+	}
+	cls->vector = !build_tables(cls);
+	cls->span = span_scalar;
+	if(name_class_use(cls, NAME_CLASS_AVX2))
+	{
+		name_class_use(cls, NAME_CLASS_SSSE3);
+	}
+}
+
+/* Make a class use a particular implementation, if it can */
+int
+name_class_use(NAME_CLASS *cls, int impl)
+{
+	if(impl == NAME_CLASS_SCALAR)
+	{
+		cls->span = span_scalar;
+		return 0;
+	}
+#ifdef NAME_CLASS_X86
+	if(!cls->vector)
+	{
+		return -1;
+	}
+	__builtin_cpu_init();
+	if(impl == NAME_CLASS_AVX2 && __builtin_cpu_supports("avx2"))
+	{
+		cls->span = span_avx2;
+		return 0;
+	}
+	if(impl == NAME_CLASS_SSSE3 && __builtin_cpu_supports("ssse3"))
+	{
+		cls->span = span_ssse3;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/* Return the number of bytes at the start of a string which are members of
+ * a class
+ */
+size_t
+name_class_span(const NAME_CLASS *cls, const char *s)
+{
+	return cls->span(cls, (const unsigned char *) s);
+}
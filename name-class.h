@@ -0,0 +1,57 @@
+#ifndef NAME_CLASS_H_
+# define NAME_CLASS_H_                  1
+
+# include <stddef.h>
+
+/* A name class is a set of bytes which may appear in some kind of name (a
+ * release branch's name, or the remainder of a release tag's version), used
+ * to find how many of the bytes at the start of a string belong to the set.
+ *
+ * Where the processor supports it, sixteen (SSSE3) or thirty-two (AVX2)
+ * bytes are classified at once: each byte's low and high nibbles index two
+ * tables with PSHUFB, and the byte belongs to the set if the two entries
+ * have a bit in common. This works for any set whose bytes, grouped by high
+ * nibble, form no more than eight distinct sets of low nibbles, which is
+ * true of any set made up of a few ranges of ASCII characters; other sets
+ * (and other processors) use a lookup table one byte at a time. The choice
+ * is made when the class is initialised, and can be overridden (to test or
+ * time a particular implementation) with name_class_use().
+ *
+ * The vector paths read whole aligned blocks, and so may read beyond the
+ * terminating NUL, but never beyond the end of the page which contains it.
+ */
+
+typedef struct name_class_struct NAME_CLASS;
+
+/* The implementations, for name_class_use() */
+# define NAME_CLASS_SCALAR              0
+# define NAME_CLASS_SSSE3               1
+# define NAME_CLASS_AVX2                2
+
+struct name_class_struct
+{
+	/* Whether each byte is a member of the set (NUL never is) */
+	unsigned char member[256];
+	/* The nibble tables used by the vector paths, and whether the set could
+	 * be expressed with them
+	 */
+	unsigned char lo[16];
+	unsigned char hi[16];
+	int vector;
+	/* The implementation chosen for this processor and set */
+	size_t (*span)(const NAME_CLASS *cls, const unsigned char *s);
+};
+
+/* Initialise a class with the set of bytes for which a predicate is true */
+void name_class_init(NAME_CLASS *cls, int (*pred)(int c));
+/* Make a class use a particular implementation; returns nonzero (leaving the
+ * class unchanged) if the processor doesn't support it, or the set can't be
+ * expressed with nibble tables
+ */
+int name_class_use(NAME_CLASS *cls, int impl);
+/* Return the number of bytes at the start of a string which are members of
+ * a class
+ */
+size_t name_class_span(const NAME_CLASS *cls, const char *s);
+
+#endif /*!NAME_CLASS_H_*/
@@ -0,0 +1,328 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "oid-index.h"
+
+/* Version 2 pack indexes begin with a signature and version number, followed
+ * by the fanout table and then the sorted object names; earlier versions
+ * interleave names with offsets, and aren't used (abbreviations which can
+ * only be found in them are resolved by libgit2 instead)
+ */
+#define IDX_SIGNATURE                   "\377tOc"
+#define IDX_VERSION                     2
+#define IDX_HEADER_SIZE                 (8 + 256 * 4)
+
+/* The minimum length of an abbreviation */
+#define OID_MINHEXSZ                    4
+
+struct oid_pack_struct
+{
+	const unsigned char *base;
+	size_t size;
+	const unsigned char *fanout;
+	const unsigned char *names;
+	uint32_t count;
+};
+
+struct oid_index_struct
+{
+	struct oid_pack_struct *packs;
+	size_t npacks;
+	/* Loose objects, sorted */
+	git_oid *loose;
+	size_t nloose;
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static int
+hexval(int c)
+{
+	if(c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if(c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	if(c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static int
+oid_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp((const git_oid *) a, (const git_oid *) b);
+}
+
+/* Map a version 2 pack index, returning nonzero if it isn't one */
+static int
+map_pack(const char *path, struct oid_pack_struct *pack)
+{
+	struct stat sbuf;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	if(fstat(fd, &sbuf) || sbuf.st_size < IDX_HEADER_SIZE)
+	{
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		return -1;
+	}
+	pack->base = (const unsigned char *) base;
+	pack->size = sbuf.st_size;
+	pack->fanout = pack->base + 8;
+	pack->names = pack->base + IDX_HEADER_SIZE;
+	pack->count = get32(pack->fanout + 255 * 4);
+	if(memcmp(pack->base, IDX_SIGNATURE, 4) ||
+	   get32(pack->base + 4) != IDX_VERSION ||
+	   (pack->size - IDX_HEADER_SIZE) / GIT_OID_RAWSZ < pack->count)
+	{
+		munmap(base, sbuf.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Collect the loose objects within one of the object fan-out directories */
+static void
+scan_loose(OID_INDEX *index, const char *dir, int byte, size_t *nalloc)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(dir);
+	if(!d)
+	{
+		return;
+	}
+	while((de = readdir(d)))
+	{
+		if(strlen(de->d_name) != GIT_OID_HEXSZ - 2)
+		{
+			continue;
+		}
+		sprintf(hex, "%02x", byte);
+		memcpy(hex + 2, de->d_name, GIT_OID_HEXSZ - 2);
+		hex[GIT_OID_HEXSZ] = 0;
+		if(index->nloose == *nalloc)
+		{
+			*nalloc = *nalloc ? *nalloc * 2 : 256;
+			index->loose = (git_oid *) xrealloc(index->loose, *nalloc * sizeof(git_oid));
+		}
+		if(!git_oid_fromstr(&(index->loose[index->nloose]), hex))
+		{
+			index->nloose++;
+		}
+	}
+	closedir(d);
+}
+
+/* Build the object ID index for a repository */
+OID_INDEX *
+oid_index_open(git_repository *repo)
+{
+	OID_INDEX *index;
+	struct dirent *de;
+	DIR *d;
+	char *path;
+	size_t len, dirlen, nalloc, packalloc;
+	int c;
+
+	index = (OID_INDEX *) xalloc(sizeof(OID_INDEX));
+	dirlen = strlen(git_repository_path(repo));
+	path = (char *) xalloc(dirlen + 320);
+	strcpy(path, git_repository_path(repo));
+	if(dirlen && path[dirlen - 1] != '/')
+	{
+		path[dirlen++] = '/';
+	}
+	strcpy(path + dirlen, "objects/pack");
+	packalloc = 0;
+	d = opendir(path);
+	while(d && (de = readdir(d)))
+	{
+		len = strlen(de->d_name);
+		if(len < 5 || len > 255 || strcmp(de->d_name + len - 4, ".idx"))
+		{
+			continue;
+		}
+		if(index->npacks == packalloc)
+		{
+			packalloc = packalloc ? packalloc * 2 : 8;
+			index->packs = (struct oid_pack_struct *) xrealloc(index->packs, packalloc * sizeof(struct oid_pack_struct));
+		}
+		sprintf(path + dirlen, "objects/pack/%s", de->d_name);
+		if(!map_pack(path, &(index->packs[index->npacks])))
+		{
+			index->npacks++;
+		}
+	}
+	if(d)
+	{
+		closedir(d);
+	}
+	nalloc = 0;
+	for(c = 0; c < 256; c++)
+	{
+		sprintf(path + dirlen, "objects/%02x", c);
+		scan_loose(index, path, c, &nalloc);
+	}
+	qsort(index->loose, index->nloose, sizeof(git_oid), oid_cmp);
+	free(path);
+	return index;
+}
+
+/* Free an object ID index */
+void
+oid_index_close(OID_INDEX *index)
+{
+	size_t c;
+
+	if(!index)
+	{
+		return;
+	}
+	for(c = 0; c < index->npacks; c++)
+	{
+		munmap((void *) index->packs[c].base, index->packs[c].size);
+	}
+	free(index->packs);
+	free(index->loose);
+	free(index);
+}
+
+/* Compare the first nibbles of an object name with an abbreviation */
+static int
+prefix_cmp(const unsigned char *name, const unsigned char *prefix, size_t nibbles)
+{
+	size_t bytes;
+	int r;
+
+	bytes = nibbles / 2;
+	r = memcmp(name, prefix, bytes);
+	if(r || !(nibbles & 1))
+	{
+		return r;
+	}
+	return (int) (name[bytes] & 0xf0) - (int) prefix[bytes];
+}
+
+/* Find the matches for an abbreviation among a sorted array of names,
+ * recording up to two distinct matches
+ */
+static void
+find_matches(const unsigned char *names, size_t stride, size_t lo, size_t hi, const unsigned char *prefix, size_t nibbles, git_oid *matches, int *nmatches)
+{
+	size_t mid, end;
+	const unsigned char *name;
+
+	end = hi;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if(prefix_cmp(names + mid * stride, prefix, nibbles) < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	for(; lo < end && *nmatches < 2; lo++)
+	{
+		name = names + lo * stride;
+		if(prefix_cmp(name, prefix, nibbles))
+		{
+			break;
+		}
+		if(*nmatches && !memcmp(matches[0].id, name, GIT_OID_RAWSZ))
+		{
+			continue;
+		}
+		git_oid_fromraw(&(matches[(*nmatches)++]), name);
+	}
+}
+
+/* Resolve an abbreviated object ID of len hexadecimal digits, returning 1 if
+ * exactly one object matches, 0 if none do, or -1 if it is ambiguous (or
+ * isn't a valid abbreviation)
+ */
+int
+oid_index_lookup(const OID_INDEX *index, const char *hex, size_t len, git_oid *out)
+{
+	unsigned char prefix[GIT_OID_RAWSZ];
+	const struct oid_pack_struct *pack;
+	git_oid matches[2];
+	size_t c, lo, hi;
+	int v, nmatches;
+
+	if(len < OID_MINHEXSZ || len > GIT_OID_HEXSZ)
+	{
+		return -1;
+	}
+	memset(prefix, 0, sizeof(prefix));
+	for(c = 0; c < len; c++)
+	{
+		v = hexval(hex[c]);
+		if(v < 0)
+		{
+			return -1;
+		}
+		prefix[c / 2] |= (c & 1) ? v : v << 4;
+	}
+	nmatches = 0;
+	for(c = 0; c < index->npacks && nmatches < 2; c++)
+	{
+		pack = &(index->packs[c]);
+		lo = prefix[0] ? get32(pack->fanout + (prefix[0] - 1) * 4) : 0;
+		hi = get32(pack->fanout + prefix[0] * 4);
+		if(hi > pack->count || lo > hi)
+		{
+			continue;
+		}
+		find_matches(pack->names, GIT_OID_RAWSZ, lo, hi, prefix, len, matches, &nmatches);
+	}
+	if(nmatches < 2 && index->nloose)
+	{
+		find_matches(index->loose[0].id, sizeof(git_oid), 0, index->nloose, prefix, len, matches, &nmatches);
+	}
+	if(nmatches != 1)
+	{
+		return nmatches ? -1 : 0;
+	}
+	git_oid_cpy(out, &(matches[0]));
+	return 1;
+}
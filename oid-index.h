@@ -0,0 +1,27 @@
+#ifndef OID_INDEX_H_
+# define OID_INDEX_H_                   1
+
+# include "utils.h"
+
+/* The object ID index resolves abbreviated object IDs without going through
+ * libgit2's object database for each one. The pack index (.idx) files are
+ * mapped, and a lookup uses each pack's fanout table to narrow the search to
+ * the objects sharing the abbreviation's first byte before searching their
+ * sorted names; loose objects are collected into a sorted table when the
+ * index is opened. Abbreviations are checked against every pack, so that
+ * ambiguous ones are detected.
+ */
+
+typedef struct oid_index_struct OID_INDEX;
+
+/* Build the object ID index for a repository */
+OID_INDEX *oid_index_open(git_repository *repo);
+/* Free an object ID index */
+void oid_index_close(OID_INDEX *index);
+/* Resolve an abbreviated object ID of len hexadecimal digits, returning 1 if
+ * exactly one object matches, 0 if none do, or -1 if it is ambiguous (or
+ * isn't a valid abbreviation)
+ */
+int oid_index_lookup(const OID_INDEX *index, const char *hex, size_t len, git_oid *out);
+
+#endif /*!OID_INDEX_H_*/
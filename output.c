@@ -0,0 +1,345 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "output.h"
+
+#define OUTPUT_BUFSIZE                  65536
+
+struct output_struct
+{
+	int fd;
+	int format;
+	/* Nonzero once a write has failed */
+	int error;
+	/* The number of fields written to the current record */
+	unsigned nfields;
+	size_t len;
+	char buf[OUTPUT_BUFSIZE];
+};
+
+/* Create an output writer for a file descriptor */
+OUTPUT *
+output_open(int fd, int format)
+{
+	OUTPUT *out;
+
+	out = (OUTPUT *) calloc(1, sizeof(OUTPUT));
+	if(!out)
+	{
+		fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) sizeof(OUTPUT));
+		abort();
+	}
+	out->fd = fd;
+	out->format = format;
+	return out;
+}
+
+/* Write out whatever has been buffered */
+int
+output_flush(OUTPUT *out)
+{
+	size_t done;
+	ssize_t r;
+
+	for(done = 0; done < out->len && !out->error; done += r)
+	{
+		r = write(out->fd, out->buf + done, out->len - done);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				r = 0;
+				continue;
+			}
+			out->error = errno;
+			break;
+		}
+	}
+	out->len = 0;
+	return out->error ? -1 : 0;
+}
+
+/* Flush and free an output writer, returning nonzero if anything couldn't be
+ * written
+ */
+int
+output_close(OUTPUT *out)
+{
+	int r;
+
+	if(!out)
+	{
+		return 0;
+	}
+	r = output_flush(out);
+	free(out);
+	return r;
+}
+
+/* Obtain the format of an output writer */
+int
+output_format(const OUTPUT *out)
+{
+	return out->format;
+}
+
+/* Write raw bytes */
+void
+output_write(OUTPUT *out, const void *buf, size_t len)
+{
+	const char *p;
+	size_t n;
+
+	p = (const char *) buf;
+	while(len)
+	{
+		if(out->len == OUTPUT_BUFSIZE)
+		{
+			output_flush(out);
+		}
+		n = OUTPUT_BUFSIZE - out->len;
+		if(n > len)
+		{
+			n = len;
+		}
+		memcpy(out->buf + out->len, p, n);
+		out->len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Write a string */
+void
+output_puts(OUTPUT *out, const char *str)
+{
+	output_write(out, str, strlen(str));
+}
+
+/* Write a single character */
+void
+output_putc(OUTPUT *out, int c)
+{
+	if(out->len == OUTPUT_BUFSIZE)
+	{
+		output_flush(out);
+	}
+	out->buf[out->len++] = (char) c;
+}
+
+/* Write formatted text */
+void
+output_printf(OUTPUT *out, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(out->buf + out->len, OUTPUT_BUFSIZE - out->len, fmt, ap);
+	va_end(ap);
+	if(n < 0)
+	{
+		return;
+	}
+	if((size_t) n < OUTPUT_BUFSIZE - out->len)
+	{
+		out->len += n;
+		return;
+	}
+	/* It didn't fit in what was left of the buffer */
+	output_flush(out);
+	if((size_t) n < OUTPUT_BUFSIZE)
+	{
+		va_start(ap, fmt);
+		vsnprintf(out->buf, OUTPUT_BUFSIZE, fmt, ap);
+		va_end(ap);
+		out->len = n;
+		return;
+	}
+	p = (char *) malloc(n + 1);
+	if(!p)
+	{
+		fprintf(stderr, "failed to allocate %lu bytes\n", (unsigned long) n + 1);
+		abort();
+	}
+	va_start(ap, fmt);
+	vsnprintf(p, n + 1, fmt, ap);
+	va_end(ap);
+	output_write(out, p, n);
+	free(p);
+}
+
+/* Write an object ID in hexadecimal */
+void
+output_hex(OUTPUT *out, const git_oid *oid)
+{
+	char buf[GIT_OID_HEXSZ];
+
+	git_oid_fmt(buf, oid);
+	output_write(out, buf, GIT_OID_HEXSZ);
+}
+
+/* Write a string as a JSON string literal */
+void
+output_json_string(OUTPUT *out, const char *str)
+{
+	const char *run;
+
+	output_putc(out, '"');
+	for(run = str; *str; str++)
+	{
+		if(*str != '"' && *str != '\\' && (unsigned char) *str >= 0x20)
+		{
+			continue;
+		}
+		output_write(out, run, str - run);
+		run = str + 1;
+		if(*str == '"' || *str == '\\')
+		{
+			output_putc(out, '\\');
+			output_putc(out, *str);
+		}
+		else
+		{
+			output_printf(out, "\\u%04x", (unsigned char) *str);
+		}
+	}
+	output_write(out, run, str - run);
+	output_putc(out, '"');
+}
+
+/* Begin a record */
+void
+output_begin(OUTPUT *out)
+{
+	out->nfields = 0;
+	if(out->format == OUTPUT_JSON)
+	{
+		output_putc(out, '{');
+	}
+}
+
+/* End a record */
+void
+output_end(OUTPUT *out)
+{
+	switch(out->format)
+	{
+	case OUTPUT_TEXT:
+		output_putc(out, '\n');
+		break;
+	case OUTPUT_NUL:
+		output_putc(out, 0);
+		break;
+	case OUTPUT_JSON:
+		output_write(out, "}\n", 2);
+		break;
+	}
+}
+
+/* Separate a field from the one preceding it */
+static void
+field_begin(OUTPUT *out, const char *key)
+{
+	if(out->format == OUTPUT_JSON)
+	{
+		if(out->nfields)
+		{
+			output_putc(out, ',');
+		}
+		output_json_string(out, key);
+		output_putc(out, ':');
+	}
+	else if(out->format != OUTPUT_BINARY && out->nfields)
+	{
+		output_putc(out, '\t');
+	}
+	out->nfields++;
+}
+
+/* Write an object ID field */
+void
+output_oid(OUTPUT *out, const char *key, const git_oid *oid)
+{
+	field_begin(out, key);
+	switch(out->format)
+	{
+	case OUTPUT_BINARY:
+		output_write(out, oid->id, GIT_OID_RAWSZ);
+		break;
+	case OUTPUT_JSON:
+		output_putc(out, '"');
+		output_hex(out, oid);
+		output_putc(out, '"');
+		break;
+	default:
+		output_hex(out, oid);
+	}
+}
+
+/* Write a string field */
+void
+output_string(OUTPUT *out, const char *key, const char *str)
+{
+	unsigned char len[4];
+	size_t n;
+
+	field_begin(out, key);
+	switch(out->format)
+	{
+	case OUTPUT_BINARY:
+		n = strlen(str);
+		len[0] = (n >> 24) & 0xff;
+		len[1] = (n >> 16) & 0xff;
+		len[2] = (n >> 8) & 0xff;
+		len[3] = n & 0xff;
+		output_write(out, len, sizeof(len));
+		output_write(out, str, n);
+		break;
+	case OUTPUT_JSON:
+		output_json_string(out, str);
+		break;
+	default:
+		output_puts(out, str);
+	}
+}
+
+/* Write a label field, which is left out of binary records */
+void
+output_label(OUTPUT *out, const char *key, const char *str)
+{
+	if(out->format != OUTPUT_BINARY)
+	{
+		output_string(out, key, str);
+	}
+}
+
+/* Write an unsigned number field */
+void
+output_number(OUTPUT *out, const char *key, uint64_t n)
+{
+	unsigned char buf[8];
+	int c;
+
+	field_begin(out, key);
+	if(out->format == OUTPUT_BINARY)
+	{
+		for(c = 7; c >= 0; c--)
+		{
+			buf[c] = n & 0xff;
+			n >>= 8;
+		}
+		output_write(out, buf, sizeof(buf));
+		return;
+	}
+	output_printf(out, "%llu", (unsigned long long) n);
+}
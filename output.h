@@ -0,0 +1,68 @@
+#ifndef OUTPUT_H_
+# define OUTPUT_H_                      1
+
+# include <stdint.h>
+
+# include <git2.h>
+
+/* The output writer buffers everything written to a file descriptor and
+ * writes it out in large blocks, rather than one line at a time through
+ * stdio, and formats records in whichever machine-readable form was asked
+ * for:
+ *
+ *   OUTPUT_TEXT    Fields separated by tabs, each record ending with a newline
+ *   OUTPUT_NUL     Fields separated by tabs, each record ending with a NUL
+ *   OUTPUT_JSON    One JSON object per line (JSON Lines)
+ *   OUTPUT_BINARY  Each object ID as 20 raw bytes, each string as a
+ *                  32-bit big-endian length followed by that many bytes,
+ *                  and each number as 64 bits, big-endian; nothing
+ *                  separates fields or records
+ *
+ * A record is written with output_begin(), a call for each field, and
+ * output_end(). Labels are descriptive strings (such as the type of a
+ * branch) which can be derived from the other fields, and are left out of
+ * binary records.
+ */
+
+# define OUTPUT_TEXT                    0
+# define OUTPUT_NUL                     1
+# define OUTPUT_JSON                    2
+# define OUTPUT_BINARY                  3
+
+typedef struct output_struct OUTPUT;
+
+/* Create an output writer for a file descriptor */
+OUTPUT *output_open(int fd, int format);
+/* Flush and free an output writer, returning nonzero if anything couldn't be
+ * written
+ */
+int output_close(OUTPUT *out);
+/* Write out whatever has been buffered */
+int output_flush(OUTPUT *out);
+/* Obtain the format of an output writer */
+int output_format(const OUTPUT *out);
+
+/* Write raw bytes, a string, a character or formatted text */
+void output_write(OUTPUT *out, const void *buf, size_t len);
+void output_puts(OUTPUT *out, const char *str);
+void output_putc(OUTPUT *out, int c);
+void output_printf(OUTPUT *out, const char *fmt, ...)
+# ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+# endif
+	;
+/* Write an object ID in hexadecimal */
+void output_hex(OUTPUT *out, const git_oid *oid);
+/* Write a string as a JSON string literal */
+void output_json_string(OUTPUT *out, const char *str);
+
+/* Begin and end a record */
+void output_begin(OUTPUT *out);
+void output_end(OUTPUT *out);
+/* Write a field of the current record */
+void output_oid(OUTPUT *out, const char *key, const git_oid *oid);
+void output_string(OUTPUT *out, const char *key, const char *str);
+void output_label(OUTPUT *out, const char *key, const char *str);
+void output_number(OUTPUT *out, const char *key, uint64_t n);
+
+#endif /*!OUTPUT_H_*/
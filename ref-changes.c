@@ -0,0 +1,587 @@
+/* This is a utility which reports how a repository's references have moved
+ * since a given time, using their reflogs, so that questions such as "what
+ * changed on the release branches since yesterday?" don't need full listings
+ * to be taken and compared.
+ *
+ * Each reflog is a file beneath $GIT_DIR/logs, to which a line is appended
+ * whenever the reference is updated:
+ *
+ *   <old-oid> <new-oid> <name> <<email>> <timestamp> <tz>\t<message>\n
+ *
+ * A reflog which hasn't been modified since the given time can't contain
+ * anything newer, so it isn't even opened. Otherwise, it's mapped and the
+ * first entry at or after the given time is found by reading backwards from
+ * the end; for a large reflog, where the changes might be a small part of a
+ * long history, it's found with a binary search over the entries instead,
+ * relying on the entries having been appended in time order. Either way,
+ * only the entries which are reported are parsed.
+ *
+ * For each reference which moved, the object it referred to at the given
+ * time and the one it refers to now are reported, which together give the
+ * range of commits involved (old..new); optionally, the number of commits
+ * added and removed is counted as well. Alternatively, every movement can
+ * be reported.
+ *
+ * References which have been deleted have no reflog, and so can't be
+ * reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "ref-filter.h"
+#include "output.h"
+#include "multicall.h"
+
+#define OPT_JSON                        256
+#define OPT_BINARY                      257
+
+/* Reflogs smaller than this are read backwards from the end, rather than
+ * searched
+ */
+#define SEARCH_MIN                      65536
+
+struct move_struct
+{
+	git_time_t when;
+	git_oid old;
+	git_oid new;
+	char *message;
+};
+
+struct ref_change_struct
+{
+	char *name;
+	struct move_struct *moves;
+	size_t nmoves;
+	size_t nalloc;
+};
+
+struct changes_struct
+{
+	REPO *repo;
+	const REF_FILTER *filter;
+	git_time_t since;
+	/* Whether the movements themselves are needed */
+	int each;
+	struct ref_change_struct *refs;
+	size_t nrefs;
+	size_t nalloc;
+};
+
+/* Find the start of the line containing p */
+static const char *
+line_start(const char *base, const char *p)
+{
+	while(p > base && p[-1] != '\n')
+	{
+		p--;
+	}
+	return p;
+}
+
+/* Obtain the timestamp of the reflog entry beginning at p, or -1 if it's
+ * malformed
+ */
+static git_time_t
+entry_time(const char *p, const char *end)
+{
+	const char *eol, *t;
+	git_time_t when;
+
+	eol = memchr(p, '\n', end - p);
+	if(!eol)
+	{
+		eol = end;
+	}
+	t = memchr(p, '\t', eol - p);
+	if(t)
+	{
+		eol = t;
+	}
+	/* Skip back over the timezone to the timestamp */
+	for(t = eol; t > p && t[-1] != ' '; t--);
+	if(t > p)
+	{
+		t--;
+	}
+	while(t > p && t[-1] != ' ')
+	{
+		t--;
+	}
+	if(t == p || !isdigit((unsigned char) *t))
+	{
+		return -1;
+	}
+	for(when = 0; isdigit((unsigned char) *t); t++)
+	{
+		when = (when * 10) + (*t - '0');
+	}
+	return when;
+}
+
+/* Parse the reflog entry beginning at p, returning the start of the next; the
+ * message is copied into the arena, if one is given
+ */
+static const char *
+parse_entry(const char *p, const char *end, struct move_struct *move, ARENA *arena)
+{
+	const char *eol, *tab;
+	size_t len;
+
+	eol = memchr(p, '\n', end - p);
+	if(!eol)
+	{
+		eol = end;
+	}
+	memset(move, 0, sizeof(struct move_struct));
+	move->when = entry_time(p, end);
+	if(eol - p < (GIT_OID_HEXSZ * 2) + 2 || git_oid_fromstrn(&(move->old), p, GIT_OID_HEXSZ) ||
+	   git_oid_fromstrn(&(move->new), p + GIT_OID_HEXSZ + 1, GIT_OID_HEXSZ))
+	{
+		move->when = -1;
+	}
+	if(arena && move->when != -1)
+	{
+		tab = memchr(p, '\t', eol - p);
+		len = tab ? (size_t) (eol - tab - 1) : 0;
+		move->message = (char *) arena_alloc(arena, len + 1);
+		if(len)
+		{
+			memcpy(move->message, tab + 1, len);
+		}
+	}
+	return eol < end ? eol + 1 : end;
+}
+
+/* Find the first entry at or after a given time */
+static const char *
+find_since(const char *base, const char *end, git_time_t since)
+{
+	const char *lo, *hi, *mid, *p;
+	git_time_t when;
+
+	if(end - base < SEARCH_MIN)
+	{
+		/* Read backwards from the end, until an entry is older */
+		p = end;
+		while(p > base)
+		{
+			mid = line_start(base, p - 1);
+			when = entry_time(mid, end);
+			if(when != -1 && when < since)
+			{
+				break;
+			}
+			p = mid;
+		}
+		return p;
+	}
+	/* Search the entries: lo is always the start of an entry, and everything
+	 * before it is older
+	 */
+	lo = base;
+	hi = end;
+	while(lo < hi)
+	{
+		mid = line_start(lo, lo + (hi - lo) / 2);
+		p = memchr(mid, '\n', end - mid);
+		p = p ? p + 1 : end;
+		when = entry_time(mid, end);
+		if(when != -1 && when < since)
+		{
+			lo = p;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Read the movements of a reference since the given time from its reflog */
+static void
+read_reflog(struct changes_struct *changes, const char *path, const char *name, const struct stat *sbuf)
+{
+	struct ref_change_struct *ref;
+	struct move_struct move;
+	const char *base, *end, *p;
+	int fd;
+
+	if(sbuf->st_mtime < changes->since || !sbuf->st_size)
+	{
+		return;
+	}
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+	{
+		return;
+	}
+	base = (const char *) mmap(NULL, sbuf->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s: failed to map reflog\n", changes->repo->progname, path);
+		return;
+	}
+	end = base + sbuf->st_size;
+	p = find_since(base, end, changes->since);
+	ref = NULL;
+	while(p < end)
+	{
+		p = parse_entry(p, end, &move, changes->each ? changes->repo->arena : NULL);
+		if(move.when == -1)
+		{
+			continue;
+		}
+		if(!ref)
+		{
+			if(changes->nrefs == changes->nalloc)
+			{
+				changes->nalloc = changes->nalloc ? changes->nalloc * 2 : 32;
+				changes->refs = (struct ref_change_struct *) xrealloc(changes->refs, changes->nalloc * sizeof(struct ref_change_struct));
+			}
+			ref = &(changes->refs[changes->nrefs++]);
+			memset(ref, 0, sizeof(struct ref_change_struct));
+			ref->name = arena_strdup(changes->repo->arena, name);
+		}
+		/* Without --each, only the first and last movements are kept */
+		if(!changes->each && ref->nmoves == 2)
+		{
+			ref->moves[1] = move;
+			continue;
+		}
+		if(ref->nmoves == ref->nalloc)
+		{
+			ref->nalloc = ref->nalloc ? ref->nalloc * 2 : (changes->each ? 16 : 2);
+			ref->moves = (struct move_struct *) xrealloc(ref->moves, ref->nalloc * sizeof(struct move_struct));
+		}
+		ref->moves[ref->nmoves++] = move;
+	}
+	munmap((void *) base, sbuf->st_size);
+}
+
+/* Read the reflogs beneath a directory */
+static void
+read_reflogs(struct changes_struct *changes, const char *path, const char *name)
+{
+	struct dirent *de;
+	struct stat sbuf;
+	char *subpath, *subname;
+	DIR *d;
+
+	d = opendir(path);
+	if(!d)
+	{
+		return;
+	}
+	while((de = readdir(d)))
+	{
+		if(de->d_name[0] == '.')
+		{
+			continue;
+		}
+		subpath = (char *) xalloc(strlen(path) + strlen(de->d_name) + 2);
+		sprintf(subpath, "%s/%s", path, de->d_name);
+		subname = (char *) xalloc(strlen(name) + strlen(de->d_name) + 2);
+		sprintf(subname, "%s/%s", name, de->d_name);
+		if(!stat(subpath, &sbuf))
+		{
+			if(S_ISDIR(sbuf.st_mode))
+			{
+				read_reflogs(changes, subpath, subname);
+			}
+			else if(S_ISREG(sbuf.st_mode) && ref_filter_match(changes->filter, subname))
+			{
+				read_reflog(changes, subpath, subname, &sbuf);
+			}
+		}
+		free(subpath);
+		free(subname);
+	}
+	closedir(d);
+}
+
+static int
+ref_change_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct ref_change_struct *) a)->name, ((const struct ref_change_struct *) b)->name);
+}
+
+/* Parse a time: seconds since the epoch prefixed with '@', a number of
+ * seconds, minutes, hours, days or weeks ago, or a UTC date and time
+ */
+static int
+parse_time(const char *str, git_time_t *when)
+{
+	struct tm tm;
+	const char *p;
+	char *unit;
+	long n;
+	int len;
+
+	if(*str == '@')
+	{
+		*when = strtoll(str + 1, &unit, 10);
+		return (unit == str + 1 || *unit) ? -1 : 0;
+	}
+	n = strtol(str, &unit, 10);
+	if(unit != str && unit[0] && !unit[1])
+	{
+		switch(*unit)
+		{
+		case 's':
+			break;
+		case 'm':
+			n *= 60;
+			break;
+		case 'h':
+			n *= 3600;
+			break;
+		case 'd':
+			n *= 86400;
+			break;
+		case 'w':
+			n *= 7 * 86400;
+			break;
+		default:
+			return -1;
+		}
+		*when = time(NULL) - n;
+		return 0;
+	}
+	memset(&tm, 0, sizeof(tm));
+	len = 0;
+	if(sscanf(str, "%4d-%2d-%2d%n", &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday), &len) != 3)
+	{
+		return -1;
+	}
+	p = str + len;
+	if(*p == 'T' || *p == ' ')
+	{
+		len = 0;
+		if(sscanf(p + 1, "%2d:%2d:%2d%n", &(tm.tm_hour), &(tm.tm_min), &(tm.tm_sec), &len) != 3)
+		{
+			return -1;
+		}
+		p += len + 1;
+	}
+	if(*p)
+	{
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	*when = timegm(&tm);
+	return 0;
+}
+
+static void
+write_changes(const struct changes_struct *changes, int count, OUTPUT *out)
+{
+	const struct ref_change_struct *ref;
+	const struct move_struct *first, *last;
+	size_t c, n, added, removed;
+
+	for(c = 0; c < changes->nrefs; c++)
+	{
+		ref = &(changes->refs[c]);
+		if(changes->each)
+		{
+			for(n = 0; n < ref->nmoves; n++)
+			{
+				output_begin(out);
+				output_number(out, "when", (uint64_t) ref->moves[n].when);
+				output_oid(out, "old", &(ref->moves[n].old));
+				output_oid(out, "new", &(ref->moves[n].new));
+				output_string(out, "name", ref->name);
+				output_string(out, "message", ref->moves[n].message);
+				output_end(out);
+			}
+			continue;
+		}
+		first = &(ref->moves[0]);
+		last = &(ref->moves[ref->nmoves - 1]);
+		/* A reference which moved back to where it started hasn't changed */
+		if(!git_oid_cmp(&(first->old), &(last->new)))
+		{
+			continue;
+		}
+		output_begin(out);
+		output_oid(out, "old", &(first->old));
+		output_oid(out, "new", &(last->new));
+		output_string(out, "name", ref->name);
+		if(count)
+		{
+			added = removed = 0;
+			if(!git_oid_iszero(&(first->old)) && !git_oid_iszero(&(last->new)))
+			{
+				git_graph_ahead_behind(&added, &removed, changes->repo->repo, &(last->new), &(first->old));
+			}
+			output_number(out, "added", added);
+			output_number(out, "removed", removed);
+		}
+		output_end(out);
+	}
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] --since=TIME [PATH-TO-REPO]\nHonours GIT_DIR if set.\n"
+			"Lists the references which have moved since TIME, with the object each\n"
+			"referred to then and the one it refers to now (all zeroes if it didn't\n"
+			"exist then).\nOPTIONS is one or more of:\n", progname);
+	fprintf(stderr,
+			"  -h, --help              Print this usage message and exit\n"
+			"  -s, --since=TIME        Report changes made at or after TIME, which is\n"
+			"                          either a number of seconds, minutes, hours,\n"
+			"                          days or weeks ago (such as '1d'), a UTC date\n"
+			"                          and time (YYYY-MM-DD[THH:MM:SS]), or seconds\n"
+			"                          since the epoch prefixed with '@'\n"
+			"  -i, --include=PATTERN   Only report references matching PATTERN (may\n"
+			"                          be given more than once; see listbranch)\n"
+			"  -x, --exclude=PATTERN   Don't report references matching PATTERN\n"
+			"  -c, --count             Also count the commits added to and removed\n"
+			"                          from each reference (left as zero for those\n"
+			"                          which were created since TIME)\n"
+			"  -a, --each              Report each movement instead, with its time,\n"
+			"                          old and new object IDs, reference name and\n"
+			"                          reflog message\n"
+			"  -z                      End each record with NUL rather than a newline\n"
+			"  --json                  Write each record as a JSON object on its own line\n"
+			"  --binary                Write object IDs as 20 bytes, numbers as 64-bit\n"
+			"                          big-endian integers and strings prefixed with\n"
+			"                          their length as 32-bit big-endian numbers\n");
+}
+
+int
+ref_changes_main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "since", required_argument, NULL, 's' },
+		{ "include", required_argument, NULL, 'i' },
+		{ "exclude", required_argument, NULL, 'x' },
+		{ "count", no_argument, NULL, 'c' },
+		{ "each", no_argument, NULL, 'a' },
+		{ "json", no_argument, NULL, OPT_JSON },
+		{ "binary", no_argument, NULL, OPT_BINARY },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *path, *gitdir;
+	REPO *repo;
+	REF_FILTER *filter;
+	OUTPUT *out;
+	struct changes_struct changes;
+	char *logdir;
+	size_t c;
+	int ch, format, count, each, havesince;
+
+	path = NULL;
+	format = OUTPUT_TEXT;
+	count = 0;
+	each = 0;
+	havesince = 0;
+	filter = ref_filter_create();
+	memset(&changes, 0, sizeof(changes));
+	while((ch = getopt_long(argc, argv, "hs:i:x:caz", longopts, NULL)) != -1)
+	{
+		switch(ch)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 's':
+			if(parse_time(optarg, &(changes.since)))
+			{
+				fprintf(stderr, "%s: unrecognised time '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			havesince = 1;
+			break;
+		case 'i':
+			ref_filter_add(filter, optarg, 0);
+			break;
+		case 'x':
+			ref_filter_add(filter, optarg, 1);
+			break;
+		case 'c':
+			count = 1;
+			break;
+		case 'a':
+			each = 1;
+			break;
+		case 'z':
+			format = OUTPUT_NUL;
+			break;
+		case OPT_JSON:
+			format = OUTPUT_JSON;
+			break;
+		case OPT_BINARY:
+			format = OUTPUT_BINARY;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!havesince || argc - optind > 1)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(argc - optind > 0)
+	{
+		path = argv[optind];
+	}
+	repo = repo_open(argv[0], path, SQLITE_OPEN_READONLY, 0);
+	if(!repo)
+	{
+		exit(EXIT_FAILURE);
+	}
+	changes.repo = repo;
+	changes.filter = filter;
+	changes.each = each;
+	gitdir = git_repository_path(repo->repo);
+	logdir = (char *) xalloc(strlen(gitdir) + 16);
+	sprintf(logdir, "%s%slogs/refs", gitdir, (*gitdir && gitdir[strlen(gitdir) - 1] == '/') ? "" : "/");
+	read_reflogs(&changes, logdir, "refs");
+	qsort(changes.refs, changes.nrefs, sizeof(struct ref_change_struct), ref_change_cmp);
+	out = output_open(STDOUT_FILENO, format);
+	write_changes(&changes, count, out);
+	for(c = 0; c < changes.nrefs; c++)
+	{
+		free(changes.refs[c].moves);
+	}
+	free(changes.refs);
+	free(logdir);
+	ref_filter_free(filter);
+	repo_close(repo);
+	if(output_close(out))
+	{
+		fprintf(stderr, "%s: failed to write output\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	return 0;
+}
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return ref_changes_main(argc, argv);
+}
+#endif
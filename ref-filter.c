@@ -0,0 +1,289 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "ref-filter.h"
+#include "utils.h"
+
+struct ref_pattern_struct
+{
+	char *pattern;
+	/* The length of the literal text preceding the first wildcard */
+	size_t prefixlen;
+	/* Whether the pattern contains no wildcards at all */
+	int literal;
+	/* Whether the pattern is matched against the full reference name */
+	int full;
+};
+
+struct ref_filter_struct
+{
+	struct ref_pattern_struct *include;
+	size_t ninclude;
+	struct ref_pattern_struct *exclude;
+	size_t nexclude;
+};
+
+struct ref_namespace_struct
+{
+	const char *prefix;
+	unsigned type;
+};
+
+struct foreach_data_struct
+{
+	const REF_FILTER *filter;
+	git_branch_t type;
+	int (*cb)(const struct ref_view_struct *ref, git_branch_t type, void *data);
+	void *data;
+};
+
+static const struct ref_namespace_struct namespaces[] = {
+	{ "refs/heads/", GIT_BRANCH_LOCAL },
+	{ "refs/remotes/", GIT_BRANCH_REMOTE },
+	{ "refs/tags/", REF_TAG },
+	{ NULL, 0 }
+};
+
+/* Create an empty reference filter, which accepts everything */
+REF_FILTER *
+ref_filter_create(void)
+{
+	return (REF_FILTER *) xalloc(sizeof(REF_FILTER));
+}
+
+/* Free a reference filter */
+void
+ref_filter_free(REF_FILTER *filter)
+{
+	size_t c;
+
+	if(!filter)
+	{
+		return;
+	}
+	for(c = 0; c < filter->ninclude; c++)
+	{
+		free(filter->include[c].pattern);
+	}
+	for(c = 0; c < filter->nexclude; c++)
+	{
+		free(filter->exclude[c].pattern);
+	}
+	free(filter->include);
+	free(filter->exclude);
+	free(filter);
+}
+
+/* Add a pattern to a filter's include or exclude list */
+void
+ref_filter_add(REF_FILTER *filter, const char *pattern, int exclude)
+{
+	struct ref_pattern_struct **list, *p;
+	size_t *count;
+
+	list = exclude ? &(filter->exclude) : &(filter->include);
+	count = exclude ? &(filter->nexclude) : &(filter->ninclude);
+	*list = (struct ref_pattern_struct *) xrealloc(*list, (*count + 1) * sizeof(struct ref_pattern_struct));
+	p = &((*list)[*count]);
+	(*count)++;
+	p->pattern = xstrdup(pattern);
+	p->prefixlen = strcspn(pattern, "*?[\\");
+	p->literal = !pattern[p->prefixlen];
+	p->full = !strncmp(pattern, "refs/", 5);
+}
+
+/* Match a name (full or short, as appropriate) against a single pattern */
+static int
+pattern_match(const struct ref_pattern_struct *p, const char *name, const char *shortname)
+{
+	if(!p->full)
+	{
+		name = shortname;
+	}
+	/* Most names can be rejected on the literal prefix alone */
+	if(strncmp(name, p->pattern, p->prefixlen))
+	{
+		return 0;
+	}
+	if(p->literal)
+	{
+		return !name[p->prefixlen] || name[p->prefixlen] == '/' || (p->prefixlen && p->pattern[p->prefixlen - 1] == '/');
+	}
+	return !fnmatch(p->pattern, name, FNM_PATHNAME);
+}
+
+/* Remove the namespace prefix from a reference name */
+static const char *
+short_name(const char *name)
+{
+	size_t c, len;
+
+	for(c = 0; namespaces[c].prefix; c++)
+	{
+		len = strlen(namespaces[c].prefix);
+		if(!strncmp(name, namespaces[c].prefix, len))
+		{
+			return name + len;
+		}
+	}
+	return name;
+}
+
+/* Determine whether a filter accepts a reference name */
+int
+ref_filter_match(const REF_FILTER *filter, const char *name)
+{
+	const char *shortname;
+	size_t c;
+
+	if(!filter)
+	{
+		return 1;
+	}
+	shortname = short_name(name);
+	for(c = 0; c < filter->nexclude; c++)
+	{
+		if(pattern_match(&(filter->exclude[c]), name, shortname))
+		{
+			return 0;
+		}
+	}
+	if(!filter->ninclude)
+	{
+		return 1;
+	}
+	for(c = 0; c < filter->ninclude; c++)
+	{
+		if(pattern_match(&(filter->include[c]), name, shortname))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+foreach_callback(const struct ref_view_struct *ref, void *payload)
+{
+	struct foreach_data_struct *data;
+
+	data = (struct foreach_data_struct *) payload;
+	if(!ref_filter_match(data->filter, ref->name))
+	{
+		return 0;
+	}
+	return data->cb(ref, data->type, data->data);
+}
+
+/* Build the longest prefix shared by every name within a namespace which the
+ * include patterns can match, so that only that part of the namespace need be
+ * read; returns NULL if none of the patterns can match within it
+ */
+static char *
+namespace_prefix(const REF_FILTER *filter, const char *ns)
+{
+	const struct ref_pattern_struct *p;
+	char *common, *prefix;
+	size_t c, nslen, maxlen, len;
+	int found;
+
+	nslen = strlen(ns);
+	maxlen = 0;
+	for(c = 0; filter && c < filter->ninclude; c++)
+	{
+		if(filter->include[c].prefixlen > maxlen)
+		{
+			maxlen = filter->include[c].prefixlen;
+		}
+	}
+	common = (char *) xalloc(nslen + maxlen + 1);
+	prefix = (char *) xalloc(nslen + maxlen + 1);
+	found = 0;
+	for(c = 0; filter && c < filter->ninclude; c++)
+	{
+		p = &(filter->include[c]);
+		if(!p->full)
+		{
+			strcpy(prefix, ns);
+			memcpy(prefix + nslen, p->pattern, p->prefixlen);
+			prefix[nslen + p->prefixlen] = 0;
+		}
+		else if(p->prefixlen >= nslen && !strncmp(p->pattern, ns, nslen))
+		{
+			memcpy(prefix, p->pattern, p->prefixlen);
+			prefix[p->prefixlen] = 0;
+		}
+		else if(!strncmp(p->pattern, ns, p->prefixlen))
+		{
+			strcpy(prefix, ns);
+		}
+		else
+		{
+			/* The pattern lies outside this namespace */
+			continue;
+		}
+		if(!found)
+		{
+			strcpy(common, prefix);
+			found = 1;
+			continue;
+		}
+		for(len = 0; common[len] && common[len] == prefix[len]; len++);
+		common[len] = 0;
+	}
+	free(prefix);
+	if(!found)
+	{
+		if(filter && filter->ninclude)
+		{
+			free(common);
+			return NULL;
+		}
+		strcpy(common, ns);
+	}
+	return common;
+}
+
+/* Invoke a callback with a view of each branch (of the given types, which
+ * may include REF_TAG) or tag accepted by a filter, which may be NULL; stops
+ * as soon as the callback returns nonzero, returning its result
+ */
+int
+ref_filter_foreach(const REF_FILTER *filter, git_repository *repo, unsigned types, int (*cb)(const struct ref_view_struct *ref, git_branch_t type, void *data), void *data)
+{
+	struct foreach_data_struct fd;
+	REFDB *db;
+	char *prefix;
+	size_t c;
+	int r;
+
+	memset(&fd, 0, sizeof(fd));
+	fd.filter = filter;
+	fd.cb = cb;
+	fd.data = data;
+	db = refdb_open(repo);
+	r = 0;
+	for(c = 0; namespaces[c].prefix && !r; c++)
+	{
+		if(!(types & namespaces[c].type))
+		{
+			continue;
+		}
+		prefix = namespace_prefix(filter, namespaces[c].prefix);
+		if(!prefix)
+		{
+			continue;
+		}
+		fd.type = (git_branch_t) namespaces[c].type;
+		r = refdb_foreach(db, prefix, foreach_callback, &fd);
+		free(prefix);
+	}
+	refdb_close(db);
+	return r;
+}
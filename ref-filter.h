@@ -0,0 +1,45 @@
+#ifndef REF_FILTER_H_
+# define REF_FILTER_H_                  1
+
+# include <git2.h>
+
+# include "refdb.h"
+
+/* A reference filter is a set of include and exclude patterns, compiled once
+ * and then applied to reference names while they are being enumerated, so
+ * that references which don't match are never looked up or resolved.
+ * Enumeration reads only the part of each namespace which the include
+ * patterns can match (see refdb.h).
+ *
+ * A pattern beginning with "refs/" is matched against the full name of a
+ * reference; any other pattern is matched against the name with its
+ * "refs/heads/", "refs/remotes/" or "refs/tags/" prefix removed. A pattern
+ * without wildcards matches a name exactly or any name beneath it (so that
+ * "origin" matches "origin/master"); otherwise, it's matched as with
+ * fnmatch(3), where '*' doesn't match '/'. A reference is accepted if it
+ * matches any of the include patterns (or there aren't any), and none of the
+ * exclude patterns.
+ */
+
+/* The type of a tag reference, alongside GIT_BRANCH_LOCAL and
+ * GIT_BRANCH_REMOTE
+ */
+# define REF_TAG                        4
+
+typedef struct ref_filter_struct REF_FILTER;
+
+/* Create an empty reference filter, which accepts everything */
+REF_FILTER *ref_filter_create(void);
+/* Free a reference filter */
+void ref_filter_free(REF_FILTER *filter);
+/* Add a pattern to a filter's include or exclude list */
+void ref_filter_add(REF_FILTER *filter, const char *pattern, int exclude);
+/* Determine whether a filter accepts a reference name */
+int ref_filter_match(const REF_FILTER *filter, const char *name);
+/* Invoke a callback with a view of each branch (of the given types, which
+ * may include REF_TAG) or tag accepted by a filter, which may be NULL; stops
+ * as soon as the callback returns nonzero, returning its result
+ */
+int ref_filter_foreach(const REF_FILTER *filter, git_repository *repo, unsigned types, int (*cb)(const struct ref_view_struct *ref, git_branch_t type, void *data), void *data);
+
+#endif /*!REF_FILTER_H_*/
@@ -0,0 +1,674 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "refdb.h"
+#include "utils.h"
+
+#define PACKED_REFS                     "packed-refs"
+#define TAGS_PREFIX                     "refs/tags/"
+#define LOOSE_ROOT                      "refs/"
+
+/* The length of the object ID and separating space preceding each packed
+ * reference's name
+ */
+#define RECORD_NAME_OFFSET              (GIT_OID_HEXSZ + 1)
+
+struct packed_entry_struct
+{
+	const char *rec;
+	const char *name;
+	size_t len;
+};
+
+struct refdb_struct
+{
+	git_repository *repo;
+	/* The repository path, with a trailing slash */
+	char *gitdir;
+	/* The mapped packed-refs file, if there is one */
+	const char *base;
+	size_t size;
+	/* The first record, following the header */
+	const char *start;
+	const char *end;
+	/* The header's traits */
+	int peeled;
+	int fully_peeled;
+	/* The records in name order, if the file isn't sorted (otherwise NULL) */
+	struct packed_entry_struct *index;
+	size_t nindex;
+	/* The buffer holding the name of the current packed reference */
+	char *namebuf;
+	size_t namealloc;
+	/* Storage for the current packed reference's peeled object */
+	git_oid peeled_oid;
+};
+
+struct loose_ref_struct
+{
+	/* The reference's name, at offset within the list's names once they
+	 * have all been collected
+	 */
+	const char *name;
+	size_t offset;
+	size_t len;
+	git_oid oid;
+};
+
+struct loose_list_struct
+{
+	struct loose_ref_struct *refs;
+	size_t count;
+	size_t nalloc;
+	/* The references' names, each NUL-terminated, one after another */
+	char *names;
+	size_t nameslen;
+	size_t namesalloc;
+	/* The path being scanned: the repository path followed by the name of
+	 * a reference or directory
+	 */
+	char *path;
+	size_t pathalloc;
+};
+
+/* Compare a name which isn't NUL-terminated with one which is */
+static int
+name_cmp(const char *name, size_t len, const char *other, size_t otherlen)
+{
+	int r;
+
+	r = memcmp(name, other, len < otherlen ? len : otherlen);
+	if(r)
+	{
+		return r;
+	}
+	return len < otherlen ? -1 : (len > otherlen ? 1 : 0);
+}
+
+/* Locate the name of the packed reference whose record begins at rec,
+ * returning NULL if the record is malformed
+ */
+static const char *
+record_name(const char *rec, const char *end, size_t *len)
+{
+	const char *name, *eol;
+
+	if(end - rec <= RECORD_NAME_OFFSET || rec[GIT_OID_HEXSZ] != ' ')
+	{
+		return NULL;
+	}
+	name = rec + RECORD_NAME_OFFSET;
+	eol = (const char *) memchr(name, '\n', end - name);
+	if(!eol)
+	{
+		eol = end;
+	}
+	if(eol > name && eol[-1] == '\r')
+	{
+		eol--;
+	}
+	*len = eol - name;
+	return name;
+}
+
+/* Find the record following the one beginning at p, skipping the "^" lines
+ * which follow it
+ */
+static const char *
+next_record(const char *p, const char *end)
+{
+	do
+	{
+		p = (const char *) memchr(p, '\n', end - p);
+		if(!p)
+		{
+			return end;
+		}
+		p++;
+	}
+	while(p < end && *p == '^');
+	return p;
+}
+
+/* Find the beginning of the record containing p, which lies no earlier than
+ * lo
+ */
+static const char *
+record_start(const char *lo, const char *p)
+{
+	while(p > lo && p[-1] != '\n')
+	{
+		p--;
+	}
+	while(p > lo && *p == '^')
+	{
+		p--;
+		while(p > lo && p[-1] != '\n')
+		{
+			p--;
+		}
+	}
+	return p;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct packed_entry_struct *ea, *eb;
+
+	ea = (const struct packed_entry_struct *) a;
+	eb = (const struct packed_entry_struct *) b;
+	return name_cmp(ea->name, ea->len, eb->name, eb->len);
+}
+
+/* Parse the header of the mapped packed-refs file, and if it doesn't declare
+ * itself sorted, check whether it is anyway, building a sorted index of its
+ * records if it isn't
+ */
+static void
+parse_packed(REFDB *db)
+{
+	char header[256];
+	const char *p, *eol, *name, *prev;
+	size_t len, prevlen, nalloc;
+	int sorted;
+
+	db->end = db->base + db->size;
+	p = db->base;
+	sorted = 0;
+	while(p < db->end && *p == '#')
+	{
+		eol = (const char *) memchr(p, '\n', db->end - p);
+		if(!eol)
+		{
+			eol = db->end;
+		}
+		len = eol - p;
+		if(len >= sizeof(header) - 1)
+		{
+			len = sizeof(header) - 2;
+		}
+		/* "# pack-refs with: peeled fully-peeled sorted " */
+		memcpy(header, p, len);
+		header[len] = ' ';
+		header[len + 1] = 0;
+		if(strstr(header, "with:"))
+		{
+			db->peeled = (strstr(header, " peeled ") != NULL);
+			db->fully_peeled = (strstr(header, " fully-peeled ") != NULL);
+			sorted = (strstr(header, " sorted ") != NULL);
+		}
+		p = eol < db->end ? eol + 1 : eol;
+	}
+	db->start = p;
+	if(sorted)
+	{
+		return;
+	}
+	prev = NULL;
+	prevlen = 0;
+	for(p = db->start; p < db->end; p = next_record(p, db->end))
+	{
+		name = record_name(p, db->end, &len);
+		if(!name || (prev && name_cmp(prev, prevlen, name, len) > 0))
+		{
+			break;
+		}
+		prev = name;
+		prevlen = len;
+	}
+	if(p >= db->end)
+	{
+		return;
+	}
+	nalloc = 0;
+	for(p = db->start; p < db->end; p = next_record(p, db->end))
+	{
+		name = record_name(p, db->end, &len);
+		if(!name)
+		{
+			continue;
+		}
+		if(db->nindex == nalloc)
+		{
+			nalloc = nalloc ? nalloc * 2 : 256;
+			db->index = (struct packed_entry_struct *) xrealloc(db->index, nalloc * sizeof(struct packed_entry_struct));
+		}
+		db->index[db->nindex].rec = p;
+		db->index[db->nindex].name = name;
+		db->index[db->nindex].len = len;
+		db->nindex++;
+	}
+	qsort(db->index, db->nindex, sizeof(struct packed_entry_struct), entry_cmp);
+}
+
+/* Open the reference reader for a repository, mapping its packed-refs file if
+ * it has one
+ */
+REFDB *
+refdb_open(git_repository *repo)
+{
+	REFDB *db;
+	struct stat sbuf;
+	const char *gitdir;
+	char *path;
+	void *base;
+	size_t len;
+	int fd;
+
+	db = (REFDB *) xalloc(sizeof(REFDB));
+	db->repo = repo;
+	gitdir = git_repository_path(repo);
+	len = strlen(gitdir);
+	db->gitdir = (char *) xalloc(len + 2);
+	strcpy(db->gitdir, gitdir);
+	if(len && db->gitdir[len - 1] != '/')
+	{
+		db->gitdir[len] = '/';
+	}
+	path = (char *) xalloc(strlen(db->gitdir) + strlen(PACKED_REFS) + 1);
+	sprintf(path, "%s%s", db->gitdir, PACKED_REFS);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if(fd == -1)
+	{
+		return db;
+	}
+	if(fstat(fd, &sbuf) || !sbuf.st_size)
+	{
+		close(fd);
+		return db;
+	}
+	base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		return db;
+	}
+	db->base = (const char *) base;
+	db->size = sbuf.st_size;
+	parse_packed(db);
+	return db;
+}
+
+/* Close a reference reader */
+void
+refdb_close(REFDB *db)
+{
+	if(!db)
+	{
+		return;
+	}
+	if(db->base)
+	{
+		munmap((void *) db->base, db->size);
+	}
+	free(db->index);
+	free(db->namebuf);
+	free(db->gitdir);
+	free(db);
+}
+
+/* Read a loose reference, resolving it through libgit2 if it is symbolic */
+static int
+read_loose(REFDB *db, const char *path, const char *name, git_oid *oid)
+{
+	char buf[GIT_OID_HEXSZ + 1];
+	git_reference *ref, *resolved;
+	ssize_t len;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	memset(buf, 0, sizeof(buf));
+	len = read(fd, buf, GIT_OID_HEXSZ);
+	close(fd);
+	if(len == GIT_OID_HEXSZ && !git_oid_fromstr(oid, buf))
+	{
+		return 0;
+	}
+	ref = NULL;
+	r = -1;
+	if(!git_reference_lookup(&ref, db->repo, name) && !git_reference_resolve(&resolved, ref))
+	{
+		git_oid_cpy(oid, git_reference_target(resolved));
+		git_reference_free(resolved);
+		r = 0;
+	}
+	if(ref)
+	{
+		git_reference_free(ref);
+	}
+	return r;
+}
+
+/* Ensure that the list's path buffer can hold len bytes */
+static void
+loose_path_reserve(struct loose_list_struct *list, size_t len)
+{
+	if(len > list->pathalloc)
+	{
+		list->pathalloc = len + 256;
+		list->path = (char *) xrealloc(list->path, list->pathalloc);
+	}
+}
+
+/* Collect the loose references beneath the directory in the list's path
+ * buffer (whose first pathlen bytes hold its path, with a trailing slash)
+ * whose names begin with prefix. Names are built in place in the path
+ * buffer and copied to the list's names, so nothing is allocated for each
+ * reference.
+ */
+static void
+scan_loose(REFDB *db, struct loose_list_struct *list, size_t pathlen, const char *prefix, size_t prefixlen)
+{
+	struct loose_ref_struct *ref;
+	struct dirent *de;
+	struct stat sbuf;
+	const char *name;
+	size_t gitlen, len, namelen;
+	DIR *d;
+
+	list->path[pathlen] = 0;
+	d = opendir(list->path);
+	if(!d)
+	{
+		return;
+	}
+	gitlen = strlen(db->gitdir);
+	while((de = readdir(d)))
+	{
+		if(de->d_name[0] == '.')
+		{
+			continue;
+		}
+		len = strlen(de->d_name);
+		if(len > 5 && !strcmp(de->d_name + len - 5, ".lock"))
+		{
+			continue;
+		}
+		loose_path_reserve(list, pathlen + len + 2);
+		memcpy(list->path + pathlen, de->d_name, len + 1);
+		name = list->path + gitlen;
+		namelen = pathlen + len - gitlen;
+		if(stat(list->path, &sbuf))
+		{
+			continue;
+		}
+		if(S_ISDIR(sbuf.st_mode))
+		{
+			list->path[gitlen + namelen++] = '/';
+			/* Descend only if names beneath the directory can begin with
+			 * the prefix
+			 */
+			if(!strncmp(name, prefix, namelen < prefixlen ? namelen : prefixlen))
+			{
+				scan_loose(db, list, gitlen + namelen, prefix, prefixlen);
+			}
+			continue;
+		}
+		if(namelen < prefixlen || strncmp(name, prefix, prefixlen))
+		{
+			continue;
+		}
+		if(list->count == list->nalloc)
+		{
+			list->nalloc = list->nalloc ? list->nalloc * 2 : 32;
+			list->refs = (struct loose_ref_struct *) xrealloc(list->refs, list->nalloc * sizeof(struct loose_ref_struct));
+		}
+		ref = &(list->refs[list->count]);
+		if(read_loose(db, list->path, name, &(ref->oid)))
+		{
+			continue;
+		}
+		if(list->nameslen + namelen + 1 > list->namesalloc)
+		{
+			list->namesalloc = (list->namesalloc ? list->namesalloc * 2 : 1024) + namelen + 1;
+			list->names = (char *) xrealloc(list->names, list->namesalloc);
+		}
+		memcpy(list->names + list->nameslen, name, namelen + 1);
+		ref->offset = list->nameslen;
+		ref->len = namelen;
+		list->nameslen += namelen + 1;
+		list->count++;
+	}
+	closedir(d);
+}
+
+static int
+loose_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct loose_ref_struct *) a)->name, ((const struct loose_ref_struct *) b)->name);
+}
+
+/* Collect the loose references whose names begin with prefix, in name order */
+static void
+collect_loose(REFDB *db, struct loose_list_struct *list, const char *prefix)
+{
+	const char *dir;
+	size_t c, len, gitlen;
+
+	/* Begin with the deepest directory named by the prefix */
+	dir = prefix;
+	len = strlen(prefix);
+	while(len && prefix[len - 1] != '/')
+	{
+		len--;
+	}
+	if(len < strlen(LOOSE_ROOT) || strncmp(prefix, LOOSE_ROOT, strlen(LOOSE_ROOT)))
+	{
+		if(strncmp(prefix, LOOSE_ROOT, strlen(prefix) < strlen(LOOSE_ROOT) ? strlen(prefix) : strlen(LOOSE_ROOT)))
+		{
+			/* Nothing beneath refs/ can match */
+			return;
+		}
+		dir = LOOSE_ROOT;
+		len = strlen(LOOSE_ROOT);
+	}
+	gitlen = strlen(db->gitdir);
+	loose_path_reserve(list, gitlen + len + 1);
+	memcpy(list->path, db->gitdir, gitlen);
+	memcpy(list->path + gitlen, dir, len);
+	scan_loose(db, list, gitlen + len, prefix, strlen(prefix));
+	/* The names can only be located once they've stopped moving */
+	for(c = 0; c < list->count; c++)
+	{
+		list->refs[c].name = list->names + list->refs[c].offset;
+	}
+	qsort(list->refs, list->count, sizeof(struct loose_ref_struct), loose_cmp);
+}
+
+/* Find the first packed record whose name is no earlier than prefix,
+ * returning its position: a pointer into the mapped file if it is sorted, or
+ * an offset into the index if not
+ */
+static const char *
+packed_lower_bound(REFDB *db, const char *prefix, size_t *pos)
+{
+	const char *lo, *hi, *mid, *rec, *name;
+	size_t prefixlen, len, ilo, ihi, imid;
+
+	prefixlen = strlen(prefix);
+	if(db->index)
+	{
+		ilo = 0;
+		ihi = db->nindex;
+		while(ilo < ihi)
+		{
+			imid = ilo + (ihi - ilo) / 2;
+			if(name_cmp(db->index[imid].name, db->index[imid].len, prefix, prefixlen) < 0)
+			{
+				ilo = imid + 1;
+			}
+			else
+			{
+				ihi = imid;
+			}
+		}
+		*pos = ilo;
+		return NULL;
+	}
+	lo = db->start;
+	hi = db->end;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		rec = record_start(lo, mid);
+		name = record_name(rec, hi, &len);
+		if(!name || name_cmp(name, len, prefix, prefixlen) < 0)
+		{
+			lo = next_record(rec, hi);
+		}
+		else
+		{
+			hi = rec;
+		}
+	}
+	return lo;
+}
+
+/* Fill in a view of the packed reference whose record begins at rec,
+ * returning nonzero if the record is malformed
+ */
+static int
+packed_view(REFDB *db, const char *rec, struct ref_view_struct *view)
+{
+	const char *name, *eol;
+	size_t len;
+
+	name = record_name(rec, db->end, &len);
+	if(!name || git_oid_fromstr(&(view->oid), rec))
+	{
+		return -1;
+	}
+	if(len + 1 > db->namealloc)
+	{
+		db->namealloc = len + 64;
+		db->namebuf = (char *) xrealloc(db->namebuf, db->namealloc);
+	}
+	memcpy(db->namebuf, name, len);
+	db->namebuf[len] = 0;
+	view->name = db->namebuf;
+	view->namelen = len;
+	view->loose = 0;
+	view->peeled = NULL;
+	eol = name + len;
+	if(eol < db->end && *eol == '\r')
+	{
+		eol++;
+	}
+	if(db->end - eol > GIT_OID_HEXSZ + 1 && eol[1] == '^' && !git_oid_fromstr(&(db->peeled_oid), eol + 2))
+	{
+		view->peeled = &(db->peeled_oid);
+	}
+	else if(db->fully_peeled || (db->peeled && !strncmp(db->namebuf, TAGS_PREFIX, strlen(TAGS_PREFIX))))
+	{
+		/* A reference packed with peeling enabled but without a "^" line
+		 * doesn't refer to a tag object, and so peels to itself
+		 */
+		view->peeled = &(view->oid);
+	}
+	return 0;
+}
+
+/* Invoke a callback for each reference whose name begins with prefix, in name
+ * order, stopping as soon as the callback returns nonzero; returns the
+ * callback's result, or zero if every reference was visited
+ */
+int
+refdb_foreach(REFDB *db, const char *prefix, int (*cb)(const struct ref_view_struct *ref, void *data), void *data)
+{
+	struct loose_list_struct loose;
+	struct ref_view_struct view;
+	const char *rec, *name;
+	size_t pos, li, len, prefixlen;
+	int r, cmp;
+
+	memset(&loose, 0, sizeof(loose));
+	collect_loose(db, &loose, prefix);
+	prefixlen = strlen(prefix);
+	rec = NULL;
+	pos = 0;
+	if(db->base)
+	{
+		rec = packed_lower_bound(db, prefix, &pos);
+	}
+	li = 0;
+	r = 0;
+	while(!r)
+	{
+		/* The next packed reference within the prefix, if any */
+		name = NULL;
+		if(db->index && pos < db->nindex)
+		{
+			rec = db->index[pos].rec;
+		}
+		else if(db->index || (rec && rec >= db->end))
+		{
+			rec = NULL;
+		}
+		if(rec)
+		{
+			name = record_name(rec, db->end, &len);
+			if(!name)
+			{
+				rec = db->index ? NULL : next_record(rec, db->end);
+				pos++;
+				continue;
+			}
+			if(len < prefixlen || memcmp(name, prefix, prefixlen))
+			{
+				/* Every later record lies beyond the prefix */
+				rec = NULL;
+				name = NULL;
+			}
+		}
+		if(!name && li >= loose.count)
+		{
+			break;
+		}
+		cmp = !name ? 1 : (li >= loose.count ? -1 : name_cmp(name, len, loose.refs[li].name, loose.refs[li].len));
+		if(cmp <= 0)
+		{
+			if(cmp < 0 && !packed_view(db, rec, &view))
+			{
+				r = cb(&view, data);
+			}
+			if(!db->index)
+			{
+				rec = next_record(rec, db->end);
+			}
+			pos++;
+			if(cmp < 0)
+			{
+				continue;
+			}
+		}
+		/* Loose references take precedence over packed ones */
+		view.name = loose.refs[li].name;
+		view.namelen = loose.refs[li].len;
+		git_oid_cpy(&(view.oid), &(loose.refs[li].oid));
+		view.peeled = NULL;
+		view.loose = 1;
+		r = cb(&view, data);
+		li++;
+	}
+	free(loose.refs);
+	free(loose.names);
+	free(loose.path);
+	return r;
+}
@@ -0,0 +1,52 @@
+#ifndef REFDB_H_
+# define REFDB_H_                       1
+
+# include <git2.h>
+
+/* The reference reader maps a repository's packed-refs file and enumerates
+ * the references beneath a given prefix directly from it: because the file
+ * is sorted, the first reference with the prefix is found by a binary search
+ * over the mapped file, and the rest follow it. Loose references beneath the
+ * prefix are read from the filesystem and merged in, taking precedence over
+ * packed references of the same name, as they do in git.
+ *
+ * Where packed-refs records peeled objects (the "peeled" and "fully-peeled"
+ * traits), they are passed along, so that annotated tags can be peeled
+ * without reading any objects.
+ *
+ * Nothing is allocated for each reference: the name and object IDs are
+ * presented in a view whose storage is reused for the next reference, and
+ * the names of loose references are gathered into a single buffer while the
+ * directories beneath the prefix are scanned.
+ */
+
+typedef struct refdb_struct REFDB;
+
+struct ref_view_struct
+{
+	/* The full name of the reference, valid only until the callback returns */
+	const char *name;
+	size_t namelen;
+	/* The object the reference refers to (resolved, if it is symbolic) */
+	git_oid oid;
+	/* The object it ultimately refers to once tags are peeled, or NULL if
+	 * that isn't known
+	 */
+	const git_oid *peeled;
+	/* Whether the reference is loose, rather than packed */
+	int loose;
+};
+
+/* Open the reference reader for a repository, mapping its packed-refs file if
+ * it has one
+ */
+REFDB *refdb_open(git_repository *repo);
+/* Close a reference reader */
+void refdb_close(REFDB *db);
+/* Invoke a callback for each reference whose name begins with prefix, in name
+ * order, stopping as soon as the callback returns nonzero; returns the
+ * callback's result, or zero if every reference was visited
+ */
+int refdb_foreach(REFDB *db, const char *prefix, int (*cb)(const struct ref_view_struct *ref, void *data), void *data);
+
+#endif /*!REFDB_H_*/
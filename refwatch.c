@@ -0,0 +1,414 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "refwatch.h"
+#include "utils.h"
+
+#define PACKED_REFS                     "packed-refs"
+#define REFS_DIR                        "refs"
+
+/* How long to wait for further changes before scanning, in milliseconds;
+ * updating a reference involves several filesystem operations, and a push
+ * may update many references at once
+ */
+#define SETTLE_MS                       10
+
+#define WATCH_MASK                      (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+struct watch_entry_struct
+{
+	char *name;
+	git_oid oid;
+	git_oid peeled;
+};
+
+struct watch_table_struct
+{
+	struct watch_entry_struct *entries;
+	size_t count;
+	size_t nalloc;
+};
+
+struct watch_dir_struct
+{
+	int wd;
+	char *path;
+};
+
+struct refwatch_struct
+{
+	const char *progname;
+	/* The repository path, with a trailing slash */
+	char *gitdir;
+	int fd;
+	/* The watch on the repository directory itself */
+	int gitwd;
+	/* The watched directories beneath refs/ */
+	struct watch_dir_struct *dirs;
+	size_t ndirs;
+	size_t diralloc;
+	int (*scan)(REFWATCH *watch, void *data);
+	void *data;
+	/* The references as of the last scan */
+	struct watch_table_struct table;
+	/* The references found by the scan in progress */
+	struct watch_table_struct next;
+};
+
+static void
+table_clear(struct watch_table_struct *table)
+{
+	size_t c;
+
+	for(c = 0; c < table->count; c++)
+	{
+		free(table->entries[c].name);
+	}
+	table->count = 0;
+}
+
+/* Watch a directory beneath refs/ and everything beneath it */
+static int
+watch_dirs(REFWATCH *watch, const char *path)
+{
+	struct dirent *de;
+	struct stat sbuf;
+	char *sub;
+	DIR *d;
+	int wd;
+
+	wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+	if(wd == -1)
+	{
+		if(errno == ENOENT || errno == ENOTDIR)
+		{
+			/* It vanished in the meantime */
+			return 0;
+		}
+		fprintf(stderr, "%s: %s: %s\n", watch->progname, path, strerror(errno));
+		return -1;
+	}
+	if(watch->ndirs == watch->diralloc)
+	{
+		watch->diralloc = watch->diralloc ? watch->diralloc * 2 : 32;
+		watch->dirs = (struct watch_dir_struct *) xrealloc(watch->dirs, watch->diralloc * sizeof(struct watch_dir_struct));
+	}
+	watch->dirs[watch->ndirs].wd = wd;
+	watch->dirs[watch->ndirs].path = xstrdup(path);
+	watch->ndirs++;
+	d = opendir(path);
+	if(!d)
+	{
+		return 0;
+	}
+	while((de = readdir(d)))
+	{
+		if(de->d_name[0] == '.')
+		{
+			continue;
+		}
+		sub = (char *) xalloc(strlen(path) + strlen(de->d_name) + 2);
+		sprintf(sub, "%s/%s", path, de->d_name);
+		if(!stat(sub, &sbuf) && S_ISDIR(sbuf.st_mode) && watch_dirs(watch, sub))
+		{
+			free(sub);
+			closedir(d);
+			return -1;
+		}
+		free(sub);
+	}
+	closedir(d);
+	return 0;
+}
+
+static struct watch_dir_struct *
+find_dir(REFWATCH *watch, int wd)
+{
+	size_t c;
+
+	for(c = 0; c < watch->ndirs; c++)
+	{
+		if(watch->dirs[c].wd == wd)
+		{
+			return &(watch->dirs[c]);
+		}
+	}
+	return NULL;
+}
+
+/* Begin watching a repository's references; returns NULL (having reported
+ * the reason) if they can't be watched
+ */
+REFWATCH *
+refwatch_open(git_repository *repo, const char *progname, int (*scan)(REFWATCH *watch, void *data), void *data)
+{
+	REFWATCH *watch;
+	const char *gitdir;
+	char *path;
+	size_t len;
+
+	watch = (REFWATCH *) xalloc(sizeof(REFWATCH));
+	watch->progname = progname;
+	watch->scan = scan;
+	watch->data = data;
+	gitdir = git_repository_path(repo);
+	len = strlen(gitdir);
+	watch->gitdir = (char *) xalloc(len + 2);
+	strcpy(watch->gitdir, gitdir);
+	if(len && watch->gitdir[len - 1] != '/')
+	{
+		watch->gitdir[len] = '/';
+	}
+	watch->fd = inotify_init1(IN_CLOEXEC);
+	if(watch->fd == -1)
+	{
+		fprintf(stderr, "%s: inotify: %s\n", progname, strerror(errno));
+		refwatch_close(watch);
+		return NULL;
+	}
+	watch->gitwd = inotify_add_watch(watch->fd, watch->gitdir, WATCH_MASK);
+	if(watch->gitwd == -1)
+	{
+		fprintf(stderr, "%s: %s: %s\n", progname, watch->gitdir, strerror(errno));
+		refwatch_close(watch);
+		return NULL;
+	}
+	path = (char *) xalloc(strlen(watch->gitdir) + strlen(REFS_DIR) + 1);
+	sprintf(path, "%s%s", watch->gitdir, REFS_DIR);
+	if(watch_dirs(watch, path))
+	{
+		free(path);
+		refwatch_close(watch);
+		return NULL;
+	}
+	free(path);
+	return watch;
+}
+
+/* Stop watching, and free the table */
+void
+refwatch_close(REFWATCH *watch)
+{
+	size_t c;
+
+	if(!watch)
+	{
+		return;
+	}
+	if(watch->fd != -1)
+	{
+		close(watch->fd);
+	}
+	for(c = 0; c < watch->ndirs; c++)
+	{
+		free(watch->dirs[c].path);
+	}
+	free(watch->dirs);
+	table_clear(&(watch->table));
+	table_clear(&(watch->next));
+	free(watch->table.entries);
+	free(watch->next.entries);
+	free(watch->gitdir);
+	free(watch);
+}
+
+/* Add a reference to the table being built by a scan; references must be
+ * added in name order
+ */
+void
+refwatch_add(REFWATCH *watch, const char *name, const git_oid *oid, const git_oid *peeled)
+{
+	struct watch_table_struct *table;
+	struct watch_entry_struct *entry;
+
+	table = &(watch->next);
+	if(table->count == table->nalloc)
+	{
+		table->nalloc = table->nalloc ? table->nalloc * 2 : 256;
+		table->entries = (struct watch_entry_struct *) xrealloc(table->entries, table->nalloc * sizeof(struct watch_entry_struct));
+	}
+	entry = &(table->entries[table->count++]);
+	entry->name = xstrdup(name);
+	git_oid_cpy(&(entry->oid), oid);
+	git_oid_cpy(&(entry->peeled), peeled ? peeled : oid);
+}
+
+/* Scan the references again and report the differences from the last scan */
+static int
+rescan(REFWATCH *watch, int (*cb)(int change, const char *name, const git_oid *oldoid, const git_oid *newoid, const git_oid *peeled, void *data), void *data)
+{
+	static const git_oid zero;
+	struct watch_table_struct old;
+	struct watch_entry_struct *o, *n;
+	size_t oi, ni;
+	int r, cmp;
+
+	table_clear(&(watch->next));
+	r = watch->scan(watch, watch->data);
+	if(r)
+	{
+		return r;
+	}
+	old = watch->table;
+	watch->table = watch->next;
+	watch->next = old;
+	oi = ni = 0;
+	while(!r && (oi < old.count || ni < watch->table.count))
+	{
+		o = oi < old.count ? &(old.entries[oi]) : NULL;
+		n = ni < watch->table.count ? &(watch->table.entries[ni]) : NULL;
+		cmp = !o ? 1 : (!n ? -1 : strcmp(o->name, n->name));
+		if(cmp < 0)
+		{
+			r = cb(REFWATCH_DELETE, o->name, &(o->oid), &zero, &zero, data);
+			oi++;
+		}
+		else if(cmp > 0)
+		{
+			r = cb(REFWATCH_CREATE, n->name, &zero, &(n->oid), &(n->peeled), data);
+			ni++;
+		}
+		else
+		{
+			if(git_oid_cmp(&(o->oid), &(n->oid)) || git_oid_cmp(&(o->peeled), &(n->peeled)))
+			{
+				r = cb(REFWATCH_UPDATE, n->name, &(o->oid), &(n->oid), &(n->peeled), data);
+			}
+			oi++;
+			ni++;
+		}
+	}
+	if(!r)
+	{
+		r = cb(REFWATCH_SETTLED, NULL, NULL, NULL, NULL, data);
+	}
+	return r;
+}
+
+/* Read the pending events, returning nonzero if any of them could affect the
+ * references, or -1 on error
+ */
+static int
+read_events(REFWATCH *watch)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct watch_dir_struct *dir;
+	char *path;
+	ssize_t len;
+	size_t namelen;
+	char *p;
+	int changed;
+
+	len = read(watch->fd, buf, sizeof(buf));
+	if(len == -1)
+	{
+		if(errno == EINTR || errno == EAGAIN)
+		{
+			return 0;
+		}
+		fprintf(stderr, "%s: inotify: %s\n", watch->progname, strerror(errno));
+		return -1;
+	}
+	changed = 0;
+	for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+	{
+		ev = (const struct inotify_event *) p;
+		if(ev->mask & IN_Q_OVERFLOW)
+		{
+			/* Events were lost, so assume the worst */
+			changed = 1;
+			continue;
+		}
+		namelen = ev->len ? strlen(ev->name) : 0;
+		if(ev->wd == watch->gitwd)
+		{
+			if(ev->len && !strcmp(ev->name, PACKED_REFS))
+			{
+				changed = 1;
+			}
+			continue;
+		}
+		dir = find_dir(watch, ev->wd);
+		if(!dir)
+		{
+			continue;
+		}
+		if(ev->mask & IN_IGNORED)
+		{
+			/* The directory was removed */
+			free(dir->path);
+			*dir = watch->dirs[--watch->ndirs];
+			continue;
+		}
+		if(namelen > 5 && !strcmp(ev->name + namelen - 5, ".lock"))
+		{
+			continue;
+		}
+		if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+		{
+			path = (char *) xalloc(strlen(dir->path) + namelen + 2);
+			sprintf(path, "%s/%s", dir->path, ev->name);
+			if(watch_dirs(watch, path))
+			{
+				free(path);
+				return -1;
+			}
+			free(path);
+		}
+		changed = 1;
+	}
+	return changed;
+}
+
+/* Report every reference as created, then wait for changes and report them
+ * as they happen, until the callback returns nonzero (or an error occurs),
+ * returning its result
+ */
+int
+refwatch_run(REFWATCH *watch, int (*cb)(int change, const char *name, const git_oid *oldoid, const git_oid *newoid, const git_oid *peeled, void *data), void *data)
+{
+	struct pollfd pfd;
+	int r, changed;
+
+	r = rescan(watch, cb, data);
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+	while(!r)
+	{
+		changed = 0;
+		/* Wait for something to happen, and then for it to settle */
+		while((r = poll(&pfd, 1, changed ? SETTLE_MS : -1)) != 0)
+		{
+			if(r == -1)
+			{
+				if(errno == EINTR)
+				{
+					continue;
+				}
+				fprintf(stderr, "%s: poll: %s\n", watch->progname, strerror(errno));
+				return -1;
+			}
+			r = read_events(watch);
+			if(r < 0)
+			{
+				return -1;
+			}
+			changed |= r;
+		}
+		r = rescan(watch, cb, data);
+	}
+	return r;
+}
@@ -0,0 +1,48 @@
+#ifndef REFWATCH_H_
+# define REFWATCH_H_                    1
+
+# include <git2.h>
+
+/* A reference watch keeps a table of a repository's references in memory,
+ * and reports the changes to it as they happen. The directories beneath
+ * refs/ and the repository directory itself (for packed-refs) are watched
+ * with inotify; nothing is read until something changes. Once the changes
+ * have settled, the references are scanned again (which is cheap, see
+ * refdb.h), and the new table compared with the old one.
+ *
+ * The caller supplies the scan, which adds each reference of interest to
+ * the table with refwatch_add() in name order, and so decides which
+ * references are watched and what is recorded for them.
+ */
+
+typedef struct refwatch_struct REFWATCH;
+
+/* The changes reported for a reference: as with git's reference-transaction
+ * hook, the old object ID of a newly-created reference, and the new object
+ * ID of a deleted one, are all zeroes
+ */
+# define REFWATCH_CREATE                1
+# define REFWATCH_UPDATE                2
+# define REFWATCH_DELETE                3
+/* Reported once all of the changes found by a scan have been, so that the
+ * caller can flush its output; the name and object IDs are NULL
+ */
+# define REFWATCH_SETTLED               0
+
+/* Begin watching a repository's references; returns NULL (having reported
+ * the reason) if they can't be watched
+ */
+REFWATCH *refwatch_open(git_repository *repo, const char *progname, int (*scan)(REFWATCH *watch, void *data), void *data);
+/* Stop watching, and free the table */
+void refwatch_close(REFWATCH *watch);
+/* Add a reference to the table being built by a scan; references must be
+ * added in name order
+ */
+void refwatch_add(REFWATCH *watch, const char *name, const git_oid *oid, const git_oid *peeled);
+/* Report every reference as created, then wait for changes and report them
+ * as they happen, until the callback returns nonzero (or an error occurs),
+ * returning its result
+ */
+int refwatch_run(REFWATCH *watch, int (*cb)(int change, const char *name, const git_oid *oldoid, const git_oid *newoid, const git_oid *peeled, void *data), void *data);
+
+#endif /*!REFWATCH_H_*/
@@ -0,0 +1,488 @@
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tag-pattern.h"
+#include "name-class.h"
+#include "utils.h"
+
+#define TAGS_PREFIX                     "refs/tags/"
+#define TAGS_PREFIX_LEN                 10
+
+#define CONFIG_NAME                     "release.tagpattern"
+
+/* States are numbered with 16 bits, which is far more than any plausible set
+ * of prefixes needs
+ */
+#define STATES_MAX                      65535
+
+/* The dead state, which every state reaches when the name can no longer be
+ * a release tag, and the start state
+ */
+#define STATE_DEAD                      0
+#define STATE_START                     1
+
+/* Each prefix contributes the positions within it to the NFA from which the
+ * DFA is built, followed by the three positions within the version number:
+ * before the full stop (VERSION_MAJOR), after it (VERSION_DOT), and after the
+ * digit which follows it, which is the only accepting position
+ * (VERSION_REST)
+ */
+#define VERSION_MAJOR                   0
+#define VERSION_DOT                     1
+#define VERSION_REST                    2
+#define VERSION_ITEMS                   3
+
+static const char *default_prefixes[] = { "v", "V", "r", "R", "debian/", "release/", "" };
+
+struct tag_pattern_struct
+{
+	/* The class of each byte: bytes in the same class lead to the same
+	 * state from every state
+	 */
+	unsigned char classes[256];
+	size_t nclasses;
+	/* The transitions, indexed by state * nclasses + class */
+	uint16_t *next;
+	/* For each state, one more than the length of the prefix matched if it
+	 * accepts, or zero if it doesn't
+	 */
+	uint32_t *accept;
+	/* For each state, whether it's within the remainder of the version,
+	 * where every version character leads back to the same state and
+	 * anything else to the dead one, so that the rest of the name need only
+	 * be checked against the version characters
+	 */
+	unsigned char *span;
+	size_t nstates;
+	NAME_CLASS version;
+};
+
+struct prefix_list_struct
+{
+	char **prefixes;
+	size_t count;
+	size_t nalloc;
+};
+
+/* The state of the subset construction: each DFA state is a set of NFA
+ * positions, held as a bitset
+ */
+struct build_struct
+{
+	const char *progname;
+	const char *const *prefixes;
+	size_t nprefixes;
+	size_t *lens;
+	/* The first NFA position of each prefix */
+	size_t *base;
+	size_t nitems;
+	size_t nwords;
+	/* The set of positions of each state, nwords apiece */
+	uint64_t *sets;
+	size_t nalloc;
+	/* An open-addressed hash table of states (plus one) by set */
+	uint32_t *table;
+	size_t tablesize;
+	TAG_PATTERN *pattern;
+};
+
+static int
+is_digit(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* Characters which may appear in a version number after its first digit
+ * following the full stop
+ */
+static int
+is_version(int c)
+{
+	return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_' || c == '.' || c == '~' || c == '@';
+}
+
+/* Determine the position which follows position k of a prefix's NFA
+ * positions on byte c, returning -1 if there is none
+ */
+static int
+item_next(const struct build_struct *build, size_t prefix, size_t k, int c)
+{
+	size_t len;
+
+	len = build->lens[prefix];
+	if(k < len)
+	{
+		return (unsigned char) build->prefixes[prefix][k] == c ? (int) k + 1 : -1;
+	}
+	switch(k - len)
+	{
+		case VERSION_MAJOR:
+			if(is_digit(c))
+			{
+				return (int) k;
+			}
+			return c == '.' ? (int) k + 1 : -1;
+		case VERSION_DOT:
+			return is_digit(c) ? (int) k + 1 : -1;
+		default:
+			return is_version(c) ? (int) k : -1;
+	}
+}
+
+/* Group the bytes into classes: each byte which appears in a prefix is a
+ * class of its own, and the rest are classed by how the version grammar
+ * treats them
+ */
+static void
+build_classes(struct build_struct *build, unsigned char *rep)
+{
+	int sigclass[4 + 256];
+	int c, sig;
+	size_t n;
+	const char *p;
+	unsigned char inprefix[256];
+
+	memset(inprefix, 0, sizeof(inprefix));
+	for(n = 0; n < build->nprefixes; n++)
+	{
+		for(p = build->prefixes[n]; *p; p++)
+		{
+			inprefix[(unsigned char) *p] = 1;
+		}
+	}
+	for(c = 0; c < 4 + 256; c++)
+	{
+		sigclass[c] = -1;
+	}
+	build->pattern->nclasses = 0;
+	for(c = 0; c < 256; c++)
+	{
+		if(inprefix[c])
+		{
+			sig = 4 + c;
+		}
+		else if(is_digit(c))
+		{
+			sig = 1;
+		}
+		else if(c == '.')
+		{
+			sig = 2;
+		}
+		else
+		{
+			sig = is_version(c) ? 3 : 0;
+		}
+		if(sigclass[sig] == -1)
+		{
+			sigclass[sig] = (int) build->pattern->nclasses;
+			rep[build->pattern->nclasses] = (unsigned char) c;
+			build->pattern->nclasses++;
+		}
+		build->pattern->classes[c] = (unsigned char) sigclass[sig];
+	}
+}
+
+static size_t
+set_hash(const struct build_struct *build, const uint64_t *set)
+{
+	uint64_t h;
+	size_t w;
+
+	h = 14695981039346656037ULL;
+	for(w = 0; w < build->nwords; w++)
+	{
+		h = (h ^ set[w]) * 1099511628211ULL;
+		h ^= h >> 29;
+	}
+	return (size_t) h;
+}
+
+/* Find the state whose set of positions is given, adding it if there's none,
+ * and returning its number, or -1 if there are too many states
+ */
+static int
+find_state(struct build_struct *build, const uint64_t *set)
+{
+	uint32_t *oldtable;
+	size_t c, n, oldsize;
+	TAG_PATTERN *pattern;
+
+	pattern = build->pattern;
+	if((pattern->nstates + 1) * 2 > build->tablesize)
+	{
+		oldtable = build->table;
+		oldsize = build->tablesize;
+		build->tablesize = oldsize ? oldsize * 2 : 64;
+		build->table = (uint32_t *) xalloc(build->tablesize * sizeof(uint32_t));
+		for(c = 0; c < oldsize; c++)
+		{
+			if(!oldtable[c])
+			{
+				continue;
+			}
+			for(n = set_hash(build, &(build->sets[(oldtable[c] - 1) * build->nwords])) & (build->tablesize - 1); build->table[n]; n = (n + 1) & (build->tablesize - 1));
+			build->table[n] = oldtable[c];
+		}
+		free(oldtable);
+	}
+	for(n = set_hash(build, set) & (build->tablesize - 1); build->table[n]; n = (n + 1) & (build->tablesize - 1))
+	{
+		if(!memcmp(&(build->sets[(build->table[n] - 1) * build->nwords]), set, build->nwords * sizeof(uint64_t)))
+		{
+			return (int) build->table[n] - 1;
+		}
+	}
+	if(pattern->nstates == STATES_MAX)
+	{
+		return -1;
+	}
+	if(pattern->nstates == build->nalloc)
+	{
+		build->nalloc = build->nalloc ? build->nalloc * 2 : 32;
+		build->sets = (uint64_t *) xrealloc(build->sets, build->nalloc * build->nwords * sizeof(uint64_t));
+		pattern->next = (uint16_t *) xrealloc(pattern->next, build->nalloc * pattern->nclasses * sizeof(uint16_t));
+		pattern->accept = (uint32_t *) xrealloc(pattern->accept, build->nalloc * sizeof(uint32_t));
+		pattern->span = (unsigned char *) xrealloc(pattern->span, build->nalloc);
+	}
+	memcpy(&(build->sets[pattern->nstates * build->nwords]), set, build->nwords * sizeof(uint64_t));
+	build->table[n] = (uint32_t) pattern->nstates + 1;
+	return (int) pattern->nstates++;
+}
+
+/* Build the DFA for a set of prefixes by subset construction */
+static int
+build_dfa(struct build_struct *build)
+{
+	TAG_PATTERN *pattern;
+	unsigned char rep[256];
+	uint64_t *set, *target;
+	size_t s, c, n, k;
+	int next, state;
+
+	pattern = build->pattern;
+	build->lens = (size_t *) xalloc((build->nprefixes + 1) * sizeof(size_t));
+	build->base = (size_t *) xalloc((build->nprefixes + 1) * sizeof(size_t));
+	for(n = 0; n < build->nprefixes; n++)
+	{
+		build->lens[n] = strlen(build->prefixes[n]);
+		build->base[n] = build->nitems;
+		build->nitems += build->lens[n] + VERSION_ITEMS;
+	}
+	build->nwords = build->nitems / 64 + 1;
+	build_classes(build, rep);
+	set = (uint64_t *) xalloc(build->nwords * sizeof(uint64_t));
+	target = (uint64_t *) xalloc(build->nwords * sizeof(uint64_t));
+	/* The dead state has no positions, and the start state has the first
+	 * position of every prefix
+	 */
+	find_state(build, set);
+	for(n = 0; n < build->nprefixes; n++)
+	{
+		set[build->base[n] / 64] |= (uint64_t) 1 << (build->base[n] % 64);
+	}
+	find_state(build, set);
+	/* States are added to the end as they're found, so working through them
+	 * in order visits every one
+	 */
+	for(s = 0; s < pattern->nstates; s++)
+	{
+		memcpy(set, &(build->sets[s * build->nwords]), build->nwords * sizeof(uint64_t));
+		pattern->accept[s] = 0;
+		for(n = build->nprefixes; n > 0; n--)
+		{
+			k = build->base[n - 1] + build->lens[n - 1] + VERSION_REST;
+			if(set[k / 64] & ((uint64_t) 1 << (k % 64)))
+			{
+				pattern->accept[s] = (uint32_t) build->lens[n - 1] + 1;
+			}
+		}
+		for(c = 0; c < pattern->nclasses; c++)
+		{
+			memset(target, 0, build->nwords * sizeof(uint64_t));
+			for(n = 0; n < build->nprefixes; n++)
+			{
+				for(k = 0; k < build->lens[n] + VERSION_ITEMS; k++)
+				{
+					if(!(set[(build->base[n] + k) / 64] & ((uint64_t) 1 << ((build->base[n] + k) % 64))))
+					{
+						continue;
+					}
+					next = item_next(build, n, k, rep[c]);
+					if(next != -1)
+					{
+						target[(build->base[n] + next) / 64] |= (uint64_t) 1 << ((build->base[n] + next) % 64);
+					}
+				}
+			}
+			state = find_state(build, target);
+			if(state == -1)
+			{
+				fprintf(stderr, "%s: %s: too many patterns to compile\n", build->progname, CONFIG_NAME);
+				free(set);
+				free(target);
+				return -1;
+			}
+			pattern->next[s * pattern->nclasses + c] = (uint16_t) state;
+		}
+	}
+	for(s = 0; s < pattern->nstates; s++)
+	{
+		pattern->span[s] = (pattern->accept[s] != 0);
+		for(c = 0; c < pattern->nclasses; c++)
+		{
+			if(pattern->next[s * pattern->nclasses + c] != (is_version(rep[c]) ? s : STATE_DEAD))
+			{
+				pattern->span[s] = 0;
+			}
+		}
+	}
+	free(set);
+	free(target);
+	return 0;
+}
+
+static int
+prefix_cb(const git_config_entry *entry, void *data)
+{
+	struct prefix_list_struct *list;
+	size_t len;
+
+	list = (struct prefix_list_struct *) data;
+	if(!entry->value)
+	{
+		return 0;
+	}
+	if(list->count == list->nalloc)
+	{
+		list->nalloc = list->nalloc ? list->nalloc * 2 : 8;
+		list->prefixes = (char **) xrealloc(list->prefixes, list->nalloc * sizeof(char *));
+	}
+	len = strlen(entry->value);
+	list->prefixes[list->count] = (char *) xalloc(len + 1);
+	memcpy(list->prefixes[list->count], entry->value, len);
+	list->count++;
+	return 0;
+}
+
+/* Compile the release tag prefixes set in a configuration (or the defaults,
+ * if there are none); returns NULL (having reported the reason) if they
+ * can't be compiled
+ */
+TAG_PATTERN *
+tag_pattern_create(git_config *cfg, const char *progname)
+{
+	struct prefix_list_struct list;
+	struct build_struct build;
+	const git_error *err;
+	TAG_PATTERN *pattern;
+	size_t n;
+	int r;
+
+	memset(&list, 0, sizeof(list));
+	r = git_config_get_multivar_foreach(cfg, CONFIG_NAME, NULL, prefix_cb, (void *) &list);
+	if(r && r != GIT_ENOTFOUND)
+	{
+		err = giterr_last();
+		fprintf(stderr, "%s: %s: %s\n", progname, CONFIG_NAME, err ? err->message : "failed to read configuration");
+		for(n = 0; n < list.count; n++)
+		{
+			free(list.prefixes[n]);
+		}
+		free(list.prefixes);
+		return NULL;
+	}
+	pattern = (TAG_PATTERN *) xalloc(sizeof(TAG_PATTERN));
+	name_class_init(&(pattern->version), is_version);
+	memset(&build, 0, sizeof(build));
+	build.progname = progname;
+	build.pattern = pattern;
+	if(list.count)
+	{
+		build.prefixes = (const char *const *) list.prefixes;
+		build.nprefixes = list.count;
+	}
+	else
+	{
+		build.prefixes = default_prefixes;
+		build.nprefixes = sizeof(default_prefixes) / sizeof(default_prefixes[0]);
+	}
+	r = build_dfa(&build);
+	free(build.lens);
+	free(build.base);
+	free(build.sets);
+	free(build.table);
+	for(n = 0; n < list.count; n++)
+	{
+		free(list.prefixes[n]);
+	}
+	free(list.prefixes);
+	if(r)
+	{
+		tag_pattern_free(pattern);
+		return NULL;
+	}
+	return pattern;
+}
+
+/* Free a compiled tag pattern */
+void
+tag_pattern_free(TAG_PATTERN *pattern)
+{
+	if(!pattern)
+	{
+		return;
+	}
+	free(pattern->next);
+	free(pattern->accept);
+	free(pattern->span);
+	free(pattern);
+}
+
+/* Check whether a tag (with or without its refs/tags/ prefix) is a release
+ * tag, returning a pointer to the start of its version number if so, or NULL
+ * if not
+ */
+const char *
+tag_pattern_match(const TAG_PATTERN *pattern, const char *tag_name)
+{
+	const unsigned char *p;
+	size_t state;
+	uint32_t accept;
+
+	if(!strncmp(tag_name, TAGS_PREFIX, TAGS_PREFIX_LEN))
+	{
+		tag_name += TAGS_PREFIX_LEN;
+	}
+	/* The dead state leads only to itself, so there's no need to stop
+	 * early when it's reached; once the remainder of the version has been
+	 * reached, the rest of the name is checked in bulk
+	 */
+	state = STATE_START;
+	for(p = (const unsigned char *) tag_name; *p; p++)
+	{
+		state = pattern->next[state * pattern->nclasses + pattern->classes[*p]];
+		if(pattern->span[state])
+		{
+			p++;
+			p += name_class_span(&(pattern->version), (const char *) p);
+			if(*p)
+			{
+				state = STATE_DEAD;
+			}
+			break;
+		}
+	}
+	accept = pattern->accept[state];
+	if(!accept || (size_t) ((const char *) p - tag_name) - (accept - 1) > TAG_VERSION_MAX)
+	{
+		return NULL;
+	}
+	return tag_name + accept - 1;
+}
@@ -0,0 +1,47 @@
+#ifndef TAG_PATTERN_H_
+# define TAG_PATTERN_H_                 1
+
+# include <git2.h>
+
+/* A tag pattern decides which tags name releases, and where in each such
+ * tag's name the version number begins.
+ *
+ * A release tag consists of one of a set of prefixes, given by the
+ * release.tagPattern configuration variable (which may be set any number of
+ * times), followed by a version number: a run of digits (which may be
+ * empty), a full stop and a digit, and then any number of letters, digits
+ * and the characters "-_.~@", up to 32 characters in all. For example, with
+ * release.tagPattern set to "pkgname-" and "upstream/", the tags
+ * "pkgname-1.2.3" and "upstream/1.2" are releases 1.2.3 and 1.2. Where no
+ * prefixes are configured, the defaults are "v", "V", "r", "R", "debian/",
+ * "release/" and the empty prefix (so that a bare version number is a
+ * release tag).
+ *
+ * The prefixes and the version grammar are compiled together into a DFA,
+ * with a table of transitions indexed by state and by the class of the
+ * next byte of the tag's name, so a tag is checked in a single pass over
+ * its name, with no backtracking and no comparisons of prefixes, however
+ * many are configured. Each accepting state records the length of the
+ * prefix which was matched; if a tag could be read in more than one way,
+ * the prefix which was configured first wins.
+ */
+
+typedef struct tag_pattern_struct TAG_PATTERN;
+
+/* The longest version number a release tag may have */
+# define TAG_VERSION_MAX                32
+
+/* Compile the release tag prefixes set in a configuration (or the defaults,
+ * if there are none); returns NULL (having reported the reason) if they
+ * can't be compiled
+ */
+TAG_PATTERN *tag_pattern_create(git_config *cfg, const char *progname);
+/* Free a compiled tag pattern */
+void tag_pattern_free(TAG_PATTERN *pattern);
+/* Check whether a tag (with or without its refs/tags/ prefix) is a release
+ * tag, returning a pointer to the start of its version number if so, or NULL
+ * if not
+ */
+const char *tag_pattern_match(const TAG_PATTERN *pattern, const char *tag_name);
+
+#endif /*!TAG_PATTERN_H_*/
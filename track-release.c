@@ -20,6 +20,10 @@
  * release-tracked branches; in which case, the version will be added to
  * the database against both branches.
  *
+ * If the repository has a commit graph (maintained by git-update-generations),
+ * the history walk stops at the generation of the oldest release-tagged
+ * commit rather than continuing to the root.
+ *
  * The database consists of a single table, "releases", which is defined as:
  *
  *   "release"    (string)   The version number
@@ -86,24 +90,72 @@
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
-#include <alloca.h>
 #include <errno.h>
 
 #include "utils.h"
+#include "commit-graph.h"
+#include "refdb.h"
+#include "multicall.h"
 
 static char *sqlbuf;
 static size_t sqlbuflen;
 
+struct release_tag_struct
+{
+	/* The commit which the tag points at */
+	git_oid commit;
+	/* The position of the tag in iteration order */
+	size_t index;
+	/* The version number extracted from the tag name */
+	char *version;
+};
+
 struct tag_match_struct
 {
 	/* The repository we're matching against */
 	REPO *repo;
-	/* The OID to match (in iterator callbacks) */
-	git_oid oidmatch;
+	/* The commit graph, if there is one */
+	COMMIT_GRAPH *graph;
+	/* The reference reader */
+	REFDB *refs;
+	/* The release tags, sorted by commit */
+	struct release_tag_struct *tags;
+	size_t ntags;
+	size_t nalloc;
+	/* The lowest generation number of any release tag's commit */
+	uint32_t mingen;
 	/* The current branch name */
 	const char *branch_name;
 };
 
+/* The release-tracking settings of a branch, from its release-branch
+ * section; further settings belong alongside the tracking mode
+ */
+struct release_branch_struct
+{
+	char *name;
+	/* The tracking mode; never NULL, since a branch is only recorded once
+	 * its release-branch section has a track setting with a value
+	 */
+	char *track;
+	/* The position of the setting in iteration order */
+	size_t index;
+};
+
+/* The release-branch sections are read in a single pass over the
+ * configuration, rather than looking up each branch's settings in turn;
+ * the branches are then sorted by name, so that they're tracked in the
+ * same order as if the branches themselves had been enumerated
+ */
+struct release_config_struct
+{
+	/* The arena which holds the branches' names and settings */
+	ARENA *arena;
+	struct release_branch_struct *branches;
+	size_t nbranches;
+	size_t nalloc;
+};
+
 struct release_match_struct
 {
 	/* The formatted OID to match */
@@ -129,7 +181,7 @@ sql_exec(REPO *repo, const char *sql)
 	char *err;
 
 	err = NULL;
-	if(sqlite3_exec(repo->db, sql, NULL, NULL, &err) != SQLITE_OK)
+	if(sqlite3_exec(repo_db(repo), sql, NULL, NULL, &err) != SQLITE_OK)
 	{
 		fprintf(stderr, "%s: %s\n", repo->progname, err);
 		fprintf(stderr, "%s: while executing '%s'\n", repo->progname, sql);
@@ -175,7 +227,7 @@ release_exists(REPO *repo, const char *version, const char *branch_name, const c
 	match.result = 0;
 	snprintf(sqlbuf, sqlbuflen, "SELECT \"commit\" FROM \"releases\" WHERE \"release\" = '%s' AND \"branch\" = '%s'", version, branch_name);	
 	err = NULL;
-	if(sqlite3_exec(repo->db, sqlbuf, release_exists_cb, (void *) &match, &err))
+	if(sqlite3_exec(repo_db(repo), sqlbuf, release_exists_cb, (void *) &match, &err))
 	{
 		fprintf(stderr, "%s: %s\n", repo->progname, err);
 		exit(EXIT_FAILURE);
@@ -247,103 +299,288 @@ add_release_tip(REPO *repo, const char *branch_name, const git_oid *oid)
 	return add_release(repo, branch_name, oid, versbuf, &tm);
 }
 
+/* Collect the tags which look like releases, along with their commits */
 static int
-tag_callback(const char *tag_name, git_oid *oid, void *data)
+tag_callback(const struct ref_view_struct *ref, void *data)
 {
 	struct tag_match_struct *match;
-	git_commit *commit;
-	const git_signature *sig;
-	struct tm tm;
+	struct release_tag_struct *tag;
+	git_object *obj, *peeled;
+	const git_oid *commit;
 	const char *version;
 
 	match = (struct tag_match_struct *) data;
-	if(git_oid_cmp(oid, &(match->oidmatch)))
+	version = check_release_tag(match->repo, ref->name);
+	if(!version)
 	{
 		return 0;
 	}
-	version = check_release_tag(tag_name);
-	if(!version)
+	obj = NULL;
+	peeled = NULL;
+	/* If packed-refs says which commit the tag leads to, and the commit graph
+	 * confirms that it is one, no objects need be read
+	 */
+	if(ref->peeled && commit_graph_find(match->graph, ref->peeled) != GRAPH_NONE)
+	{
+		commit = ref->peeled;
+	}
+	else if(git_object_lookup(&obj, match->repo->repo, &(ref->oid), GIT_OBJ_ANY) || git_object_peel(&peeled, obj, GIT_OBJ_COMMIT))
+	{
+		fprintf(stderr, "%s: failed to locate commit for tag '%s'\n", match->repo->progname, ref->name);
+		git_object_free(obj);
+		return 0;
+	}
+	else
+	{
+		commit = git_object_id(peeled);
+	}
+	if(match->ntags == match->nalloc)
+	{
+		match->nalloc = match->nalloc ? match->nalloc * 2 : 32;
+		match->tags = (struct release_tag_struct *) xrealloc(match->tags, match->nalloc * sizeof(struct release_tag_struct));
+	}
+	tag = &(match->tags[match->ntags]);
+	git_oid_cpy(&(tag->commit), commit);
+	tag->index = match->ntags;
+	tag->version = arena_strdup(match->repo->arena, version);
+	match->ntags++;
+	git_object_free(peeled);
+	git_object_free(obj);
+	return 0;
+}
+
+static int
+release_commit_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&(((const struct release_tag_struct *) a)->commit), &(((const struct release_tag_struct *) b)->commit));
+}
+
+static int
+release_tag_cmp(const void *a, const void *b)
+{
+	const struct release_tag_struct *ta, *tb;
+	int r;
+
+	ta = (const struct release_tag_struct *) a;
+	tb = (const struct release_tag_struct *) b;
+	r = git_oid_cmp(&(ta->commit), &(tb->commit));
+	if(r)
+	{
+		return r;
+	}
+	return ta->index < tb->index ? -1 : ta->index > tb->index;
+}
+
+/* Collect the release tags and sort them by commit, so that each commit in a
+ * branch's history can be matched with a binary search; where several release
+ * tags point at the same commit, the first one found is used
+ */
+static void
+collect_release_tags(struct tag_match_struct *match)
+{
+	size_t c, n;
+	uint32_t generation;
+
+	refdb_foreach(match->refs, "refs/tags/", tag_callback, (void *) match);
+	qsort(match->tags, match->ntags, sizeof(struct release_tag_struct), release_tag_cmp);
+	match->mingen = GENERATION_INFINITY;
+	for(c = n = 0; c < match->ntags; c++)
+	{
+		if(n && !git_oid_cmp(&(match->tags[n - 1].commit), &(match->tags[c].commit)))
+		{
+			continue;
+		}
+		match->tags[n++] = match->tags[c];
+		generation = commit_generation(match->graph, &(match->tags[c].commit));
+		if(generation < match->mingen)
+		{
+			match->mingen = generation;
+		}
+	}
+	match->ntags = n;
+}
+
+/* Add a release for a commit in a branch's history if it has been tagged */
+static int
+release_commit_cb(const git_oid *oid, void *data)
+{
+	struct tag_match_struct *match;
+	struct release_tag_struct key, *tag;
+	git_commit *commit;
+	const git_signature *sig;
+	struct tm tm;
+
+	match = (struct tag_match_struct *) data;
+	git_oid_cpy(&(key.commit), oid);
+	tag = (struct release_tag_struct *) bsearch(&key, match->tags, match->ntags, sizeof(struct release_tag_struct), release_commit_cmp);
+	if(!tag)
 	{
 		return 0;
 	}
 	if(git_commit_lookup(&commit, match->repo->repo, oid))
 	{
-		fprintf(stderr, "%s: failed to locate commit for tag '%s'\n", match->repo->progname, tag_name);
-		return 1;
+		fprintf(stderr, "%s: failed to locate commit for release '%s'\n", match->repo->progname, tag->version);
+		return 0;
 	}
 	sig = git_commit_committer(commit);
-	gmgittime(&(sig->when), &tm, NULL, NULL, NULL);	
-	add_release(match->repo, match->branch_name, oid, version, &tm);
-	return 1;
+	gmgittime(&(sig->when), &tm, NULL, NULL, NULL);
+	add_release(match->repo, match->branch_name, oid, tag->version, &tm);
+	git_commit_free(commit);
+	return 0;
 }
 
-static int
-branch_callback(git_reference *ref, const char *branch_name, git_branch_t branch_type, void *data)
+/* Add the releases of a branch according to its tracking mode */
+static void
+track_branch(struct tag_match_struct *tagmatch, const char *branch_name, const git_oid *oid, const char *track)
 {
 	REPO *repo;
-	struct tag_match_struct tagmatch;
-	const char *cfgval, *t;
-	char *p;
-	const git_oid *oid;
-	git_oid oidbuf;
-	git_revwalk *walker;
-	
-	(void) branch_type;
 
-	repo = (REPO *) data;
-	git_branch_name(&branch_name, ref);
-	t = check_release_branch(branch_name);
-	if(!t)
+	repo = tagmatch->repo;
+	tagmatch->branch_name = branch_name;
+	if(!strcmp(track, "tip"))
 	{
-		fprintf(stderr, "%s: ignoring branch '%s' because its name is not valid for release-tracking\n", repo->progname, branch_name);
-		return 0;
+		/* Add the commit at the tip of the branch as a release */
+		add_release_tip(repo, branch_name, oid);
 	}
-	memset(&tagmatch, 0, sizeof(tagmatch));
-	tagmatch.repo = repo;
-	tagmatch.branch_name = t;
-	p = alloca(strlen(t) + 32);
-	strcpy(p, "release-branch.");
-	strcat(p, t);
-	strcat(p, ".track");
-	cfgval = NULL;
-	git_config_get_string(&cfgval, repo->cfg, p);
-	if(cfgval)
-	{
-		if(!strcmp(cfgval, "tip"))
+	else if(!strcmp(track, "tag"))
+	{
+		/* Walk the history of the branch, matching commits with tags which
+		 * look like releases. Nothing older than the oldest release tag
+		 * can match, so (given a commit graph) the walk stops there.
+		 */
+		if(tagmatch->ntags)
 		{
-			/* Add the commit at the tip of the branch as a release */
-			oid = git_reference_target(ref);
-			if(oid)
-			{
-				add_release_tip(repo, t, oid);
-			}
+			commit_graph_walk(tagmatch->graph, repo->repo, oid, tagmatch->mingen, release_commit_cb, (void *) tagmatch);
 		}
-		else if(!strcmp(cfgval, "tag"))
+	}
+	else
+	{
+		fprintf(stderr, "%s: warning: tracking mode '%s' (for branch '%s') is not supported\n", repo->progname, track, branch_name);
+	}
+}
+
+/* Record a setting from a release-branch section */
+static int
+release_config_cb(const git_config_entry *entry, void *data)
+{
+	struct release_config_struct *config;
+	struct release_branch_struct *branch;
+	const char *sub, *key;
+
+	config = (struct release_config_struct *) data;
+	/* The name has the form release-branch.<branch>.<key> */
+	sub = strchr(entry->name, '.') + 1;
+	key = strrchr(entry->name, '.');
+	if(key < sub || strcmp(key + 1, "track") || !entry->value)
+	{
+		return 0;
+	}
+	if(config->nbranches == config->nalloc)
+	{
+		config->nalloc = config->nalloc ? config->nalloc * 2 : 16;
+		config->branches = (struct release_branch_struct *) xrealloc(config->branches, config->nalloc * sizeof(struct release_branch_struct));
+	}
+	branch = &(config->branches[config->nbranches]);
+	branch->name = (char *) arena_alloc(config->arena, key - sub + 1);
+	memcpy(branch->name, sub, key - sub);
+	branch->track = arena_strdup(config->arena, entry->value);
+	branch->index = config->nbranches;
+	config->nbranches++;
+	return 0;
+}
+
+static int
+release_branch_cmp(const void *a, const void *b)
+{
+	const struct release_branch_struct *ba, *bb;
+	int r;
+
+	ba = (const struct release_branch_struct *) a;
+	bb = (const struct release_branch_struct *) b;
+	r = strcmp(ba->name, bb->name);
+	if(r)
+	{
+		return r;
+	}
+	return ba->index < bb->index ? -1 : ba->index > bb->index;
+}
+
+/* Read the settings of every release-tracked branch, sorted by name; where a
+ * setting is given more than once, the last one (which is the one with the
+ * highest priority) wins
+ */
+static int
+read_release_config(REPO *repo, struct release_config_struct *config)
+{
+	git_config *cfg;
+	size_t c, n;
+
+	memset(config, 0, sizeof(struct release_config_struct));
+	config->arena = repo->arena;
+	cfg = repo_config(repo);
+	if(!cfg)
+	{
+		return -1;
+	}
+	git_config_foreach_match(cfg, "^release-branch\\.", release_config_cb, (void *) config);
+	qsort(config->branches, config->nbranches, sizeof(struct release_branch_struct), release_branch_cmp);
+	for(c = n = 0; c < config->nbranches; c++)
+	{
+		if(c + 1 < config->nbranches && !strcmp(config->branches[c].name, config->branches[c + 1].name))
 		{
-			/* Walk the history of the branch, matching commits with tags which
-			 * look like releases.
-			 */
-			oid = git_reference_target(ref);
-			git_oid_cpy(&oidbuf, oid);
-			git_revwalk_new(&walker, repo->repo);
-			git_revwalk_sorting(walker, GIT_SORT_TOPOLOGICAL);
-			git_revwalk_push(walker, &oidbuf);
-			while(!git_revwalk_next(&oidbuf, walker))
-			{
-				/* Now attempt to find a tag for the commit */
-				git_oid_cpy(&(tagmatch.oidmatch), &oidbuf);
-				git_tag_foreach(repo->repo, tag_callback, (void *) &tagmatch);
-			}
-			git_revwalk_free(walker);
+			continue;
 		}
-		else
+		config->branches[n++] = config->branches[c];
+	}
+	config->nbranches = n;
+	return 0;
+}
+
+/* Determine whether any branch's releases are tracked by tag */
+static int
+release_config_tags(const struct release_config_struct *config)
+{
+	size_t c;
+
+	for(c = 0; c < config->nbranches; c++)
+	{
+		if(!strcmp(config->branches[c].track, "tag"))
 		{
-			fprintf(stderr, "%s: warning: tracking mode '%s' (for branch '%s') is not supported\n", repo->progname, cfgval, t);
+			return 1;
 		}
 	}
 	return 0;
 }
 
+/* Track the releases of each configured branch which exists */
+static void
+track_branches(struct tag_match_struct *tagmatch, const struct release_config_struct *config)
+{
+	REPO *repo;
+	const struct release_branch_struct *branch;
+	char refname[64];
+	git_oid oid;
+	size_t c;
+
+	repo = tagmatch->repo;
+	for(c = 0; c < config->nbranches; c++)
+	{
+		branch = &(config->branches[c]);
+		if(!check_release_branch(branch->name))
+		{
+			fprintf(stderr, "%s: ignoring branch '%s' because its name is not valid for release-tracking\n", repo->progname, branch->name);
+			continue;
+		}
+		/* A valid branch name is no more than 32 characters long */
+		sprintf(refname, "refs/heads/%s", branch->name);
+		if(git_reference_name_to_id(&oid, repo->repo, refname))
+		{
+			continue;
+		}
+		track_branch(tagmatch, branch->name, &oid, branch->track);
+	}
+}
+
 static int
 build_release_cb(void *data, int ncols, char **values, char **columns)
 {
@@ -386,16 +623,15 @@ usage(const char *progname)
 }
 
 int
-main(int argc, char **argv)
+track_releases_main(int argc, char **argv)
 {
 	const char *path;
 	REPO *repo;
-	git_branch_iterator *branch_iter;
-	git_branch_t branch_type;
-	git_reference *ref;
 	int c;
 	char *err, *p;
 	struct hook_data_struct hook;
+	struct tag_match_struct tagmatch;
+	struct release_config_struct config;
 
 	path = NULL;
 	while((c = getopt(argc, argv, "h")) != -1)
@@ -439,12 +675,25 @@ main(int argc, char **argv)
 			 "  PRIMARY KEY (\"release\", \"branch\") "
 			 ")");
 	
-	git_branch_iterator_new(&branch_iter, repo->repo, GIT_BRANCH_LOCAL);
-	while(git_branch_next(&ref, &branch_type, branch_iter) == 0)
+	memset(&tagmatch, 0, sizeof(tagmatch));
+	tagmatch.repo = repo;
+	tagmatch.graph = commit_graph_open(repo->repo);
+	if(read_release_config(repo, &config))
 	{
-		branch_callback(ref, git_reference_name(ref), branch_type, (void *) repo);
+		repo_close(repo);
+		exit(EXIT_FAILURE);
+	}
+	/* The tags are only needed if some branch's releases are tagged */
+	if(release_config_tags(&config))
+	{
+		tagmatch.refs = refdb_open(repo->repo);
+		collect_release_tags(&tagmatch);
+		refdb_close(tagmatch.refs);
 	}
-	git_branch_iterator_free(branch_iter);
+	track_branches(&tagmatch, &config);
+	free(config.branches);
+	free(tagmatch.tags);
+	commit_graph_close(tagmatch.graph);
 
 	/* Iterate each of the releases and invoke the 'release' hook */
 	memset(&hook, 0, sizeof(hook));
@@ -471,7 +720,7 @@ main(int argc, char **argv)
 	if(!access(hook.path, R_OK|X_OK))
 	{
 		err = NULL;
-		if(sqlite3_exec(repo->db, "SELECT \"commit\", \"branch\", \"release\" FROM \"releases\" WHERE \"state\" = 'NEW'", build_release_cb, (void *) &hook, &err))
+		if(sqlite3_exec(repo_db(repo), "SELECT \"commit\", \"branch\", \"release\" FROM \"releases\" WHERE \"state\" = 'NEW'", build_release_cb, (void *) &hook, &err))
 		{
 			fprintf(stderr, "%s: %s\n", repo->progname, err);
 			exit(EXIT_FAILURE);
@@ -482,3 +731,11 @@ main(int argc, char **argv)
 	repo_close(repo);
 	return 0;
 }
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return track_releases_main(argc, argv);
+}
+#endif
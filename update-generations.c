@@ -0,0 +1,100 @@
+/* This is a utility, intended to be invoked in a post-receive hook (or
+ * periodically), which maintains the commit graph file used to cut off
+ * history walks early.
+ *
+ * The commit graph is stored as $GIT_DIR/commit-generations and records, for
+ * every commit reachable from the repository's references, the positions of
+ * its parents, its generation number and its commit time. See commit-graph.h
+ * for details.
+ *
+ * Updates are incremental: only the commits which are not already present
+ * in the graph are read from the object database, and the new graph is
+ * written alongside the old one before being renamed into place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "utils.h"
+#include "commit-graph.h"
+#include "multicall.h"
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [OPTIONS] [PATH-TO-REPO]\nHonours GIT_DIR if set. OPTIONS is one or more of:\n", progname);
+	fprintf(stderr,
+			"  -h            Print this usage message and exit\n"
+			"  -f            Rebuild the commit graph from scratch\n"
+			"  -v            Report the number of commits added\n");
+}
+
+int
+update_generations_main(int argc, char **argv)
+{
+	const char *path;
+	REPO *repo;
+	COMMIT_GRAPH *graph;
+	long added;
+	int c, rebuild, verbose;
+
+	path = NULL;
+	rebuild = 0;
+	verbose = 0;
+	while((c = getopt(argc, argv, "hfv")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'f':
+			rebuild = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(argc - optind > 1)
+	{
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if(argc - optind > 0)
+	{
+		path = argv[optind];
+	}
+	repo = repo_open(argv[0], path, SQLITE_OPEN_READONLY, 0);
+	if(!repo)
+	{
+		exit(EXIT_FAILURE);
+	}
+	added = commit_graph_update(repo, rebuild);
+	if(added < 0)
+	{
+		repo_close(repo);
+		exit(EXIT_FAILURE);
+	}
+	if(verbose)
+	{
+		graph = commit_graph_open(repo->repo);
+		fprintf(stderr, "%s: added %ld commits (%lu in total)\n", repo->progname, added, (unsigned long) commit_graph_count(graph));
+		commit_graph_close(graph);
+	}
+	repo_close(repo);
+	return 0;
+}
+
+#ifndef MULTICALL
+int
+main(int argc, char **argv)
+{
+	return update_generations_main(argc, argv);
+}
+#endif
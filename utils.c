@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "utils.h"
 
@@ -55,28 +56,210 @@ xrealloc(void *ptr, size_t newsize)
 	return newptr;
 }
 
-/* Open a repository, the configuration dictionary, and the releases database */
+/* The size of an arena's chunks: anything larger than a quarter of this is
+ * given a chunk of its own, which is freed (rather than kept) on reset
+ */
+#define ARENA_CHUNK                     65536
+#define ARENA_ALIGN                     16
+
+struct arena_chunk_struct
+{
+	struct arena_chunk_struct *next;
+	size_t size;
+	size_t used;
+};
+
+struct arena_struct
+{
+	/* The chunks in use, the first being the one currently being filled */
+	struct arena_chunk_struct *chunks;
+	/* Standard-sized chunks which have been released by a reset */
+	struct arena_chunk_struct *spare;
+};
+
+#define ARENA_HEADER                    ((sizeof(struct arena_chunk_struct) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/* Create an empty arena */
+ARENA *
+arena_create(void)
+{
+	return (ARENA *) xalloc(sizeof(ARENA));
+}
+
+/* Free an arena, and everything allocated from it */
+void
+arena_free(ARENA *arena)
+{
+	struct arena_chunk_struct *chunk, *next;
+
+	if(!arena)
+	{
+		return;
+	}
+	arena_reset(arena);
+	for(chunk = arena->spare; chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	free(arena);
+}
+
+/* Allocate zeroed memory from an arena */
+void *
+arena_alloc(ARENA *arena, size_t size)
+{
+	struct arena_chunk_struct *chunk;
+	char *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	chunk = arena->chunks;
+	if(chunk && chunk->size - chunk->used >= size)
+	{
+		p = (char *) chunk + ARENA_HEADER + chunk->used;
+		chunk->used += size;
+		memset(p, 0, size);
+		return p;
+	}
+	if(size > ARENA_CHUNK / 4)
+	{
+		/* A large allocation has a chunk to itself, placed behind the one
+		 * being filled so that the rest of that isn't wasted
+		 */
+		chunk = (struct arena_chunk_struct *) xalloc(ARENA_HEADER + size);
+		chunk->size = size;
+		chunk->used = size;
+		if(arena->chunks)
+		{
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		else
+		{
+			arena->chunks = chunk;
+		}
+		return (char *) chunk + ARENA_HEADER;
+	}
+	if(arena->spare)
+	{
+		chunk = arena->spare;
+		arena->spare = chunk->next;
+	}
+	else
+	{
+		chunk = (struct arena_chunk_struct *) xalloc(ARENA_HEADER + ARENA_CHUNK);
+		chunk->size = ARENA_CHUNK;
+	}
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	chunk->used = size;
+	p = (char *) chunk + ARENA_HEADER;
+	memset(p, 0, size);
+	return p;
+}
+
+/* Duplicate a string in an arena */
+char *
+arena_strdup(ARENA *arena, const char *src)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(src) + 1;
+	p = (char *) arena_alloc(arena, len);
+	memcpy(p, src, len);
+	return p;
+}
+
+/* Release everything allocated from an arena, keeping its memory for re-use */
+void
+arena_reset(ARENA *arena)
+{
+	struct arena_chunk_struct *chunk, *next;
+
+	for(chunk = arena->chunks; chunk; chunk = next)
+	{
+		next = chunk->next;
+		if(chunk->size != ARENA_CHUNK)
+		{
+			free(chunk);
+			continue;
+		}
+		chunk->used = 0;
+		chunk->next = arena->spare;
+		arena->spare = chunk;
+	}
+	arena->chunks = NULL;
+}
+
+/* The repository shared by repo_share(), if any */
+static REPO *shared_repo;
+
+/* Set a REPO's program name to the basename of progname */
+static void
+repo_set_progname(REPO *repo, const char *progname)
+{
+	const char *t;
+
+	free(repo->progname);
+	t = strrchr(progname, '/');
+	repo->progname = xstrdup(t ? t + 1 : progname);
+}
+
+/* Take another reference to the shared repository on behalf of a program,
+ * re-opening the database if it now needs to be writeable
+ */
+static REPO *
+repo_open_shared(const char *progname, int sqliteflags, int requiredb)
+{
+	REPO *repo;
+
+	repo = shared_repo;
+	repo_set_progname(repo, progname);
+	if(sqliteflags & ~repo->sqliteflags & (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE))
+	{
+		sqlite3_close(repo->db);
+		repo->db = NULL;
+		repo->loaded &= ~REPO_LOADED_DB;
+		repo->sqliteflags = sqliteflags;
+	}
+	repo->requiredb = requiredb;
+	if(requiredb && !repo->db)
+	{
+		/* An optional database may have been found not to exist before */
+		repo->loaded &= ~REPO_LOADED_DB;
+		if(!repo_db(repo))
+		{
+			return NULL;
+		}
+	}
+	repo->refs++;
+	return repo;
+}
+
+/* Open a repository; its configuration, name, release tag prefixes and
+ * releases database are loaded when they're first asked for, except that a
+ * required database is opened at once, so that its absence is reported
+ * before anything else is done
+ */
 REPO *
 repo_open(const char *progname, const char *repopath, int sqliteflags, int requiredb)
 {
 	REPO *repo;
-	const char *s, *t;
 	char *p;
 	const git_error *err;
-	int r;
 
-	repo = (REPO *) xalloc(sizeof(REPO));
-	/* Determine the basename for progname */
-	t = strrchr(progname, '/');
-	if(t)
-	{
-		t++;
-		repo->progname = xstrdup(t);
-	}
-	else
+	if(shared_repo && (!repopath || !strcmp(repopath, shared_repo->path)))
 	{
-		repo->progname = xstrdup(progname);
+		return repo_open_shared(progname, sqliteflags, requiredb);
 	}
+	repo = (REPO *) xalloc(sizeof(REPO));
+	repo->refs = 1;
+	repo->arena = arena_create();
+	repo->sqliteflags = sqliteflags;
+	repo->requiredb = requiredb;
+	/* Determine the basename for progname */
+	repo_set_progname(repo, progname);
 	/* If no repository path was specified, attempt to use $GIT_DIR */
 	if(!repopath)
 	{
@@ -123,17 +306,79 @@ repo_open(const char *progname, const char *repopath, int sqliteflags, int requi
 	}
 	strcat(repo->dbpath, "releases.sqlite3");
 
-	/* Open the configuration dictionary */
-	if(git_repository_config(&(repo->cfg), repo->repo))
+	if(requiredb && !repo_db(repo))
 	{
-		err = giterr_last();
-		fprintf(stderr, "%s: %s: %s\n", repo->progname, repo->path, err->message);
 		repo_close(repo);
 		return NULL;
 	}
+	return repo;
+}
+
+/* Obtain the repository's configuration, loading it if it hasn't been; returns
+ * NULL (having reported the reason) if it can't be loaded
+ */
+git_config *
+repo_config(REPO *repo)
+{
+	const git_error *err;
+
+	if(!(repo->loaded & REPO_LOADED_CONFIG))
+	{
+		repo->loaded |= REPO_LOADED_CONFIG;
+		if(git_repository_config(&(repo->cfg), repo->repo))
+		{
+			err = giterr_last();
+			fprintf(stderr, "%s: %s: %s\n", repo->progname, repo->path, err->message);
+			repo->cfg = NULL;
+		}
+	}
+	return repo->cfg;
+}
+
+/* Obtain the releases database, opening it if it hasn't been; returns NULL
+ * if it doesn't exist and isn't required, or (having reported the reason) if
+ * it can't be opened
+ */
+sqlite3 *
+repo_db(REPO *repo)
+{
+	int r;
 
-	/* Determine the repository's name */
-	if(!git_config_get_string(&t, repo->cfg, "package.name"))
+	if(!(repo->loaded & REPO_LOADED_DB))
+	{
+		repo->loaded |= REPO_LOADED_DB;
+		r = sqlite3_open_v2(repo->dbpath, &(repo->db), repo->sqliteflags, NULL);
+		if(r != SQLITE_OK)
+		{
+			if(repo->requiredb || r != SQLITE_CANTOPEN)
+			{
+				fprintf(stderr, "%s: %s: %s\n", repo->progname, repo->dbpath, sqlite3_errmsg(repo->db));
+			}
+			/* The database is optional */
+			sqlite3_close(repo->db);
+			repo->db = NULL;
+		}
+	}
+	return repo->db;
+}
+
+/* Obtain the name of the repository (or the package it contains), from the
+ * package.name configuration variable or, failing that, its path
+ */
+const char *
+repo_name(REPO *repo)
+{
+	git_config *cfg;
+	const char *repopath, *s, *t;
+	char *p;
+
+	if(repo->loaded & REPO_LOADED_NAME)
+	{
+		return repo->name;
+	}
+	repo->loaded |= REPO_LOADED_NAME;
+	cfg = repo_config(repo);
+	if(cfg && !git_config_get_string(&t, cfg, "package.name"))
 	{
 		repo->name = xstrdup(t);
 	}
@@ -173,22 +418,27 @@ repo_open(const char *progname, const char *repopath, int sqliteflags, int requi
 			}
 		}
 	}
+	return repo->name;
+}
 
-	/* Open the releases database */
-	r = sqlite3_open_v2(repo->dbpath, &(repo->db), sqliteflags, NULL);
-	if(r != SQLITE_OK)
+/* Obtain the compiled release tag prefixes, compiling them if they haven't
+ * been; returns NULL (having reported the reason) if they can't be
+ */
+const TAG_PATTERN *
+repo_tag_pattern(REPO *repo)
+{
+	git_config *cfg;
+
+	if(!(repo->loaded & REPO_LOADED_TAGS))
 	{
-		if(requiredb || r != SQLITE_CANTOPEN)
+		repo->loaded |= REPO_LOADED_TAGS;
+		cfg = repo_config(repo);
+		if(cfg)
 		{
-			fprintf(stderr, "%s: %s: %s\n", repo->progname, repo->dbpath, sqlite3_errmsg(repo->db));
-			repo_close(repo);
-			return NULL;
+			repo->tagpattern = tag_pattern_create(cfg, repo->progname);
 		}
-		/* The database is optional */
-		sqlite3_close(repo->db);
-		repo->db = NULL;
 	}
-	return repo;
+	return repo->tagpattern;
 }
 
 /* Close a repository, freeing resources */
@@ -200,6 +450,18 @@ repo_close(REPO *repo)
 		errno = EINVAL;
 		return -1;
 	}
+	if(--repo->refs > 0)
+	{
+		/* The repository is shared, and remains open; whatever the program
+		 * which has finished with it allocated from the arena is released
+		 */
+		arena_reset(repo->arena);
+		return 0;
+	}
+	if(repo == shared_repo)
+	{
+		shared_repo = NULL;
+	}
 	if(repo->pathbuf.ptr)
 	{
 		git_buf_free(&(repo->pathbuf) );
@@ -209,93 +471,144 @@ repo_close(REPO *repo)
 		free(repo->path);
 	}
 	sqlite3_close(repo->db);
+	git_config_free(repo->cfg);
+	git_repository_free(repo->repo);
 	free(repo->progname);
 	free(repo->dbpath);
 	free(repo->name);
+	tag_pattern_free(repo->tagpattern);
+	arena_free(repo->arena);
 	free(repo);   
 	return 0;
 }
 
-/* Check if a given tag name is a release tag, returning a pointer to the
- * start of the version number if so, or NULL if not
+/* Share an open repository (or stop sharing one, if repo is NULL): until it's
+ * closed, repo_open() returns another reference to it, rather than opening
+ * the same repository again, to any program which doesn't name a different
+ * one
+ */
+void
+repo_share(REPO *repo)
+{
+	shared_repo = repo;
+}
+
+/* Check if a given tag name is a release tag, according to the repository's
+ * release.tagPattern settings, returning a pointer to the start of the
+ * version number if so, or NULL if not
  */
 const char *
-check_release_tag(const char *tag_name)
+check_release_tag(REPO *repo, const char *tag_name)
 {
-	const char *t;
+	const TAG_PATTERN *pattern;
 
-	if(!strncmp(tag_name, "refs/tags/", 10))
-	{
-		tag_name += 10;
-	}
-	if(tolower(tag_name[0]) == 'v' || tolower(tag_name[0]) == 'r')
-	{
-		tag_name++;
-	}
-	else if(!strncmp(tag_name, "debian/", 7))
-	{
-		tag_name += 7;
-	}
-	else if(!strncmp(tag_name, "release/", 8))
-	{
-		tag_name += 8;
-	}
-	if(!tag_name[0])
-	{
-		return NULL;
-	}
-	/* Check that the remainder of the tag looks something
-	 * like a version number: this means that it must consist
-	 * of a string which begins with '999.9', where '999' is
-	 * any number of digits.
-	 */
-	t = tag_name;
-	while(*t && isdigit(*t))
-	{
-		t++;
-	}
-	if(*t != '.')
+	pattern = repo_tag_pattern(repo);
+	if(!pattern)
 	{
 		return NULL;
 	}
-	t++;
-	if(!isdigit(*t))
-	{
-		return NULL;
-	}	
-	/* Check that the tag contains only characters that we consider
-	 * valid.
-	 */
-	for(; *t; t++)
+	return tag_pattern_match(pattern, tag_name);
+}
+
+/* Build the sort key for a version number, returning its length: comparing
+ * two keys with memcmp() (the shorter sorting first where one is a prefix of
+ * the other) orders the versions as Debian does
+ *
+ * A version is compared as alternating runs of non-digits and digits. Within
+ * a run of non-digits, '~' sorts before anything (even the end of the run),
+ * and letters sort before everything else; runs of digits are compared as
+ * numbers. So, each non-digit becomes a byte which sorts accordingly, with
+ * 0x02 marking the end of the run; each run of digits becomes one more than
+ * its length (without leading zeroes) followed by its digits, so that longer
+ * numbers sort after shorter ones and no key contains a zero byte. The end
+ * of the version is encoded as the zero and empty run of non-digits which it
+ * is equivalent to, so that "1.0~rc1" sorts before "1.0" and "1.", which sort
+ * before "1.0a".
+ */
+size_t
+version_key(const char *version, unsigned char *key, size_t size)
+{
+	const unsigned char *p, *start;
+	size_t len, n;
+	int zero;
+
+	p = (const unsigned char *) version;
+	len = 0;
+	zero = 0;
+	for(;;)
 	{
-		if(!isalnum(*t) && *t != '-' && *t != '_' && *t != '.' && *t != '~' && *t != '@')
+		for(start = p; *p && !isdigit(*p) && len < size; p++)
 		{
-			return NULL;
+			if(*p == '~')
+			{
+				key[len++] = 0x01;
+			}
+			else if(isalpha(*p))
+			{
+				key[len++] = *p;
+			}
+			else
+			{
+				key[len++] = 0x80 | *p;
+			}
+		}
+		if(len < size)
+		{
+			key[len++] = 0x02;
+		}
+		if(!*p || len >= size)
+		{
+			break;
 		}
+		while(*p == '0')
+		{
+			p++;
+		}
+		for(start = p; isdigit(*p); p++);
+		n = p - start;
+		if(n >= 0xff || len + n + 1 > size)
+		{
+			break;
+		}
+		key[len++] = n + 1;
+		memcpy(key + len, start, n);
+		len += n;
+		zero = !n;
 	}
-	if(strlen(tag_name) > 32)
+	/* The end of a version compares as a zero followed by an empty run of
+	 * non-digits, so make it so unless the version already ends that way
+	 */
+	if((!zero || p != start) && len + 2 <= size)
 	{
-		return NULL;
+		key[len++] = 0x01;
+		key[len++] = 0x02;
 	}
-	return tag_name;
+	return len;
 }
 
 /* Check the name of a branch to ensure it's something we consider valid
  * as a release-tracking branch name
  */
+static int
+is_branch_char(int c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_';
+}
+
 const char *
 check_release_branch(const char *branch_name)
 {
-	const char *t;
+	static NAME_CLASS branch_class;
+	static int initialised;
+	size_t len;
 
-	for(t = branch_name; *t; t++)
+	if(!initialised)
 	{
-		if(!isalnum(*t) && *t != '-' && *t != '_')
-		{
-			return NULL;
-		}
+		name_class_init(&branch_class, is_branch_char);
+		initialised = 1;
 	}
-	if(strlen(branch_name) > 32)
+	len = name_class_span(&branch_class, branch_name);
+	if(branch_name[len] || len > 32)
 	{
 		return NULL;
 	}
@@ -397,3 +710,54 @@ spawn(const char *pathname, char *const *argv)
 	/* Something... else... happened to the child; spooky. */
 	return -1;
 }
+
+/* Return the number of processors available to run threads on */
+int
+nprocessors(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+	{
+		return 1;
+	}
+	return (int) n;
+}
+
+/* Run a function on a number of threads at once, waiting for them all to
+ * complete
+ */
+int
+run_threads(int nthreads, void *(*fn)(void *data), void *data)
+{
+	pthread_t *threads;
+	int c, started, r;
+
+	if(nthreads <= 1)
+	{
+		fn(data);
+		return 0;
+	}
+	threads = (pthread_t *) xalloc(nthreads * sizeof(pthread_t));
+	for(started = 0; started < nthreads; started++)
+	{
+		r = pthread_create(&(threads[started]), NULL, fn, data);
+		if(r)
+		{
+			fprintf(stderr, "failed to create thread: %s\n", strerror(r));
+			break;
+		}
+	}
+	if(!started)
+	{
+		/* Fall back to doing the work on the calling thread */
+		fn(data);
+	}
+	for(c = 0; c < started; c++)
+	{
+		pthread_join(threads[c], NULL);
+	}
+	free(threads);
+	return 0;
+}
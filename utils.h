@@ -7,26 +7,69 @@
 # include <git2.h>
 # include <sqlite3.h>
 
+# include "tag-pattern.h"
+# include "name-class.h"
+
+/* The largest sort key built by version_key() for a release tag's version */
+# define VERSION_KEY_MAX                96
+
 typedef struct repo_struct REPO;
 
+/* The parts of a REPO which are loaded on demand, recorded (in loaded) once
+ * an attempt to load them has been made, whether or not it succeeded
+ */
+# define REPO_LOADED_CONFIG             (1<<0)
+# define REPO_LOADED_DB                 (1<<1)
+# define REPO_LOADED_NAME               (1<<2)
+# define REPO_LOADED_TAGS               (1<<3)
+
+/* An arena hands out memory for things which all become unwanted at the
+ * same time (everything to do with one run, or one branch) by advancing a
+ * pointer through large chunks, and releases it all at once when it's reset;
+ * the chunks are kept for re-use, so a long-running process settles down to
+ * allocating nothing at all. Memory from an arena is zeroed, as with xalloc(),
+ * and must not be passed to free(). An arena mustn't be shared between
+ * threads.
+ */
+typedef struct arena_struct ARENA;
+
 struct repo_struct
 {
 	/* The program name, for error messages */
 	char *progname;
 	/* The libgit2 repository object */
 	git_repository *repo;
-	/* The libgit2 configuration dictionary */
+	/* The libgit2 configuration dictionary (see repo_config()) */
 	git_config *cfg;
 	/* The path to the repository */
 	char *path;
-	/* The name of the repository (or the package it contains) */
+	/* The name of the repository (or the package it contains; see
+	 * repo_name())
+	 */
 	char *name;
 	/* The buffer to hold a discovered repository path */
 	git_buf pathbuf;
 	/* The path to the SQLite3 database */
 	char *dbpath;
-	/* The SQLite3 database object */
+	/* The SQLite3 database object (see repo_db()), the flags it's opened
+	 * with, and whether it must exist
+	 */
 	sqlite3 *db;
+	int sqliteflags;
+	int requiredb;
+	/* The compiled release tag prefixes (see repo_tag_pattern()) */
+	TAG_PATTERN *tagpattern;
+	/* Which of the above have been loaded */
+	unsigned loaded;
+	/* The number of references to the repository (see repo_share()) */
+	int refs;
+	/* An arena for allocations which last no longer than the repository
+	 * remains open (or until the arena is reset). The arena is reset each
+	 * time a program sharing the repository closes it (see repo_share()),
+	 * so the name and database path, which are kept for as long as the
+	 * repository itself, are allocated separately
+	 */
+	ARENA *arena;
 };	
 
 /* Allocate a buffer, aborting if allocation fails */
@@ -36,24 +79,74 @@ char *xstrdup(const char *src);
 /* Re-allocate a buffer, aborting if re-allocation fails */
 void *xrealloc(void *ptr, size_t newsize);
 
-/* Open a repository, the configuration dictionary, and the releases database */
+/* Create an empty arena */
+ARENA *arena_create(void);
+/* Free an arena, and everything allocated from it */
+void arena_free(ARENA *arena);
+/* Allocate zeroed memory from an arena */
+void *arena_alloc(ARENA *arena, size_t size);
+/* Duplicate a string in an arena */
+char *arena_strdup(ARENA *arena, const char *src);
+/* Release everything allocated from an arena, keeping its memory for re-use */
+void arena_reset(ARENA *arena);
+
+/* Open a repository; its configuration, name, release tag prefixes and
+ * releases database are loaded when they're first asked for, except that a
+ * required database is opened at once, so that its absence is reported
+ * before anything else is done
+ */
 REPO *repo_open(const char *progname, const char *repopath, int sqliteflags, int requiredb);
+/* Obtain the repository's configuration, loading it if it hasn't been; returns
+ * NULL (having reported the reason) if it can't be loaded
+ */
+git_config *repo_config(REPO *repo);
+/* Obtain the releases database, opening it if it hasn't been; returns NULL
+ * if it doesn't exist and isn't required, or (having reported the reason) if
+ * it can't be opened
+ */
+sqlite3 *repo_db(REPO *repo);
+/* Obtain the name of the repository (or the package it contains), from the
+ * package.name configuration variable or, failing that, its path
+ */
+const char *repo_name(REPO *repo);
+/* Obtain the compiled release tag prefixes, compiling them if they haven't
+ * been; returns NULL (having reported the reason) if they can't be
+ */
+const TAG_PATTERN *repo_tag_pattern(REPO *repo);
 /* Close a repository, freeing resources */
 int repo_close(REPO *repo);
+/* Share an open repository (or stop sharing one, if repo is NULL): until it's
+ * closed, repo_open() returns another reference to it, rather than opening
+ * the same repository again, to any program which doesn't name a different
+ * one
+ */
+void repo_share(REPO *repo);
 
-/* Check if a given tag name is a release tag, returning a pointer to the
- * start of the version number if so, or NULL if not
+/* Check if a given tag name is a release tag, according to the repository's
+ * release.tagPattern settings, returning a pointer to the start of the
+ * version number if so, or NULL if not
  */
-const char *check_release_tag(const char *tag_name);
+const char *check_release_tag(REPO *repo, const char *tag_name);
 /* Check the name of a branch to ensure it's something we consider valid
  * as a release-tracking branch name
  */
 const char *check_release_branch(const char *branch_name);
+/* Build the sort key for a version number, returning its length: comparing
+ * two keys with memcmp() (the shorter sorting first where one is a prefix of
+ * the other) orders the versions as Debian does
+ */
+size_t version_key(const char *version, unsigned char *key, size_t size);
 /* Convert a git_time to a UTC struct tm and accompanying hours/minutes
  * offset and sign
  */
 int gmgittime(const git_time *time, struct tm *tm, int *hours, int *minutes, char *signptr);
 /* Spawn a process with sensible defaults and wait for it to complete */
 int spawn(const char *pathname, char *const *argv);
+/* Return the number of processors available to run threads on */
+int nprocessors(void);
+/* Run a function on a number of threads at once, waiting for them all to
+ * complete
+ */
+int run_threads(int nthreads, void *(*fn)(void *data), void *data);
 
 #endif /*!UTILS_H_*/